@@ -0,0 +1,380 @@
+#include "copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (1 << 20)
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++g_failures; \
+  } \
+} while(0)
+
+static char g_root[] = "/tmp/copy-test.XXXXXX";
+static char g_src[64], g_dst[64];
+
+static char * buffer(size_t *size) {
+  static char *buf;
+
+  if(!buf && posix_memalign((void **) &buf, COPY_DIRECT_ALIGN, BUFFER_SIZE)) {
+    perror(NULL);
+    exit(1);
+  }
+  *size = BUFFER_SIZE;
+  return buf;
+}
+
+static void fill(char *buf, size_t len, uint64_t seed) {
+  size_t i;
+
+  for(i = 0; i < len; ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    buf[i] = (char) seed;
+  }
+}
+
+static void write_file(const char *path, const char *data, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || write(fd, data, len) != (ssize_t) len) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+}
+
+/// non-zero if path holds exactly len bytes of data
+static int same_file(const char *path, const char *data, size_t len) {
+  char *buf = malloc(len + 1);
+  ssize_t n;
+  int fd, same;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1 || !buf) {
+    perror(path);
+    exit(1);
+  }
+  n = pread(fd, buf, len + 1, 0);
+  same = n == (ssize_t) len && memcmp(buf, data, len) == 0;
+  close(fd);
+  free(buf);
+  return same;
+}
+
+/// copy g_src over dst and truncate it to the source's length, as mtsync does
+static int copy_to(const char *dst, enum copy_method method, int flags, struct copy_result *result) {
+  int src_fd, dst_fd, rc, saved_errno;
+
+  src_fd = open(g_src, O_RDONLY);
+  dst_fd = open(dst, O_RDWR | O_CREAT, 0644);
+  if(src_fd == -1 || dst_fd == -1) {
+    perror(src_fd == -1 ? g_src : dst);
+    exit(1);
+  }
+  rc = copy_data(src_fd, dst_fd, method, flags, buffer, result);
+  if(rc == 0 && ftruncate(dst_fd, result->length)) rc = -1;
+  saved_errno = errno;
+  close(dst_fd);
+  close(src_fd);
+  errno = saved_errno;
+  return rc;
+}
+
+static int copy(enum copy_method method, int flags, struct copy_result *result) {
+  return copy_to(g_dst, method, flags, result);
+}
+
+/*
+ * Each method given explicitly copies the whole file itself, and COPY_AUTO
+ * with COPY_DIRECT copies with read() and write(), including the partial
+ * block at the end.
+ */
+static void test_methods(void) {
+  static const enum copy_method methods[] = {
+    COPY_AUTO, COPY_FILE_RANGE, COPY_SENDFILE, COPY_READ_WRITE
+  };
+  size_t len = 3 * BUFFER_SIZE + 123, i;
+  char *data = malloc(len);
+  struct copy_result r;
+
+  fill(data, len, 3);
+  write_file(g_src, data, len);
+  for(i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i) {
+    unlink(g_dst);
+    CHECK(copy(methods[i], 0, &r) == 0);
+    CHECK(r.length == (off_t) len);
+    if(methods[i] != COPY_AUTO) CHECK(r.method == methods[i]);
+    if(r.method != COPY_CLONE) CHECK(r.copied == (off_t) len);
+    CHECK(same_file(g_dst, data, len));
+  }
+
+  unlink(g_dst);
+  CHECK(copy(COPY_AUTO, COPY_DIRECT, &r) == 0);
+  CHECK(r.method == COPY_READ_WRITE);
+  CHECK(r.copied == (off_t) len);
+  CHECK(same_file(g_dst, data, len));
+  free(data);
+}
+
+/*
+ * Where a method fails, COPY_AUTO goes on with the next: cloning fails on
+ * file systems that cannot share extents and across file systems, and so
+ * does copy_file_range() on most.  A method given explicitly reports its
+ * failure instead.
+ */
+static void test_fallback(void) {
+  char shm[] = "/dev/shm/copy-test.XXXXXX", dst[64];
+  size_t len = BUFFER_SIZE + 4321;
+  char *data = malloc(len);
+  struct copy_result r;
+  int rc;
+
+  fill(data, len, 4);
+  write_file(g_src, data, len);
+  unlink(g_dst);
+  rc = copy(COPY_CLONE, 0, &r);
+  if(rc) {
+    CHECK(r.method == COPY_CLONE);
+    unlink(g_dst);
+    CHECK(copy(COPY_AUTO, 0, &r) == 0);
+    CHECK(r.method != COPY_CLONE);
+    CHECK(r.copied == (off_t) len);
+    CHECK(same_file(g_dst, data, len));
+  }
+
+  // another file system, if there is one to hand
+  if(!mkdtemp(shm)) {
+    free(data);
+    return;
+  }
+  snprintf(dst, sizeof(dst), "%s/dst", shm);
+  rc = copy_to(dst, COPY_FILE_RANGE, 0, &r);
+  unlink(dst);
+  CHECK(copy_to(dst, COPY_AUTO, 0, &r) == 0);
+  CHECK(r.method != COPY_CLONE);
+  if(rc) CHECK(r.method != COPY_FILE_RANGE);
+  CHECK(r.copied == (off_t) len);
+  CHECK(same_file(dst, data, len));
+  unlink(dst);
+  rmdir(shm);
+  free(data);
+}
+
+/*
+ * A 2 MB file with one byte changed has just the block holding it
+ * rewritten, however many blocks share a buffer with it.
+ */
+static void test_delta_one_byte(void) {
+  size_t len = 2 << 20;
+  char *data = malloc(len);
+  struct copy_result r;
+
+  fill(data, len, 1);
+  write_file(g_dst, data, len);
+  data[len / 2 + 12345] ^= 0xFF;
+  write_file(g_src, data, len);
+
+  CHECK(copy(COPY_DELTA, 0, &r) == 0);
+  CHECK(r.method == COPY_DELTA);
+  CHECK(r.copied == COPY_DELTA_BLOCK);
+  CHECK(r.same == (off_t) len - COPY_DELTA_BLOCK);
+  CHECK(same_file(g_dst, data, len));
+
+  // nothing left to write
+  CHECK(copy(COPY_DELTA, 0, &r) == 0);
+  CHECK(r.copied == 0);
+  CHECK(r.same == (off_t) len);
+  free(data);
+}
+
+/*
+ * What lies past the end of the old dst is copied as usual, and a longer
+ * dst is cut to the length of src.
+ */
+static void test_delta_resize(void) {
+  size_t len = 3 * COPY_DELTA_BLOCK + 100;
+  char *data = malloc(len);
+  struct copy_result r;
+
+  fill(data, len, 2);
+  write_file(g_dst, data, COPY_DELTA_BLOCK + 7);
+  write_file(g_src, data, len);
+  CHECK(copy(COPY_DELTA, 0, &r) == 0);
+  CHECK(r.same == COPY_DELTA_BLOCK + 7);
+  CHECK(r.copied == (off_t) len - COPY_DELTA_BLOCK - 7);
+  CHECK(same_file(g_dst, data, len));
+
+  write_file(g_src, data, COPY_DELTA_BLOCK / 2);
+  CHECK(copy(COPY_DELTA, 0, &r) == 0);
+  CHECK(r.copied == 0);
+  CHECK(r.same == COPY_DELTA_BLOCK / 2);
+  CHECK(same_file(g_dst, data, COPY_DELTA_BLOCK / 2));
+  free(data);
+}
+
+#define SPARSE_SIZE (8 << 20)
+
+/*
+ * An 8 MB file with data at 1 MB, 5 MB and in its last block, and holes
+ * everywhere else; returns its contents.
+ */
+static char * make_sparse(void) {
+  static const off_t offsets[] = { 1 << 20, 5 << 20, SPARSE_SIZE - 10 };
+  static const size_t lengths[] = { 100 << 10, 64 << 10, 10 };
+  char *data = calloc(1, SPARSE_SIZE);
+  size_t i;
+  int fd;
+
+  fd = open(g_src, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || !data) {
+    perror(g_src);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+    fill(data + offsets[i], lengths[i], 5 + i);
+    if(pwrite(fd, data + offsets[i], lengths[i], offsets[i]) != (ssize_t) lengths[i]) {
+      perror(g_src);
+      exit(1);
+    }
+  }
+  close(fd);
+  return data;
+}
+
+static blkcnt_t blocks(const char *path) {
+  struct stat st;
+
+  if(stat(path, &st)) {
+    perror(path);
+    exit(1);
+  }
+  return st.st_blocks;
+}
+
+/*
+ * A sparse file is copied as data and holes, into a new file and over an
+ * old one full of data, which has its old data punched out of the holes.
+ */
+static void test_sparse(void) {
+  char *data = make_sparse(), *old = malloc(SPARSE_SIZE);
+  struct copy_result r;
+  struct stat st;
+
+  CHECK(stat(g_src, &st) == 0);
+  CHECK(copy_is_sparse(&st));
+  if(!copy_is_sparse(&st)) {
+    // the file system has no holes to test with
+    free(data);
+    free(old);
+    return;
+  }
+
+  unlink(g_dst);
+  CHECK(copy(COPY_AUTO, 0, &r) == 0);
+  CHECK(r.length == SPARSE_SIZE);
+  CHECK(r.holes > 0);
+  CHECK(r.copied + r.holes == SPARSE_SIZE);
+  CHECK(same_file(g_dst, data, SPARSE_SIZE));
+  CHECK(blocks(g_dst) <= blocks(g_src));
+
+  fill(old, SPARSE_SIZE, 9);
+  write_file(g_dst, old, SPARSE_SIZE);
+  CHECK(copy(COPY_AUTO, COPY_PREALLOCATE, &r) == 0);
+  CHECK(r.copied + r.holes == SPARSE_SIZE);
+  CHECK(same_file(g_dst, data, SPARSE_SIZE));
+  CHECK(blocks(g_dst) <= blocks(g_src));
+  free(old);
+  free(data);
+}
+
+/*
+ * Copying a file in chunks, each with its own descriptors and in any order,
+ * as mtsync's chunk threads do, gives the same file as copying it whole.
+ */
+static void copy_chunked(off_t size, off_t chunk, int flags, struct copy_result *result) {
+  struct stat src_st, dst_st;
+  struct copy_result part;
+  off_t offset, end, first;
+  int src_fd, dst_fd;
+
+  memset(result, 0, sizeof(*result));
+  src_fd = open(g_src, O_RDONLY);
+  dst_fd = open(g_dst, O_RDWR | O_CREAT, 0644);
+  CHECK(fstat(src_fd, &src_st) == 0 && fstat(dst_fd, &dst_st) == 0);
+  close(src_fd);
+  close(dst_fd);
+  if(copy_is_sparse(&src_st)) flags |= COPY_SPARSE;
+  // odd chunks first, then even ones
+  for(first = 1; first >= 0; --first) {
+    for(offset = first * chunk; offset < size; offset += 2 * chunk) {
+      end = offset + chunk < size ? offset + chunk : size;
+      src_fd = open(g_src, O_RDONLY);
+      dst_fd = open(g_dst, O_RDWR);
+      memset(&part, 0, sizeof(part));
+      CHECK(copy_data_range(src_fd, dst_fd, COPY_AUTO, flags, buffer, offset, end, dst_st.st_size, &part) == 0);
+      result->copied += part.copied;
+      result->holes += part.holes;
+      close(dst_fd);
+      close(src_fd);
+    }
+  }
+  CHECK(truncate(g_dst, size) == 0);
+}
+
+static void test_chunked(void) {
+  size_t len = 5 * BUFFER_SIZE + 777;
+  char *data = malloc(len);
+  struct copy_result r;
+
+  fill(data, len, 6);
+  write_file(g_src, data, len);
+  unlink(g_dst);
+  copy_chunked(len, 1536 << 10, COPY_PREALLOCATE, &r);
+  CHECK(r.copied == (off_t) len);
+  CHECK(same_file(g_dst, data, len));
+  free(data);
+
+  data = make_sparse();
+  unlink(g_dst);
+  copy_chunked(SPARSE_SIZE, 3 << 20, COPY_PREALLOCATE, &r);
+  CHECK(r.copied + r.holes == SPARSE_SIZE);
+  CHECK(same_file(g_dst, data, SPARSE_SIZE));
+  CHECK(blocks(g_dst) <= blocks(g_src));
+  free(data);
+}
+
+int main(int argc, char **argv) {
+  if(!mkdtemp(g_root)) {
+    perror(g_root);
+    return 1;
+  }
+  snprintf(g_src, sizeof(g_src), "%s/src", g_root);
+  snprintf(g_dst, sizeof(g_dst), "%s/dst", g_root);
+
+  test_methods();
+  test_fallback();
+  test_sparse();
+  test_chunked();
+  test_delta_one_byte();
+  test_delta_resize();
+
+  unlink(g_src);
+  unlink(g_dst);
+  rmdir(g_root);
+  if(g_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], g_failures);
+    return 1;
+  }
+  printf("%s: ok\n", argv[0]);
+  return 0;
+}
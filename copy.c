@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+/// most bytes asked of one copy_file_range() or sendfile() call
+#define COPY_CHUNK (1 << 30)
+
+static const char *copy_method_names[] = {
+  "auto",
+  "clone",
+  "copy_file_range",
+  "sendfile",
+  "read_write",
+  "delta"
+};
+
+int copy_method_parse(const char *name, enum copy_method *method) {
+  int i;
+
+  for(i = 0; i < sizeof(copy_method_names) / sizeof(copy_method_names[0]); ++i) {
+    if(strcmp(name, copy_method_names[i]) == 0) {
+#ifndef FICLONE
+      if(i == COPY_CLONE) return ENOSYS;
+#endif
+#ifndef __linux__
+      if(i == COPY_FILE_RANGE || i == COPY_SENDFILE) return ENOSYS;
+#endif
+      *method = i;
+      return 0;
+    }
+  }
+  return EINVAL;
+}
+
+const char * copy_method_name(enum copy_method method) {
+  return copy_method_names[method];
+}
+
+#ifdef __linux__
+/**
+ * Copy with copy_file_range() or sendfile() from *offset until end, or the
+ * end of the file if that comes first.  *offset is moved past what was
+ * copied, so that another method can take over where this one stopped.
+ */
+static int copy_in_kernel(int src_fd, int dst_fd, enum copy_method method, off_t *offset, off_t end) {
+  off_t out;
+  ssize_t n;
+
+  while(*offset < end) {
+    size_t len = end - *offset < COPY_CHUNK ? end - *offset : COPY_CHUNK;
+    if(method == COPY_FILE_RANGE) {
+      out = *offset;
+      n = copy_file_range(src_fd, offset, dst_fd, &out, len, 0);
+    } else {
+      if(lseek(dst_fd, *offset, SEEK_SET) == -1) return -1;
+      n = sendfile(dst_fd, src_fd, offset, len);
+    }
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    if(n == 0) break;
+  }
+  return 0;
+}
+#endif
+
+static int copy_read_write(int src_fd, int dst_fd, char * (*buffer)(size_t *size), off_t *offset, off_t end, struct copy_result *result) {
+  ssize_t a, b, c;
+  size_t size;
+  char *buf;
+
+  buf = (*buffer)(&size);
+  while(*offset < end) {
+    a = pread(src_fd, buf, end - *offset < size ? end - *offset : size, *offset);
+    if(a == -1) {
+      if(errno == EINTR) continue;
+      result->read_error = 1;
+      return -1;
+    } else if(a == 0) {
+      // end of file
+      break;
+    }
+    c = 0;
+    do {
+      b = pwrite(dst_fd, buf + c, a - c, *offset + c);
+      if(b == -1) {
+        if(errno == EINTR) continue;
+        return -1;
+      }
+      c += b;
+    } while(c < a);
+    *offset += a;
+  }
+  return 0;
+}
+
+#ifdef O_DIRECT
+/// set or clear O_DIRECT on fd
+static int copy_set_direct(int fd, int on) {
+  int fl = fcntl(fd, F_GETFL);
+
+  if(fl == -1) return -1;
+  return fcntl(fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT);
+}
+
+/**
+ * Copy from *offset until end with O_DIRECT reads and writes of whole
+ * COPY_DIRECT_ALIGN blocks, bypassing the page cache.  Stops at what is
+ * left of a partial block at the end, or at once where the buffer or offset
+ * is not aligned or the file system will not do direct I/O, leaving *offset
+ * for copy_read_write() to finish through the page cache.
+ */
+static int copy_direct(int src_fd, int dst_fd, char * (*buffer)(size_t *size), off_t *offset, off_t end, struct copy_result *result) {
+  ssize_t a, b, c;
+  size_t size, n;
+  char *buf;
+  int rc = 0;
+
+  buf = (*buffer)(&size);
+  size -= size % COPY_DIRECT_ALIGN;
+  if(!size || (uintptr_t) buf % COPY_DIRECT_ALIGN || *offset % COPY_DIRECT_ALIGN) return 0;
+  // EINVAL where the file system has no direct I/O
+  if(copy_set_direct(src_fd, 1)) return 0;
+  if(copy_set_direct(dst_fd, 1)) goto out;
+  while(end - *offset >= COPY_DIRECT_ALIGN) {
+    n = end - *offset < size ? end - *offset : size;
+    n -= n % COPY_DIRECT_ALIGN;
+    a = pread(src_fd, buf, n, *offset);
+    if(a == -1) {
+      if(errno == EINTR) continue;
+      // EINVAL if the device needs a larger alignment
+      if(errno != EINVAL) {
+        result->read_error = 1;
+        rc = -1;
+      }
+      break;
+    }
+    // the partial block at the end of the file is left to copy_read_write()
+    a -= a % COPY_DIRECT_ALIGN;
+    if(a == 0) break;
+    c = 0;
+    do {
+      b = pwrite(dst_fd, buf + c, a - c, *offset + c);
+      if(b == -1) {
+        if(errno == EINTR) continue;
+        if(errno != EINVAL) rc = -1;
+        *offset += c;
+        goto out;
+      }
+      c += b;
+    } while(c < a);
+    *offset += a;
+  }
+out:
+  copy_set_direct(src_fd, 0);
+  copy_set_direct(dst_fd, 0);
+  return rc;
+}
+#endif
+
+/**
+ * Copy the bytes from offset to end with the first method that works, or
+ * only with the method given.  Stops early at the end of the file.
+ */
+static int copy_range(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  off_t offset,
+  off_t end,
+  struct copy_result *result
+) {
+  off_t start = offset;
+  int rc;
+
+#ifdef O_DIRECT
+  if((flags & COPY_DIRECT) && (method == COPY_AUTO || method == COPY_READ_WRITE)) {
+    result->method = COPY_READ_WRITE;
+    rc = copy_direct(src_fd, dst_fd, buffer, &offset, end, result);
+    if(rc) goto out;
+    goto read_write;
+  }
+#endif
+#ifdef __linux__
+  if(method == COPY_AUTO || method == COPY_FILE_RANGE) {
+    result->method = COPY_FILE_RANGE;
+    rc = copy_in_kernel(src_fd, dst_fd, COPY_FILE_RANGE, &offset, end);
+    if(rc == 0 || method != COPY_AUTO) goto out;
+  }
+  if(method == COPY_AUTO || method == COPY_SENDFILE) {
+    result->method = COPY_SENDFILE;
+    rc = copy_in_kernel(src_fd, dst_fd, COPY_SENDFILE, &offset, end);
+    if(rc == 0 || method != COPY_AUTO) goto out;
+  }
+#endif
+#ifdef O_DIRECT
+read_write:
+#endif
+  result->method = COPY_READ_WRITE;
+  rc = copy_read_write(src_fd, dst_fd, buffer, &offset, end, result);
+out:
+  result->copied += offset - start;
+  return rc;
+}
+
+/// allocate the blocks from offset to end of dst_fd, if the file system can
+static void copy_preallocate(int dst_fd, off_t offset, off_t end) {
+#ifdef FALLOC_FL_KEEP_SIZE
+  // failure only means the blocks are allocated as they are written
+  if(offset < end) fallocate(dst_fd, FALLOC_FL_KEEP_SIZE, offset, end - offset);
+#endif
+}
+
+/**
+ * Compare the bytes from *offset until end, or the end of either file, one
+ * half of the buffer for each file, and write only the blocks that differ.
+ */
+static int copy_delta(int src_fd, int dst_fd, char * (*buffer)(size_t *size), off_t *offset, off_t end, struct copy_result *result) {
+  ssize_t a, b, c, w, i, len;
+  size_t size;
+  char *src_buf, *dst_buf;
+
+  src_buf = (*buffer)(&size);
+  size /= 2;
+  dst_buf = src_buf + size;
+  result->method = COPY_DELTA;
+  while(*offset < end) {
+    a = pread(src_fd, src_buf, end - *offset < size ? end - *offset : size, *offset);
+    if(a == -1) {
+      if(errno == EINTR) continue;
+      result->read_error = 1;
+      return -1;
+    } else if(a == 0) {
+      // end of file
+      break;
+    }
+    do {
+      b = pread(dst_fd, dst_buf, a, *offset);
+    } while(b == -1 && errno == EINTR);
+    if(b == -1) return -1;
+    for(i = 0; i < a; i += len) {
+      len = a - i < COPY_DELTA_BLOCK ? a - i : COPY_DELTA_BLOCK;
+      if(i + len <= b && memcmp(src_buf + i, dst_buf + i, len) == 0) {
+        result->same += len;
+        continue;
+      }
+      c = 0;
+      do {
+        // b still holds how much of dst was read, for the blocks after this
+        w = pwrite(dst_fd, src_buf + i + c, len - c, *offset + i + c);
+        if(w == -1) {
+          if(errno == EINTR) continue;
+          return -1;
+        }
+        c += w;
+      } while(c < len);
+      result->copied += len;
+    }
+    *offset += a;
+  }
+  return 0;
+}
+
+#if defined(SEEK_DATA) && defined(FALLOC_FL_PUNCH_HOLE)
+/**
+ * Copy only the data extents between offset and end of a sparse file, found
+ * with SEEK_DATA and SEEK_HOLE.  The holes are left unwritten, and punched
+ * where they cover old data in dst_fd.
+ */
+static int copy_sparse(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  off_t offset,
+  off_t end,
+  off_t dst_size,
+  struct copy_result *result
+) {
+  off_t data, hole = offset, old;
+
+  while(hole < end) {
+    data = lseek(src_fd, hole, SEEK_DATA);
+    if(data == -1) {
+      // ENXIO: the rest is a hole
+      if(errno != ENXIO) {
+        result->read_error = 1;
+        return -1;
+      }
+      data = end;
+    }
+    if(data > end) data = end;
+    if(data > hole) {
+      old = data < dst_size ? data : dst_size;
+      if(hole < old &&
+         fallocate(dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, old - hole) == -1
+      ) {
+        // dst cannot have holes, so write the zeros over its old data
+        if(copy_range(src_fd, dst_fd, method, flags, buffer, hole, old, result)) return -1;
+        result->holes += data - old;
+      } else {
+        result->holes += data - hole;
+      }
+    }
+    if(data == end) break;
+    hole = lseek(src_fd, data, SEEK_HOLE);
+    if(hole == -1) {
+      result->read_error = 1;
+      return -1;
+    }
+    if(hole > end) hole = end;
+    if(flags & COPY_PREALLOCATE) copy_preallocate(dst_fd, data, hole);
+    if(copy_range(src_fd, dst_fd, method, flags, buffer, data, hole, result)) return -1;
+  }
+  return 0;
+}
+#endif
+
+int copy_is_sparse(const struct stat *st) {
+  // fewer blocks than the size calls for means there are holes
+  return (off_t) st->st_blocks * 512 < st->st_size;
+}
+
+int copy_clone(int src_fd, int dst_fd) {
+#ifdef FICLONE
+  return ioctl(dst_fd, FICLONE, src_fd);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int copy_data_range(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  off_t offset,
+  off_t end,
+  off_t dst_size,
+  struct copy_result *result
+) {
+  if(method == COPY_DELTA) {
+    if(offset < dst_size) {
+      if(copy_delta(src_fd, dst_fd, buffer, &offset, end < dst_size ? end : dst_size, result)) {
+        return -1;
+      }
+      // done, or src ended before dst did
+      if(offset == end || offset < dst_size) return 0;
+    }
+    method = COPY_AUTO;
+  }
+#if defined(SEEK_DATA) && defined(FALLOC_FL_PUNCH_HOLE)
+  if(flags & COPY_SPARSE) {
+    return copy_sparse(src_fd, dst_fd, method, flags, buffer, offset, end, dst_size, result);
+  }
+#endif
+  if(flags & COPY_PREALLOCATE) copy_preallocate(dst_fd, offset, end);
+  return copy_range(src_fd, dst_fd, method, flags, buffer, offset, end, result);
+}
+
+int copy_data(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  struct copy_result *result
+) {
+  struct stat src_st, dst_st;
+
+  result->length = 0;
+  result->copied = 0;
+  result->holes = 0;
+  result->same = 0;
+  result->read_error = 0;
+  if(fstat(src_fd, &src_st) == -1) {
+    result->read_error = 1;
+    return -1;
+  }
+  if(fstat(dst_fd, &dst_st) == -1) return -1;
+  result->length = src_st.st_size;
+  if(method == COPY_AUTO || method == COPY_CLONE) {
+    // fails at once with EXDEV across file systems and with EOPNOTSUPP
+    // where extents cannot be shared
+    result->method = COPY_CLONE;
+    if(copy_clone(src_fd, dst_fd) == 0) return 0;
+    if(method != COPY_AUTO) return -1;
+  }
+  if(copy_is_sparse(&src_st)) flags |= COPY_SPARSE;
+  if(copy_data_range(src_fd, dst_fd, method, flags, buffer, 0, src_st.st_size, dst_st.st_size, result)) {
+    return -1;
+  }
+  // in case the file shrank while it was copied
+  if(!(flags & COPY_SPARSE)) result->length = result->copied + result->same;
+  return 0;
+}
@@ -0,0 +1,193 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Copying the contents of one file to another
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * How the data of a file is copied.  COPY_AUTO tries each of the others in
+ * turn, falling back to the next when the kernel or file system does not
+ * support one.
+ */
+enum copy_method {
+  COPY_AUTO,
+  /// share the source's extents (FICLONE), on XFS, btrfs and the like
+  COPY_CLONE,
+  /// copy_file_range(), which some file systems and NFS 4.2 do server-side
+  COPY_FILE_RANGE,
+  /// sendfile(), which moves pages in the kernel without a user copy
+  COPY_SENDFILE,
+  /// read() and write() through a buffer in user space
+  COPY_READ_WRITE,
+  /**
+   * read both files and write only the blocks that differ, so that a large
+   * file changed in a few places is updated in place
+   */
+  COPY_DELTA
+};
+
+/**
+ * src_fd has holes, to be skipped as copy_data() does.  Only for
+ * copy_data_range(); copy_data() finds out for itself.
+ */
+#define COPY_SPARSE      0x1
+
+/**
+ * fallocate() each range of dst_fd before writing it, so that it is
+ * allocated in one piece rather than a buffer at a time.  The size of dst_fd
+ * is kept, and only set when the copy is done; of a sparse file only the
+ * data is allocated.
+ */
+#define COPY_PREALLOCATE 0x2
+
+/**
+ * Copy with read() and write() through O_DIRECT, in whole blocks of
+ * COPY_DIRECT_ALIGN from a buffer aligned to it, so that a large copy does
+ * not push everything else out of the page cache.  Only applies to
+ * COPY_AUTO, which then copies only this way, and COPY_READ_WRITE.  A
+ * partial block at the end, and files on file systems without direct I/O,
+ * are copied through the page cache.
+ */
+#define COPY_DIRECT      0x4
+
+/// the alignment of offsets, sizes and buffers for COPY_DIRECT
+#define COPY_DIRECT_ALIGN 4096
+
+/// bytes that COPY_DELTA compares and rewrites as one
+#define COPY_DELTA_BLOCK (64 << 10)
+
+/**
+ * Finds the method named by name: auto, clone, copy_file_range, sendfile or
+ * read_write or delta.
+ *
+ * @return 0 if successful, EINVAL if name is unknown, or ENOSYS if the
+ * method is not supported on this system
+ */
+int copy_method_parse(const char *name, enum copy_method *method);
+
+/// the name of a method, as understood by copy_method_parse()
+const char * copy_method_name(enum copy_method method);
+
+/// the result of copy_data()
+struct copy_result {
+  /// the size of the file, to truncate the destination to
+  off_t length;
+
+  /// bytes of data written, or 0 if the file was cloned
+  off_t copied;
+
+  /// bytes of holes in a sparse file that were skipped
+  off_t holes;
+
+  /// bytes that COPY_DELTA found already the same in the destination
+  off_t same;
+
+  /// the method that copied the last of the data
+  enum copy_method method;
+
+  /// on error, non-zero if it was reading src_fd that failed
+  int read_error;
+};
+
+/**
+ * Copies all of src_fd to the same offsets of dst_fd, which is not
+ * truncated.  buffer is called for the buffer and its size only if the data
+ * is copied with read() and write().
+ *
+ * A sparse src_fd has only its data copied, found with SEEK_DATA and
+ * SEEK_HOLE; holes are punched in dst_fd where it had data, or written as
+ * zeros if it cannot have holes.
+ *
+ * Errors from cloning, copy_file_range() and sendfile() with COPY_AUTO are not
+ * reported; the copy goes on with the next method, which with read() and
+ * write() can tell which side failed.  A method given explicitly is not
+ * fallen back from, and its errors are taken to be errors writing.
+ *
+ * flags can be COPY_PREALLOCATE and COPY_DIRECT.
+ *
+ * COPY_DELTA needs dst_fd open for reading too.  It compares what dst_fd
+ * already has in blocks of COPY_DELTA_BLOCK, and copies whatever lies past
+ * its end as COPY_AUTO does, except for cloning.
+ *
+ * @return 0 if successful, or -1 with errno set
+ */
+int copy_data(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  struct copy_result *result
+);
+
+/// non-zero if the file has holes, going by the blocks it takes up
+int copy_is_sparse(const struct stat *st);
+
+/**
+ * Makes dst_fd share the extents of all of src_fd, so that nothing is
+ * copied until one of them is written.
+ *
+ * @return 0 if successful, or -1 with errno set: EXDEV across file systems,
+ * EOPNOTSUPP where extents cannot be shared, ENOSYS on other systems
+ */
+int copy_clone(int src_fd, int dst_fd);
+
+/**
+ * Copies the bytes from offset to end of src_fd to the same offsets of
+ * dst_fd, as copy_data() does but without cloning, so that the parts of a
+ * large file can be copied at once by several threads, each with its own
+ * descriptors.  dst_size is the size dst_fd had before the copy started.
+ * flags are COPY_SPARSE if copy_is_sparse() of src_fd, COPY_PREALLOCATE and
+ * COPY_DIRECT.  Adds to result->copied, result->holes and result->same, and
+ * sets result->method and result->read_error.
+ *
+ * @return 0 if successful, or -1 with errno set
+ */
+int copy_data_range(
+  int src_fd,
+  int dst_fd,
+  enum copy_method method,
+  int flags,
+  char * (*buffer)(size_t *size),
+  off_t offset,
+  off_t end,
+  off_t dst_size,
+  struct copy_result *result
+);
+
+#endif // COPY_H
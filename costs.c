@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "costs.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t costs_hash(const char *path) {
+  uint64_t h = 14695981039346656037u;
+  while(*path) {
+    h ^= (unsigned char) *path++;
+    h *= 1099511628211u;
+  }
+  return h;
+}
+
+// loaded_size is a power of two and the table is never full
+static struct cost * costs_slot(struct cost *table, size_t size, const char *path) {
+  size_t i = costs_hash(path) & (size - 1);
+  while(table[i].path && strcmp(table[i].path, path) != 0) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+int costs_init(struct costs *c) {
+  int rc;
+
+  rc = pthread_mutex_init(&c->mutex, NULL);
+  if(rc) return rc;
+  c->loaded = NULL;
+  c->loaded_size = 0;
+  c->recorded = NULL;
+  c->recorded_count = 0;
+  c->recorded_size = 0;
+  return 0;
+}
+
+static void costs_free_loaded(struct costs *c) {
+  size_t i;
+
+  for(i = 0; i < c->loaded_size; ++i) {
+    free(c->loaded[i].path);
+  }
+  free(c->loaded);
+  c->loaded = NULL;
+  c->loaded_size = 0;
+}
+
+int costs_load(struct costs *c, const char *file) {
+  struct cost *list = NULL, *p, *slot;
+  size_t count = 0, size = 0, lsize = 0, i;
+  FILE *f;
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t len;
+  uint64_t nsec, entries;
+  int n, rc = 0;
+
+  f = fopen(file, "r");
+  if(!f) return errno;
+  while((len = getline(&line, &linesize, f)) != -1) {
+    if(len && line[len-1] == '\n') line[--len] = '\0';
+    if(sscanf(line, "%" SCNu64 " %" SCNu64 " %n", &nsec, &entries, &n) != 2 || !line[n]) {
+      continue;
+    }
+    if(count == size) {
+      size = size ? size << 1 : 256;
+      p = realloc(list, sizeof(struct cost) * size);
+      if(!p) {
+        rc = errno;
+        break;
+      }
+      list = p;
+    }
+    list[count].path = strdup(line + n);
+    if(!list[count].path) {
+      rc = errno;
+      break;
+    }
+    list[count].nsec = nsec;
+    list[count].entries = entries;
+    ++count;
+  }
+  if(!rc && ferror(f)) rc = errno;
+  free(line);
+  fclose(f);
+
+  if(!rc && count) {
+    for(lsize = 16; lsize < count * 2; lsize <<= 1);
+    c->loaded = calloc(lsize, sizeof(struct cost));
+    if(!c->loaded) rc = errno;
+  }
+  if(rc) {
+    for(i = 0; i < count; ++i) free(list[i].path);
+    free(list);
+    return rc;
+  }
+
+  c->loaded_size = lsize;
+  for(i = 0; i < count; ++i) {
+    slot = costs_slot(c->loaded, lsize, list[i].path);
+    if(slot->path) free(slot->path);
+    *slot = list[i];
+  }
+  free(list);
+  return 0;
+}
+
+uint64_t costs_lookup(const struct costs *c, const char *path) {
+  if(!c->loaded_size) return 0;
+  return costs_slot(c->loaded, c->loaded_size, path)->nsec;
+}
+
+void costs_record(struct costs *c, const char *path, uint64_t nsec, uint64_t entries) {
+  struct cost *p;
+  char *copy;
+
+  // a name with a newline cannot be saved
+  if(entries < COSTS_MIN_ENTRIES || strchr(path, '\n')) return;
+  copy = strdup(path);
+  if(!copy) return;
+
+  pthread_mutex_lock(&c->mutex);
+  if(c->recorded_count == c->recorded_size) {
+    c->recorded_size = c->recorded_size ? c->recorded_size << 1 : 256;
+    p = realloc(c->recorded, sizeof(struct cost) * c->recorded_size);
+    if(!p) {
+      c->recorded_size = c->recorded_count;
+      pthread_mutex_unlock(&c->mutex);
+      free(copy);
+      return;
+    }
+    c->recorded = p;
+  }
+  p = &c->recorded[c->recorded_count++];
+  p->path = copy;
+  p->nsec = nsec;
+  p->entries = entries;
+  pthread_mutex_unlock(&c->mutex);
+}
+
+int costs_save(struct costs *c, const char *file) {
+  char tmp[PATH_MAX];
+  FILE *f;
+  uint64_t max = 0;
+  size_t i;
+  int rc = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  f = fopen(tmp, "w");
+  if(!f) return errno;
+
+  pthread_mutex_lock(&c->mutex);
+  for(i = 0; i < c->recorded_count; ++i) {
+    if(c->recorded[i].nsec > max) max = c->recorded[i].nsec;
+  }
+  for(i = 0; i < c->recorded_count; ++i) {
+    if(c->recorded[i].nsec < max / COSTS_SAVE_FRACTION) continue;
+    fprintf(f, "%" PRIu64 " %" PRIu64 " %s\n",
+      c->recorded[i].nsec,
+      c->recorded[i].entries,
+      c->recorded[i].path
+    );
+  }
+  pthread_mutex_unlock(&c->mutex);
+
+  if(ferror(f)) rc = errno;
+  if(fclose(f) && !rc) rc = errno;
+  if(!rc && rename(tmp, file)) rc = errno;
+  if(rc) unlink(tmp);
+  return rc;
+}
+
+void costs_destroy(struct costs *c) {
+  size_t i;
+
+  costs_free_loaded(c);
+  for(i = 0; i < c->recorded_count; ++i) {
+    free(c->recorded[i].path);
+  }
+  free(c->recorded);
+  pthread_mutex_destroy(&c->mutex);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Per-subtree costs remembered between runs
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COSTS_H
+#define COSTS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/// subtrees with fewer entries than this are not worth remembering
+#define COSTS_MIN_ENTRIES 1024
+
+/**
+ * Subtrees that cost less than this fraction of the most expensive one are
+ * left out of the saved profile.
+ */
+#define COSTS_SAVE_FRACTION 1000
+
+struct cost {
+  char *path;
+  /// time spent on the whole subtree, summed over all threads
+  uint64_t nsec;
+  /// number of entries in the whole subtree
+  uint64_t entries;
+};
+
+struct costs {
+  /// mutex, protects recorded
+  pthread_mutex_t mutex;
+
+  /// hash table of the costs loaded from the previous run, read-only
+  struct cost *loaded;
+  size_t loaded_size;
+
+  /// costs recorded in this run
+  struct cost *recorded;
+  size_t recorded_count;
+  size_t recorded_size;
+};
+
+/// initialize an empty costs object
+int costs_init(struct costs *c);
+
+/**
+ * Load the costs saved by a previous run.
+ *
+ * @return 0 if successful, or an error number
+ */
+int costs_load(struct costs *c, const char *file);
+
+/// get the cost of path from the previous run, 0 if it is not known
+uint64_t costs_lookup(const struct costs *c, const char *path);
+
+/// record the cost of the subtree at path in this run
+void costs_record(struct costs *c, const char *path, uint64_t nsec, uint64_t entries);
+
+/**
+ * Save the costs recorded in this run, replacing file.
+ *
+ * @return 0 if successful, or an error number
+ */
+int costs_save(struct costs *c, const char *file);
+
+/// destroy a costs object
+void costs_destroy(struct costs *c);
+
+#endif
@@ -1,8 +1,24 @@
 #include "exclude.h"
 #include <fnmatch.h>
-#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
+static int excluded_by(const char *p, const char *path) {
+  const char *tail;
+
+  if(p[0] == '/') {
+    return fnmatch(p+1, path, FNM_PATHNAME) == 0;
+  }
+  if(fnmatch(p, path, FNM_PATHNAME) == 0) return 1;
+  tail = path;
+  while(*tail) {
+    if(*tail++ == '/') {
+      if(fnmatch(p, tail, FNM_PATHNAME) == 0) return 1;
+    }
+  }
+  return 0;
+}
+
 int excluded(
   const char * const *patterns,
   size_t npatterns,
@@ -10,29 +26,24 @@ int excluded(
   int isdir
 ) {
   size_t i, l;
-  const char *p, *tail;
-  char pattern[PATH_MAX];
+  const char *p;
+  char *pattern;
+  int match;
 
   for(i = 0; i < npatterns; ++i) {
     p = patterns[i];
     l = strlen(p);
     if(p[l-1] == '/') {
       if(!isdir) return 0;
-      strcpy(pattern, p);
-      pattern[--l] = '\0';
-      p = pattern;
-    }
-    if(p[0] == '/') {
-      if(fnmatch(p+1, path, FNM_PATHNAME) == 0) return 1;
+      // copied to the heap, as the callers may be running on small stacks
+      pattern = strndup(p, l - 1);
+      if(!pattern) return 0;
+      match = excluded_by(pattern, path);
+      free(pattern);
     } else {
-      if(fnmatch(p, path, FNM_PATHNAME) == 0) return 1;
-      tail = path;
-      while(*tail) {
-        if(*tail++ == '/') {
-          if(fnmatch(p, tail, FNM_PATHNAME) == 0) return 1;
-        }
-      }
+      match = excluded_by(p, path);
     }
+    if(match) return 1;
   }
   return 0;
 }
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fstune.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+/*
+ * Local file systems are limited by the disk, and gain more from stat'ing in
+ * inode order than from more threads.  Network and parallel file systems
+ * hide a round trip behind every call, so they want many threads, a task
+ * per file and large readdir buffers.  tmpfs is limited by the CPU and its
+ * locks, so more threads than that only add contention.
+ */
+static const struct fstune_profile builtin_profiles[] = {
+  //  name       magic        threads  readdir  inode  file
+  { "default", 0x00000000ul,  0,       0,       0,     -1 },
+  { "ext4",    0x0000EF53ul,  8,       0,       1,     -1 },
+  { "xfs",     0x58465342ul,  16,      0,       1,     -1 },
+  { "btrfs",   0x9123683Eul,  8,       0,       0,     -1 },
+  { "tmpfs",   0x01021994ul,  4,       0,       0,     -1 },
+  { "nfs",     0x00006969ul,  64,      1 << 20, 0,     1 },
+  { "lustre",  0x0BD00BD0ul,  64,      1 << 20, 0,     1 },
+  { "gpfs",    0x47504653ul,  32,      1 << 18, 0,     1 },
+  { "cephfs",  0x00C36400ul,  64,      1 << 20, 0,     1 },
+  { "cifs",    0xFF534D42ul,  32,      1 << 16, 0,     1 },
+};
+
+#define NBUILTIN (sizeof(builtin_profiles) / sizeof(builtin_profiles[0]))
+
+int fstune_parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long long n;
+  int shift = 0;
+
+  // strtoull() would negate a leading minus sign rather than reject it
+  if(strchr(str, '-')) return -1;
+  errno = 0;
+  n = strtoull(str, &end, 10);
+  if(errno || end == str) return -1;
+  switch(*end) {
+  case 'G': case 'g': shift = 30; ++end; break;
+  case 'M': case 'm': shift = 20; ++end; break;
+  case 'K': case 'k': shift = 10; ++end; break;
+  }
+  if(*end || n > SIZE_MAX >> shift) return -1;
+  *size = (size_t) n << shift;
+  return 0;
+}
+
+int fstune_parse_stacksize(const char *str, size_t *stacksize) {
+  size_t n;
+
+  if(fstune_parse_size(str, &n) || n < FSTUNE_MIN_STACKSIZE) return -1;
+  *stacksize = n;
+  return 0;
+}
+
+int fstune_parse_spin(const char *str, long *spin) {
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol(str, &end, 10);
+  if(errno || end == str || *end || n < 0) return -1;
+  *spin = n ? n : MTPT_SPIN_NONE;
+  return 0;
+}
+
+int fstune_parse_bool(const char *str, int *value) {
+  if(strcmp(str, "yes") == 0) *value = 1;
+  else if(strcmp(str, "no") == 0) *value = 0;
+  else return -1;
+  return 0;
+}
+
+static int fstune_parse_setting(struct fstune_profile *p, char *setting) {
+  char *value, *end;
+
+  value = strchr(setting, '=');
+  if(!value) return -1;
+  *value++ = '\0';
+  if(strcmp(setting, "magic") == 0) {
+    errno = 0;
+    p->magic = strtoul(value, &end, 0);
+    return errno || end == value || *end ? -1 : 0;
+  } else if(strcmp(setting, "threads") == 0) {
+    errno = 0;
+    p->threads = strtoul(value, &end, 10);
+    return errno || end == value || *end ? -1 : 0;
+  } else if(strcmp(setting, "readdir-buffer") == 0) {
+    return fstune_parse_size(value, &p->readdir_buffer_size);
+  } else if(strcmp(setting, "inode-order") == 0) {
+    return fstune_parse_bool(value, &p->inode_order);
+  } else if(strcmp(setting, "file-tasks") == 0) {
+    return fstune_parse_bool(value, &p->file_tasks);
+  }
+  return -1;
+}
+
+static struct fstune_profile * fstune_find(struct fstune *ft, const char *name) {
+  size_t i;
+
+  for(i = 0; i < ft->count; ++i) {
+    if(strcmp(ft->profiles[i].name, name) == 0) return &ft->profiles[i];
+  }
+  return NULL;
+}
+
+static int fstune_load(struct fstune *ft, const char *file) {
+  struct fstune_profile p, *existing, *profiles;
+  FILE *f;
+  char *line = NULL, *name, *setting, *save;
+  size_t size = 0;
+  int rc = 0, lineno = 0;
+
+  f = fopen(file, "r");
+  if(!f) return errno;
+  while(getline(&line, &size, f) != -1) {
+    ++lineno;
+    name = strtok_r(line, " \t\n", &save);
+    if(!name || name[0] == '#') continue;
+
+    existing = fstune_find(ft, name);
+    if(existing) {
+      p = *existing;
+    } else {
+      memset(&p, 0, sizeof(p));
+      snprintf(p.name, sizeof(p.name), "%s", name);
+      p.inode_order = -1;
+      p.file_tasks = -1;
+    }
+    while((setting = strtok_r(NULL, " \t\n", &save))) {
+      if(fstune_parse_setting(&p, setting)) {
+        fprintf(stderr, "%s:%d: invalid setting: %s\n", file, lineno, setting);
+        rc = EINVAL;
+        goto out;
+      }
+    }
+    if(existing) {
+      *existing = p;
+    } else if(!p.magic) {
+      fprintf(stderr, "%s:%d: %s needs a magic number\n", file, lineno, name);
+      rc = EINVAL;
+      goto out;
+    } else {
+      profiles = realloc(ft->profiles, sizeof(struct fstune_profile) * (ft->count + 1));
+      if(!profiles) {
+        rc = errno;
+        goto out;
+      }
+      ft->profiles = profiles;
+      ft->profiles[ft->count++] = p;
+    }
+  }
+  if(ferror(f)) rc = errno;
+out:
+  free(line);
+  fclose(f);
+  return rc;
+}
+
+int fstune_init(struct fstune *ft, const char *config_file) {
+  int rc;
+
+  ft->profiles = malloc(sizeof(builtin_profiles));
+  if(!ft->profiles) return errno;
+  memcpy(ft->profiles, builtin_profiles, sizeof(builtin_profiles));
+  ft->count = NBUILTIN;
+
+  rc = fstune_load(ft, config_file ? config_file : FSTUNE_CONFIG_FILE);
+  if(rc == ENOENT && !config_file) rc = 0;
+  if(rc) fstune_destroy(ft);
+  return rc;
+}
+
+int fstune_lookup(
+  const struct fstune *ft,
+  const char *path,
+  struct fstune_profile *profile
+) {
+#ifdef __linux__
+  struct statfs sfs;
+  unsigned long magic;
+  size_t i;
+
+  if(statfs(path, &sfs)) return errno;
+  magic = (unsigned long) sfs.f_type & 0xFFFFFFFFul;
+  for(i = 1; i < ft->count; ++i) {
+    if(ft->profiles[i].magic == magic) {
+      *profile = ft->profiles[i];
+      return 0;
+    }
+  }
+#endif
+  *profile = ft->profiles[0];
+  return 0;
+}
+
+void fstune_destroy(struct fstune *ft) {
+  free(ft->profiles);
+}
+
+void fstune_apply(
+  const struct fstune_profile *profile,
+  int keep,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+) {
+  if(!(keep & FSTUNE_KEEP_THREADS) && profile->threads) {
+    *nthreads = profile->threads;
+  }
+  if(!(keep & FSTUNE_KEEP_READDIR_BUFFER)) {
+    options->readdir_buffer_size = profile->readdir_buffer_size;
+  }
+  if(!(keep & FSTUNE_KEEP_INODE_ORDER) && profile->inode_order >= 0) {
+    if(profile->inode_order) *config |= MTPT_CONFIG_INODE_ORDER;
+    else *config &= ~MTPT_CONFIG_INODE_ORDER;
+  }
+  if(!(keep & FSTUNE_KEEP_FILE_TASKS) && profile->file_tasks >= 0) {
+    if(profile->file_tasks) *config |= MTPT_CONFIG_FILE_TASKS;
+    else *config &= ~MTPT_CONFIG_FILE_TASKS;
+  }
+}
+
+void fstune_tune(
+  const struct fstune *ft,
+  int keep,
+  const char *path,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+) {
+  struct fstune_profile profile;
+
+  if(!ft) return;
+  if(fstune_lookup(ft, path, &profile)) return;
+  fstune_apply(&profile, keep, nthreads, config, options);
+}
@@ -0,0 +1,175 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Settings tuned to the type of file system
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSTUNE_H
+#define FSTUNE_H
+
+#include "mtpt.h"
+#include <stddef.h>
+
+/// read if it exists and no other file is given
+#define FSTUNE_CONFIG_FILE "/etc/mtpt/fstune.conf"
+
+/// smallest thread stack that fstune_parse_stacksize() accepts
+#define FSTUNE_MIN_STACKSIZE (64<<10) // 64 KB
+
+/**
+ * Settings that suit a particular type of file system.
+ */
+struct fstune_profile {
+  /// file system type, "default" for the fallback profile
+  char name[16];
+
+  /// statfs() f_type, 0 for the fallback profile
+  unsigned long magic;
+
+  /// number of threads, 0 to keep the tool's default
+  size_t threads;
+
+  /// mtpt_options_t readdir_buffer_size, 0 for the C library's readdir()
+  size_t readdir_buffer_size;
+
+  /// 1 to set MTPT_CONFIG_INODE_ORDER, 0 to clear it, -1 to leave the
+  /// tool's choice
+  int inode_order;
+
+  /// 1 to set MTPT_CONFIG_FILE_TASKS, 0 to clear it, -1 to leave the
+  /// tool's choice
+  int file_tasks;
+};
+
+/**
+ * Settings given on the command line, which fstune_apply() leaves alone.
+ */
+#define FSTUNE_KEEP_THREADS        0x1
+#define FSTUNE_KEEP_READDIR_BUFFER 0x2
+#define FSTUNE_KEEP_INODE_ORDER    0x4
+#define FSTUNE_KEEP_FILE_TASKS     0x8
+
+/**
+ * The built-in profiles, amended by a config file.
+ */
+struct fstune {
+  /// the fallback profile comes first
+  struct fstune_profile *profiles;
+  size_t count;
+};
+
+/**
+ * Loads the built-in profiles amended by config_file, or by
+ * FSTUNE_CONFIG_FILE if config_file is NULL and that file exists.
+ *
+ * Each line of the file names a profile, followed by any of the settings
+ * magic=N, threads=N, readdir-buffer=SIZE, inode-order=yes|no and
+ * file-tasks=yes|no.  A new profile must be given a magic number, and
+ * leaves inode order and file tasks to the tool unless it sets them.
+ *
+ * @return 0 if successful, or an error number.  Errors in the config file
+ * are reported on stderr and return EINVAL.
+ */
+int fstune_init(struct fstune *ft, const char *config_file);
+
+/**
+ * Finds the profile for the file system that path is on, or the fallback
+ * profile if there is none for it.
+ *
+ * @return 0 if successful, or an error number from statfs()
+ */
+int fstune_lookup(
+  const struct fstune *ft,
+  const char *path,
+  struct fstune_profile *profile
+);
+
+void fstune_destroy(struct fstune *ft);
+
+/**
+ * Applies profile to the settings not named in keep, a bitwise OR of
+ * FSTUNE_KEEP_* flags.
+ */
+void fstune_apply(
+  const struct fstune_profile *profile,
+  int keep,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+);
+
+/**
+ * Looks up the profile for path and applies it as fstune_apply() does.
+ * Does nothing if ft is NULL, which is how --no-tune is passed, or if the
+ * file system cannot be looked up.
+ */
+void fstune_tune(
+  const struct fstune *ft,
+  int keep,
+  const char *path,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+);
+
+/**
+ * Parses a size in bytes with an optional K, M or G suffix.
+ *
+ * @return 0 if successful, -1 if str is not a size or the size does not fit
+ * in a size_t
+ */
+int fstune_parse_size(const char *str, size_t *size);
+
+/**
+ * Parses a thread stack size as fstune_parse_size() does, for --stack-size.
+ *
+ * @return 0 if successful, -1 if str is not a size or is less than
+ * FSTUNE_MIN_STACKSIZE
+ */
+int fstune_parse_stacksize(const char *str, size_t *stacksize);
+
+/**
+ * Parses a --spin count into an mtpt_options_t spin, where 0 gives
+ * MTPT_SPIN_NONE.
+ *
+ * @return 0 if successful, -1 if str is not a non-negative number
+ */
+int fstune_parse_spin(const char *str, long *spin);
+
+/**
+ * Parses yes or no as 1 or 0, for inode-order and file-tasks.
+ *
+ * @return 0 if successful, -1 if str is neither
+ */
+int fstune_parse_bool(const char *str, int *value);
+
+#endif
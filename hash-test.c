@@ -0,0 +1,128 @@
+#include "hash.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LONG_SIZE (100 << 10)
+#define BUFFER_SIZE 4096
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++g_failures; \
+  } \
+} while(0)
+
+static uint64_t hash(const void *data, size_t len) {
+  struct hash64 h;
+
+  hash64_init(&h, 0);
+  hash64_update(&h, data, len);
+  return hash64_digest(&h);
+}
+
+/// the reference implementation's digests, seed 0
+static void test_vectors(void) {
+  static const char fox[] = "The quick brown fox jumps over the lazy dog";
+
+  CHECK(hash("", 0) == 0xef46db3751d8e999ull);
+  CHECK(hash("a", 1) == 0xd24ec4f1a98c6e5bull);
+  CHECK(hash("abc", 3) == 0x44bc2cf5ad770999ull);
+  CHECK(hash(fox, sizeof(fox) - 1) == 0x0b242d361fda71bcull);
+}
+
+static void fill(unsigned char *buf, size_t len) {
+  uint64_t x = 88172645463325252ull;
+  size_t i;
+
+  for(i = 0; i < len; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = (unsigned char) x;
+  }
+}
+
+/*
+ * The digest does not depend on how the input is split between updates,
+ * and taking it does not end the hash.
+ */
+static void test_incremental(void) {
+  unsigned char *data = malloc(LONG_SIZE);
+  struct hash64 h;
+  uint64_t whole, part;
+  size_t i, n, step;
+
+  fill(data, LONG_SIZE);
+  whole = hash(data, LONG_SIZE);
+  for(step = 1; step <= 97; step += 8) {
+    hash64_init(&h, 0);
+    for(i = 0; i < LONG_SIZE; i += n) {
+      n = LONG_SIZE - i < step ? LONG_SIZE - i : step;
+      hash64_update(&h, data + i, n);
+    }
+    CHECK(hash64_digest(&h) == whole);
+  }
+
+  hash64_init(&h, 0);
+  hash64_update(&h, data, 1000);
+  part = hash64_digest(&h);
+  CHECK(part == hash(data, 1000));
+  hash64_update(&h, data + 1000, LONG_SIZE - 1000);
+  CHECK(hash64_digest(&h) == whole);
+
+  // a different seed gives a different digest
+  hash64_init(&h, 1);
+  hash64_update(&h, data, LONG_SIZE);
+  CHECK(hash64_digest(&h) != whole);
+  free(data);
+}
+
+static char * buffer(size_t *size) {
+  static char buf[BUFFER_SIZE];
+
+  *size = sizeof(buf);
+  return buf;
+}
+
+/// hashing a file through a small buffer gives the digest of its contents
+static void test_fd(void) {
+  char path[] = "/tmp/hash-test.XXXXXX";
+  unsigned char *data = malloc(LONG_SIZE + 13);
+  uint64_t digest = 0;
+  int fd;
+
+  fill(data, LONG_SIZE + 13);
+  fd = mkstemp(path);
+  if(fd == -1 || write(fd, data, LONG_SIZE + 13) != LONG_SIZE + 13) {
+    perror(path);
+    exit(1);
+  }
+  // hash64_fd() reads from the start, wherever the offset is
+  CHECK(hash64_fd(fd, buffer, &digest) == 0);
+  CHECK(digest == hash(data, LONG_SIZE + 13));
+
+  CHECK(ftruncate(fd, 0) == 0);
+  CHECK(hash64_fd(fd, buffer, &digest) == 0);
+  CHECK(digest == 0xef46db3751d8e999ull);
+  close(fd);
+  unlink(path);
+  free(data);
+}
+
+int main(int argc, char **argv) {
+  test_vectors();
+  test_incremental();
+  test_fd();
+
+  if(g_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], g_failures);
+    return 1;
+  }
+  printf("%s: ok\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include "hash.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define P1 UINT64_C(11400714785074694791)
+#define P2 UINT64_C(14029467366897019727)
+#define P3 UINT64_C(1609587929392839161)
+#define P4 UINT64_C(9650029242287828579)
+#define P5 UINT64_C(2870177450012600261)
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/// little-endian loads, which compilers turn into plain loads on x86
+static inline uint64_t read64(const unsigned char *p) {
+  return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+         (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+         (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+  return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+         (uint64_t) p[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+  acc ^= round64(0, v);
+  return acc * P1 + P4;
+}
+
+/// run the four lanes over as many whole 32 byte stripes as p has
+static const unsigned char * hash64_stripes(struct hash64 *h, const unsigned char *p, const unsigned char *end) {
+  uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+
+  while(end - p >= 32) {
+    v0 = round64(v0, read64(p));
+    v1 = round64(v1, read64(p + 8));
+    v2 = round64(v2, read64(p + 16));
+    v3 = round64(v3, read64(p + 24));
+    p += 32;
+  }
+  h->v[0] = v0;
+  h->v[1] = v1;
+  h->v[2] = v2;
+  h->v[3] = v3;
+  return p;
+}
+
+void hash64_init(struct hash64 *h, uint64_t seed) {
+  h->v[0] = seed + P1 + P2;
+  h->v[1] = seed + P2;
+  h->v[2] = seed;
+  h->v[3] = seed - P1;
+  h->seed = seed;
+  h->total = 0;
+  h->buflen = 0;
+}
+
+void hash64_update(struct hash64 *h, const void *data, size_t len) {
+  const unsigned char *p = data, *end = p + len;
+  size_t n;
+
+  h->total += len;
+  if(h->buflen) {
+    // fill the partial stripe left by the last update first
+    n = 32 - h->buflen < len ? 32 - h->buflen : len;
+    memcpy(h->buf + h->buflen, p, n);
+    h->buflen += n;
+    p += n;
+    if(h->buflen < 32) return;
+    hash64_stripes(h, h->buf, h->buf + 32);
+    h->buflen = 0;
+  }
+  p = hash64_stripes(h, p, end);
+  memcpy(h->buf, p, end - p);
+  h->buflen = end - p;
+}
+
+uint64_t hash64_digest(const struct hash64 *h) {
+  const unsigned char *p = h->buf, *end = h->buf + h->buflen;
+  uint64_t acc;
+
+  if(h->total >= 32) {
+    acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+    acc = merge64(acc, h->v[0]);
+    acc = merge64(acc, h->v[1]);
+    acc = merge64(acc, h->v[2]);
+    acc = merge64(acc, h->v[3]);
+  } else {
+    acc = h->seed + P5;
+  }
+  acc += h->total;
+  while(end - p >= 8) {
+    acc ^= round64(0, read64(p));
+    acc = rotl(acc, 27) * P1 + P4;
+    p += 8;
+  }
+  if(end - p >= 4) {
+    acc ^= read32(p) * P1;
+    acc = rotl(acc, 23) * P2 + P3;
+    p += 4;
+  }
+  while(p < end) {
+    acc ^= *p++ * P5;
+    acc = rotl(acc, 11) * P1;
+  }
+  acc ^= acc >> 33;
+  acc *= P2;
+  acc ^= acc >> 29;
+  acc *= P3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+int hash64_fd(int fd, char * (*buffer)(size_t *size), uint64_t *digest) {
+  struct hash64 h;
+  off_t offset = 0;
+  size_t size;
+  ssize_t n;
+  char *buf;
+
+  buf = (*buffer)(&size);
+  hash64_init(&h, 0);
+  for(;;) {
+    n = pread(fd, buf, size, offset);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    if(n == 0) break;
+    hash64_update(&h, buf, n);
+    offset += n;
+  }
+  *digest = hash64_digest(&h);
+  return 0;
+}
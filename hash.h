@@ -0,0 +1,72 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  A fast non-cryptographic hash of file contents
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The state of an XXH64 hash being computed.  XXH64 reads 32 bytes at a
+ * time into four independent lanes, so it runs near memory bandwidth without
+ * needing any particular instruction set.
+ */
+struct hash64 {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t total;
+  unsigned char buf[32];
+  size_t buflen;
+};
+
+/// starts a hash with the given seed
+void hash64_init(struct hash64 *h, uint64_t seed);
+
+/// adds len bytes at data to the hash
+void hash64_update(struct hash64 *h, const void *data, size_t len);
+
+/// the hash of everything added so far; h can still be added to
+uint64_t hash64_digest(const struct hash64 *h);
+
+/**
+ * Hashes all of fd from the start, reading into the buffer returned by
+ * buffer.
+ *
+ * @return 0 if successful, or -1 with errno set
+ */
+int hash64_fd(int fd, char * (*buffer)(size_t *size), uint64_t *digest);
+
+#endif // HASH_H
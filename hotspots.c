@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hotspots.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *hotspot_op_names[HOTSPOT_NOPS] = {
+  "readdir",
+  "stat",
+  "directories",
+};
+
+int hotspots_init(struct hotspots *hs, size_t k) {
+  int i, rc;
+
+  rc = pthread_mutex_init(&hs->mutex, NULL);
+  if(rc) return rc;
+  hs->k = k;
+  for(i = 0; i < HOTSPOT_NOPS; ++i) {
+    hs->threshold[i] = 0;
+    hs->count[i] = 0;
+    hs->heap[i] = malloc(sizeof(struct hotspot) * (k ? k : 1));
+    if(!hs->heap[i]) {
+      for(--i; i >= 0; --i) free(hs->heap[i]);
+      pthread_mutex_destroy(&hs->mutex);
+      return ENOMEM;
+    }
+  }
+  return 0;
+}
+
+uint64_t hotspots_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void hotspot_sift_down(struct hotspot *heap, size_t count, size_t p) {
+  size_t l, r, m;
+  struct hotspot t;
+
+  while((l = (p << 1) | 1) < count) {
+    r = l + 1;
+    m = (r < count && heap[r].nsec < heap[l].nsec) ? r : l;
+    if(heap[p].nsec <= heap[m].nsec) break;
+    t = heap[p];
+    heap[p] = heap[m];
+    heap[m] = t;
+    p = m;
+  }
+}
+
+void hotspots_record(struct hotspots *hs, hotspot_op_t op, const char *path, uint64_t nsec) {
+  struct hotspot *heap;
+  size_t c, p;
+  char *s;
+
+  // cheap unlocked check so that fast operations never touch the mutex
+  if(hs->k == 0 || nsec <= __atomic_load_n(&hs->threshold[op], __ATOMIC_RELAXED))
+    return;
+
+  s = strdup(path);
+  if(!s) return;
+
+  pthread_mutex_lock(&hs->mutex);
+  heap = hs->heap[op];
+  if(hs->count[op] < hs->k) {
+    // sift up
+    c = hs->count[op]++;
+    while(c) {
+      p = (c - 1) >> 1;
+      if(heap[p].nsec <= nsec) break;
+      heap[c] = heap[p];
+      c = p;
+    }
+    heap[c].nsec = nsec;
+    heap[c].path = s;
+    s = NULL;
+  } else if(nsec > heap[0].nsec) {
+    // replace the fastest of the slow
+    free(heap[0].path);
+    heap[0].nsec = nsec;
+    heap[0].path = s;
+    s = NULL;
+    hotspot_sift_down(heap, hs->count[op], 0);
+  }
+  if(hs->count[op] == hs->k) {
+    __atomic_store_n(&hs->threshold[op], heap[0].nsec, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&hs->mutex);
+  free(s);
+}
+
+static int hotspot_cmp_desc(const void *p1, const void *p2) {
+  const struct hotspot *a = p1;
+  const struct hotspot *b = p2;
+  if(a->nsec < b->nsec) return 1;
+  if(a->nsec > b->nsec) return -1;
+  return strcmp(a->path, b->path);
+}
+
+void hotspots_print(struct hotspots *hs, FILE *file) {
+  int i;
+  size_t j;
+
+  pthread_mutex_lock(&hs->mutex);
+  for(i = 0; i < HOTSPOT_NOPS; ++i) {
+    qsort(hs->heap[i], hs->count[i], sizeof(struct hotspot), hotspot_cmp_desc);
+    fprintf(file, "Slowest %s:\n", hotspot_op_names[i]);
+    for(j = 0; j < hs->count[i]; ++j) {
+      fprintf(file, "  %12.6fs  %s\n", hs->heap[i][j].nsec * 1e-9, hs->heap[i][j].path);
+    }
+    // a sorted array is still a valid heap, but in the wrong direction;
+    // rebuild it so that recording can continue after printing
+    for(j = hs->count[i] / 2; j-- > 0;) {
+      hotspot_sift_down(hs->heap[i], hs->count[i], j);
+    }
+  }
+  pthread_mutex_unlock(&hs->mutex);
+}
+
+void hotspots_destroy(struct hotspots *hs) {
+  int i;
+  size_t j;
+
+  for(i = 0; i < HOTSPOT_NOPS; ++i) {
+    for(j = 0; j < hs->count[i]; ++j) {
+      free(hs->heap[i][j].path);
+    }
+    free(hs->heap[i]);
+  }
+  pthread_mutex_destroy(&hs->mutex);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Bounded record of the slowest operations
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HOTSPOTS_H
+#define HOTSPOTS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum hotspot_op {
+  /// opening and reading a directory
+  HOTSPOT_READDIR,
+  /// stat of a single entry
+  HOTSPOT_STAT,
+  /// processing of a whole directory (read, stat and inline file callbacks)
+  HOTSPOT_DIR,
+  HOTSPOT_NOPS
+} hotspot_op_t;
+
+struct hotspot {
+  uint64_t nsec;
+  char *path;
+};
+
+struct hotspots {
+  /// mutex
+  pthread_mutex_t mutex;
+
+  /// number of operations to keep of each kind
+  size_t k;
+
+  /// smallest time in each heap once it is full, 0 while it is not
+  uint64_t threshold[HOTSPOT_NOPS];
+
+  /// min-heaps of the slowest operations of each kind
+  struct hotspot *heap[HOTSPOT_NOPS];
+  size_t count[HOTSPOT_NOPS];
+};
+
+/// initialize a hotspots object that keeps the k slowest of each operation
+int hotspots_init(struct hotspots *hs, size_t k);
+
+/// get a monotonic timestamp in nanoseconds
+uint64_t hotspots_now(void);
+
+/// record that an operation on path took nsec nanoseconds
+void hotspots_record(struct hotspots *hs, hotspot_op_t op, const char *path, uint64_t nsec);
+
+/// print the recorded operations, slowest first
+void hotspots_print(struct hotspots *hs, FILE *file);
+
+/// destroy a hotspots object
+void hotspots_destroy(struct hotspots *hs);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "memacct.h"
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define NAME_WIDTH 26
+#define VALUE_WIDTH 14
+
+struct memacct_counter {
+  /// copied, and cut to what fits in the report
+  char name[NAME_WIDTH - 1];
+  size_t current;
+  size_t peak;
+};
+
+int memacct_enabled;
+
+static struct memacct_counter memacct_counters[MEMACCT_MAX_CATEGORIES] = {
+  [MEMACCT_TASKS] = { "tasks" },
+  [MEMACCT_ENTRIES] = { "entry arrays" },
+  [MEMACCT_NAMES] = { "names" },
+  [MEMACCT_DATA] = { "callback data" },
+  [MEMACCT_QUEUE] = { "thread pool queue" },
+};
+
+static int memacct_count = MEMACCT_BUILTIN;
+static pthread_mutex_t memacct_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// set by the signal handler, which posts memacct_signal_sem
+static volatile sig_atomic_t memacct_signal_pending;
+static sem_t memacct_signal_sem;
+static int memacct_reporter_started;
+
+void memacct_enable(void) {
+  __atomic_store_n(&memacct_enabled, 1, __ATOMIC_RELAXED);
+}
+
+int memacct_register(const char *name) {
+  int category = -1;
+
+  pthread_mutex_lock(&memacct_mutex);
+  if(memacct_count < MEMACCT_MAX_CATEGORIES) {
+    category = memacct_count;
+    strncpy(memacct_counters[category].name, name, sizeof(memacct_counters[category].name) - 1);
+    __atomic_store_n(&memacct_count, memacct_count + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&memacct_mutex);
+  return category;
+}
+
+void memacct_add_slow(int category, ssize_t bytes) {
+  struct memacct_counter *c;
+  size_t current, peak;
+
+  if(category < 0) return;
+  c = &memacct_counters[category];
+  current = __atomic_add_fetch(&c->current, bytes, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while(current > peak) {
+    if(__atomic_compare_exchange_n(&c->peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+}
+
+// formats into a line that memacct_report() write()s to its fd in one call,
+// since the fd has no FILE and the lines should not mix with other output
+static char * memacct_format(char *p, const char *s, size_t value, int width) {
+  char digits[24];
+  int n = 0;
+
+  if(s) {
+    while(*s) *p++ = *s++;
+    return p;
+  }
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while(value);
+  while(width-- > n) *p++ = ' ';
+  while(n) *p++ = digits[--n];
+  return p;
+}
+
+void memacct_report(int fd) {
+  char line[128], *p;
+  const char *name;
+  struct rusage ru;
+  int i, count, len;
+
+  p = line;
+  p = memacct_format(p, "Memory:                          current          peak\n", 0, 0);
+  write(fd, line, p - line);
+  count = __atomic_load_n(&memacct_count, __ATOMIC_ACQUIRE);
+  for(i = 0; i < count; ++i) {
+    name = memacct_counters[i].name;
+    len = strlen(name);
+    if(len > NAME_WIDTH - 2) len = NAME_WIDTH - 2;
+    p = line;
+    p = memacct_format(p, "  ", 0, 0);
+    memcpy(p, name, len);
+    p += len;
+    p = memacct_format(p, NULL,
+      __atomic_load_n(&memacct_counters[i].current, __ATOMIC_RELAXED),
+      NAME_WIDTH - 2 - len + VALUE_WIDTH
+    );
+    p = memacct_format(p, NULL,
+      __atomic_load_n(&memacct_counters[i].peak, __ATOMIC_RELAXED),
+      VALUE_WIDTH
+    );
+    *p++ = '\n';
+    write(fd, line, p - line);
+  }
+  if(getrusage(RUSAGE_SELF, &ru) == 0) {
+    p = line;
+    p = memacct_format(p, "  peak resident set size", 0, 0);
+    // ru_maxrss is in kilobytes on Linux
+    p = memacct_format(p, NULL, (size_t) ru.ru_maxrss * 1024, NAME_WIDTH - 24 + 2 * VALUE_WIDTH);
+    *p++ = '\n';
+    write(fd, line, p - line);
+  }
+}
+
+static void memacct_signal_handler(int signo) {
+  int saved_errno = errno;
+  // sem_post() is async-signal-safe; the report itself is written by
+  // memacct_reporter(), outside the handler
+  memacct_signal_pending = 1;
+  sem_post(&memacct_signal_sem);
+  errno = saved_errno;
+}
+
+static void * memacct_reporter(void *arg) {
+  while(1) {
+    if(sem_wait(&memacct_signal_sem) && errno != EINTR) return NULL;
+    // signals that arrive while a report is written are folded into one
+    if(memacct_signal_pending) {
+      memacct_signal_pending = 0;
+      memacct_report(STDERR_FILENO);
+    }
+  }
+}
+
+int memacct_report_on_signal(int signo) {
+  struct sigaction sa;
+  pthread_t thread;
+  int rc;
+
+  if(!memacct_reporter_started) {
+    if(sem_init(&memacct_signal_sem, 0, 0)) return errno;
+    rc = pthread_create(&thread, NULL, memacct_reporter, NULL);
+    if(rc) {
+      sem_destroy(&memacct_signal_sem);
+      return rc;
+    }
+    pthread_detach(thread);
+    memacct_reporter_started = 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = memacct_signal_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if(sigaction(signo, &sa, NULL)) return errno;
+  return 0;
+}
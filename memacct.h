@@ -0,0 +1,99 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Memory accounting by category
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMACCT_H
+#define MEMACCT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/// categories used by mtpt and the thread pool
+enum memacct_category {
+  /// directory and file tasks, queued or running
+  MEMACCT_TASKS,
+  /// arrays of directory entries
+  MEMACCT_ENTRIES,
+  /// directory entries with their names
+  MEMACCT_NAMES,
+  /// continuations and data returned by callbacks, accounted by the tools
+  MEMACCT_DATA,
+  /// thread pool task queues
+  MEMACCT_QUEUE,
+  MEMACCT_BUILTIN
+};
+
+/// maximum number of categories, including the built-in ones
+#define MEMACCT_MAX_CATEGORIES 32
+
+/**
+ * Non-zero once memacct_enable() has been called.  Nothing is counted
+ * before that, so accounting costs nothing unless it is asked for.
+ */
+extern int memacct_enabled;
+
+/// start counting
+void memacct_enable(void);
+
+/**
+ * Register a category of the caller's own.  name is copied, and cut to the
+ * width of the report.
+ *
+ * @return The category number, or -1 if there are too many
+ */
+int memacct_register(const char *name);
+
+void memacct_add_slow(int category, ssize_t bytes);
+
+/// count bytes allocated (or freed, if negative) in category
+static inline void memacct_add(int category, ssize_t bytes) {
+  if(__builtin_expect(memacct_enabled, 0)) memacct_add_slow(category, bytes);
+}
+
+/**
+ * Write the current and peak bytes of each category and the peak resident
+ * set size to fd.
+ */
+void memacct_report(int fd);
+
+/**
+ * Write the report to stderr whenever signo is received.  The handler only
+ * wakes a thread started by the first call, which writes the report.  Must
+ * be called from the main thread.
+ *
+ * @return 0 if successful, or an error number
+ */
+int memacct_report_on_signal(int signo);
+
+#endif
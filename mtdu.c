@@ -30,6 +30,11 @@
 
 #include "mtpt.h"
 #include "exclude.h"
+#include "memacct.h"
+#include "output.h"
+#include "toolopts.h"
+#include <errno.h>
+#include <getopt.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,7 +43,6 @@
 #include <unistd.h>
 
 #define DEFAULT_NTHREADS 4
-#define STACKSIZE (2<<20) // 2 MB
 #define KiB (1lu << 10)
 #define MiB (1lu << 20)
 #define GiB (1lu << 30)
@@ -57,6 +61,14 @@ static int g_human_readable = 0;
 static char g_line_terminator = '\n';
 static int g_one_file_system = 0;
 static dev_t g_dev;
+static struct toolopts g_opts;
+
+static const struct option long_options[] = {
+  TOOLOPTS_LONG_OPTIONS,
+  TOOLOPTS_SEEDS_LONG_OPTIONS,
+  TOOLOPTS_COSTS_LONG_OPTIONS,
+  {NULL, 0, NULL, 0}
+};
 
 struct file_data {
   size_t size;
@@ -67,7 +79,8 @@ static void usage(FILE *file, const char *arg0) {
     "Usage: %s [options] [path] ...\n"
     "Options:\n"
     "  -H    Print this message\n"
-    "  -j N  Operate on N files at a time (default %d)\n"
+    "  -j N  Operate on N files at a time (default %d, or as tuned\n"
+    "        for the file system)\n"
     "  -e P  Exclude files matching P\n"
     "  -A    Print apparent sizes rather than disk usage\n"
     "  -b    Print sizes in bytes\n"
@@ -80,49 +93,50 @@ static void usage(FILE *file, const char *arg0) {
     "  -0    Terminate each item with a null character rather than newline\n"
     "  -x    Do not cross file system boundaries\n"
     , arg0, DEFAULT_NTHREADS);
+  toolopts_usage(&g_opts, file);
 }
 
 static int print_size(size_t size, const char *path) {
   float f;
   if(size == 0) {
-    return printf("0\t%s%c", path, g_line_terminator);
+    return output_printf("0\t%s%c", path, g_line_terminator);
   }
   if(g_human_readable) {
     if(size < KiB) { // under 1K
-      return printf("%lu\t%s%c", size, path, g_line_terminator);
+      return output_printf("%lu\t%s%c", size, path, g_line_terminator);
     }
     if(size < 10lu * KiB) { // under 10K
       f = ceilf(size * (10.0f / KiB)) * 0.1f;
-      return printf("%.1fK\t%s%c", f, path, g_line_terminator);
+      return output_printf("%.1fK\t%s%c", f, path, g_line_terminator);
     }
     if(size < MiB) { // under 1M
       f = ceilf(size * (1.0f / KiB));
-      return printf("%dK\t%s%c", (int) f, path, g_line_terminator);
+      return output_printf("%dK\t%s%c", (int) f, path, g_line_terminator);
     }
     if(size < 10lu * MiB) { // under 10M
       f = ceilf(size * (10.0f / MiB)) * 0.1f;
-      return printf("%.1fM\t%s%c", f, path, g_line_terminator);
+      return output_printf("%.1fM\t%s%c", f, path, g_line_terminator);
     }
     if(size < GiB) { // under 1G
       f = ceilf(size * (1.0f / MiB));
-      return printf("%dM\t%s%c", (int) f, path, g_line_terminator);
+      return output_printf("%dM\t%s%c", (int) f, path, g_line_terminator);
     }
     if(size < 10lu * GiB) { // under 10G
       f = ceilf(size * (10.0f / GiB)) * 0.1f;
-      return printf("%.1fG\t%s%c", f, path, g_line_terminator);
+      return output_printf("%.1fG\t%s%c", f, path, g_line_terminator);
     }
     if(size < TiB) { // under 1T
       f = ceilf(size * (1.0f / GiB));
-      return printf("%dG\t%s%c", (int) f, path, g_line_terminator);
+      return output_printf("%dG\t%s%c", (int) f, path, g_line_terminator);
     }
     if(size < 10lu * TiB) { // under 10T
       f = ceilf(size * (10.0f / TiB)) * 0.1f;
-      return printf("%.1fT\t%s%c", f, path, g_line_terminator);
+      return output_printf("%.1fT\t%s%c", f, path, g_line_terminator);
     }
     f = ceilf(size * (1.0f / TiB));
-    return printf("%dT\t%s%c", (int) f, path, g_line_terminator);
+    return output_printf("%dT\t%s%c", (int) f, path, g_line_terminator);
   } else {
-    return printf("%lu\t%s%c", (size-1)/g_block_size+1, path, g_line_terminator);
+    return output_printf("%lu\t%s%c", (size-1)/g_block_size+1, path, g_line_terminator);
   }
 }
 
@@ -169,6 +183,7 @@ static void * traverse_dir_exit(
     if(data) {
       size += data->size;
       free(data);
+      memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct file_data));
     }
   }
 
@@ -177,6 +192,7 @@ static void * traverse_dir_exit(
   }
 
   data = malloc(sizeof(struct file_data));
+  memacct_add(MEMACCT_DATA, sizeof(struct file_data));
   data->size = size;
 
   return data;
@@ -217,6 +233,7 @@ static void * traverse_file(
   }
 
   data = malloc(sizeof(struct file_data));
+  memacct_add(MEMACCT_DATA, sizeof(struct file_data));
   data->size = size;
 
   return data;
@@ -235,7 +252,8 @@ static void * traverse_error(
 }
 
 static void process_path(const char *path, size_t threads) {
-  int rc;
+  mtpt_options_t options = g_opts.options;
+  int rc, config = MTPT_CONFIG_SORT;
   size_t l = strlen(path);
   struct file_data *data = NULL;
   struct stat st;
@@ -250,17 +268,19 @@ static void process_path(const char *path, size_t threads) {
     g_dev = st.st_dev;
   }
 
-  rc = mtpt(
+  toolopts_tune(&g_opts, path, &threads, &config, &options);
+  rc = mtpt_opts(
     threads,
-    STACKSIZE,
-    MTPT_CONFIG_SORT,
+    g_opts.stacksize,
+    config,
     path,
     traverse_dir_enter,
     traverse_dir_exit,
     traverse_file,
     traverse_error,
     &l,
-    (void **) &data
+    (void **) &data,
+    &options
   );
   if(rc) {
     perror(path);
@@ -272,27 +292,20 @@ static void process_path(const char *path, size_t threads) {
     }
     g_total += data->size;
     free(data);
+    memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct file_data));
   }
 }
 
 int main(int argc, char **argv) {
-  int opt;
-  size_t threads;
+  int rc, opt;
 
-  threads = DEFAULT_NTHREADS;
+  toolopts_init(&g_opts, TOOLOPTS_SEEDS | TOOLOPTS_COSTS, DEFAULT_NTHREADS);
 
-  while((opt = getopt(argc, argv, "Hj:e:aAbchkm0sx")) != -1) {
+  while((opt = getopt_long(argc, argv, "Hj:e:aAbchkm0sx", long_options, NULL)) != -1) {
     switch(opt) {
     case 'H':
       usage(stdout, argv[0]);
       exit(0);
-    case 'j':
-      threads = atoi(optarg);
-      if(threads <= 0) {
-        fprintf(stderr, "Error: number of threads (-j) must be a positive integer\n");
-        exit(2);
-      }
-      break;
     case 'e':
       g_exclude = realloc(g_exclude, (g_exclude_count+1) * sizeof(char *));
       g_exclude[g_exclude_count++] = optarg;
@@ -328,21 +341,30 @@ int main(int argc, char **argv) {
       g_one_file_system = 1;
       break;
     default:
+      if(toolopts_parse(&g_opts, opt, optarg)) break;
       usage(stderr, argv[0]);
       exit(2);
     }
   }
 
+  toolopts_setup(&g_opts, argv[0]);
+
   if(g_all_files && g_summarize) {
     fprintf(stderr, "%s: cannot both summarize and show all entries\n", argv[0]);
     exit(2);
   }
 
+  rc = output_init(STDOUT_FILENO, 0, isatty(STDOUT_FILENO) ? OUTPUT_ORDERED : 0);
+  if(rc) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+    exit(1);
+  }
+
   if(argc == optind) {
-    process_path(".", threads);
+    process_path(".", g_opts.threads);
   } else {
     for(; optind < argc; ++optind) {
-      process_path(argv[optind], threads);
+      process_path(argv[optind], g_opts.threads);
     }
   }
 
@@ -350,6 +372,14 @@ int main(int argc, char **argv) {
     print_size(g_total, "total");
   }
 
+  rc = output_destroy();
+  if(rc) {
+    fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(rc));
+    g_error = 1;
+  }
+
+  if(toolopts_finish(&g_opts)) g_error = 1;
+
   if(g_exclude) free(g_exclude);
   return g_error;
 }
@@ -31,6 +31,11 @@
 #define _FILE_OFFSET_BITS 64
 #include "mtpt.h"
 #include "exclude.h"
+#include "memacct.h"
+#include "output.h"
+#include "toolopts.h"
+#include <errno.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,13 +44,19 @@
 #define DEFAULT_NTHREADS 4
 #define DEFAULT_FACTOR_GT 10
 #define DEFAULT_FACTOR_LT 100
-#define STACKSIZE (2<<20) // 2 MB
 
 static int g_error = 0;
 static const char **g_exclude = NULL;
 static size_t g_exclude_count = 0;
 static int g_less_than = 0;
 static float g_factor = DEFAULT_FACTOR_GT;
+static struct toolopts g_opts;
+
+static const struct option long_options[] = {
+  TOOLOPTS_LONG_OPTIONS,
+  TOOLOPTS_COSTS_LONG_OPTIONS,
+  {NULL, 0, NULL, 0}
+};
 
 struct traverse_data {
   off_t unreported_size;
@@ -57,11 +68,13 @@ static void usage(FILE *file, const char *arg0) {
     "Usage: %s [options] path ...\n"
     "Options:\n"
     "  -h     Print this message\n"
-    "  -j N   Operate on N files at a time (default %d)\n"
+    "  -j N   Operate on N files at a time (default %d, or as tuned\n"
+    "         for the file system)\n"
     "  -e P   Exclude files matching P\n"
     "  -g[F]  At least F times (default %d) the average size (default)\n"
     "  -l[F]  At most 1/F times (default %d) the average size\n"
     , arg0, DEFAULT_NTHREADS, DEFAULT_FACTOR_GT, DEFAULT_FACTOR_LT);
+  toolopts_usage(&g_opts, file);
 }
 
 static int traverse_dir_enter(
@@ -116,7 +129,7 @@ static void * traverse_dir_exit(
       for(i = 0; i < entries_count; ++i) {
         data = entries[i]->data;
         if(data && data->size <= cutoff) {
-          printf("%6lu %s/%s\n", (long unsigned) data->size, path, entries[i]->name);
+          output_printf("%6lu %s/%s\n", (long unsigned) data->size, path, entries[i]->name);
         }
       }
     } else {
@@ -125,7 +138,7 @@ static void * traverse_dir_exit(
         data = entries[i]->data;
         if(data && data->unreported_size >= cutoff) {
           unreported_size -= data->unreported_size;
-          printf("%12lu %s/%s\n", (long unsigned) data->size, path, entries[i]->name);
+          output_printf("%12lu %s/%s\n", (long unsigned) data->size, path, entries[i]->name);
         }
       }
     }
@@ -134,10 +147,12 @@ static void * traverse_dir_exit(
   for(i = 0; i < entries_count; ++i) {
     if(entries[i]->data) {
       free(entries[i]->data);
+      memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct traverse_data));
     }
   }
 
   data = malloc(sizeof(struct traverse_data));
+  memacct_add(MEMACCT_DATA, sizeof(struct traverse_data));
   data->unreported_size = unreported_size;
   data->size = size;
 
@@ -170,6 +185,7 @@ static void * traverse_file(
     return NULL;
 
   data = malloc(sizeof(struct traverse_data));
+  memacct_add(MEMACCT_DATA, sizeof(struct traverse_data));
   data->unreported_size = st->st_size;
   data->size = st->st_size;
 
@@ -188,24 +204,18 @@ static void * traverse_error(
 }
 
 int main(int argc, char **argv) {
-  int rc, opt;
-  size_t threads, l;
+  mtpt_options_t options;
+  int rc, opt, config;
+  size_t nthreads, l;
   struct traverse_data *data;
 
-  threads = DEFAULT_NTHREADS;
+  toolopts_init(&g_opts, TOOLOPTS_COSTS, DEFAULT_NTHREADS);
 
-  while((opt = getopt(argc, argv, "hvj:e:g::l::")) != -1) {
+  while((opt = getopt_long(argc, argv, "hvj:e:g::l::", long_options, NULL)) != -1) {
     switch(opt) {
     case 'h':
       usage(stdout, argv[0]);
       exit(0);
-    case 'j':
-      threads = atoi(optarg);
-      if(threads <= 0) {
-        fprintf(stderr, "Error: number of threads (-j) must be a positive integer\n");
-        exit(2);
-      }
-      break;
     case 'e':
       g_exclude = realloc(g_exclude, (g_exclude_count+1) * sizeof(char *));
       g_exclude[g_exclude_count++] = optarg;
@@ -227,39 +237,64 @@ int main(int argc, char **argv) {
       }
       break;
     default:
+      if(toolopts_parse(&g_opts, opt, optarg)) break;
       usage(stderr, argv[0]);
       exit(2);
     }
   }
 
+  toolopts_setup(&g_opts, argv[0]);
+
   if(argc == optind) {
     fprintf(stderr, "Error: path not given\n");
     usage(stderr, argv[0]);
     exit(2);
   }
 
+  rc = output_init(STDOUT_FILENO, 0, isatty(STDOUT_FILENO) ? OUTPUT_ORDERED : 0);
+  if(rc) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+    exit(1);
+  }
+
   for(; optind < argc; ++optind) {
+    options = g_opts.options;
+    config = MTPT_CONFIG_SORT;
+    nthreads = g_opts.threads;
+    toolopts_tune(&g_opts, argv[optind], &nthreads, &config, &options);
     data = NULL;
     l = strlen(argv[optind]);
-    rc = mtpt(
-      threads,
-      STACKSIZE,
-      MTPT_CONFIG_SORT,
+    rc = mtpt_opts(
+      nthreads,
+      g_opts.stacksize,
+      config,
       argv[optind],
       traverse_dir_enter,
       traverse_dir_exit,
       traverse_file,
       traverse_error,
       &l,
-      (void **) &data
+      (void **) &data,
+      &options
     );
     if(rc) {
       perror(argv[optind]);
       g_error = 1;
     }
-    if(data) free(data);
+    if(data) {
+      free(data);
+      memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct traverse_data));
+    }
   }
 
+  rc = output_destroy();
+  if(rc) {
+    fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(rc));
+    g_error = 1;
+  }
+
+  if(toolopts_finish(&g_opts)) g_error = 1;
+
   if(g_exclude) free(g_exclude);
   return g_error;
 }
@@ -0,0 +1,186 @@
+#include "mtpt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NDIRS 20
+#define NFILES 50
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++g_failures; \
+  } \
+} while(0)
+
+static char g_root[] = "/tmp/mtpt-iter-test.XXXXXX";
+
+static void make_file(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+}
+
+/*
+ * root/dNN/fNN for NDIRS directories of NFILES files, plus root/link.
+ */
+static size_t make_tree(void) {
+  char path[256];
+  size_t i, j;
+
+  if(!mkdtemp(g_root)) {
+    perror(g_root);
+    exit(1);
+  }
+  for(i = 0; i < NDIRS; ++i) {
+    snprintf(path, sizeof(path), "%s/d%02zu", g_root, i);
+    if(mkdir(path, 0755)) {
+      perror(path);
+      exit(1);
+    }
+    for(j = 0; j < NFILES; ++j) {
+      snprintf(path, sizeof(path), "%s/d%02zu/f%02zu", g_root, i, j);
+      make_file(path);
+    }
+  }
+  snprintf(path, sizeof(path), "%s/link", g_root);
+  if(symlink("d00", path)) {
+    perror(path);
+    exit(1);
+  }
+  return 1 + NDIRS + NDIRS * NFILES + 1;
+}
+
+static void remove_tree(void) {
+  char path[256];
+  size_t i, j;
+
+  for(i = 0; i < NDIRS; ++i) {
+    for(j = 0; j < NFILES; ++j) {
+      snprintf(path, sizeof(path), "%s/d%02zu/f%02zu", g_root, i, j);
+      unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/d%02zu", g_root, i);
+    rmdir(path);
+  }
+  snprintf(path, sizeof(path), "%s/link", g_root);
+  unlink(path);
+  rmdir(g_root);
+}
+
+/*
+ * Pulls every record, checking that each path comes once and after its
+ * directory.
+ */
+static void test_walk(size_t nthreads, int config, size_t capacity, size_t expect) {
+  char seen_dir[NDIRS] = {0};
+  char seen_file[NDIRS][NFILES];
+  const mtpt_iter_record_t *r;
+  mtpt_iter_t *iter;
+  size_t rootlen = strlen(g_root), n = 0, dirs = 0, files = 0, links = 0;
+  unsigned d, f;
+  int root = 0;
+
+  memset(seen_file, 0, sizeof(seen_file));
+  iter = mtpt_iter_open(nthreads, 0, config, g_root, capacity, NULL);
+  CHECK(iter != NULL);
+  if(!iter) return;
+  while((r = mtpt_iter_next(iter))) {
+    ++n;
+    CHECK(r->error == 0);
+    CHECK(strncmp(r->path, g_root, rootlen) == 0);
+    if(r->path[rootlen] == '\0') {
+      CHECK(!root);
+      CHECK(n == 1);
+      CHECK(S_ISDIR(r->st.st_mode));
+      root = 1;
+    } else if(sscanf(r->path + rootlen, "/d%2u/f%2u", &d, &f) == 2) {
+      CHECK(d < NDIRS && f < NFILES);
+      if(d >= NDIRS || f >= NFILES) continue;
+      CHECK(seen_dir[d]);
+      CHECK(!seen_file[d][f]);
+      CHECK(S_ISREG(r->st.st_mode));
+      seen_file[d][f] = 1;
+      ++files;
+    } else if(sscanf(r->path + rootlen, "/d%2u", &d) == 1) {
+      CHECK(d < NDIRS);
+      if(d >= NDIRS) continue;
+      CHECK(root);
+      CHECK(!seen_dir[d]);
+      CHECK(S_ISDIR(r->st.st_mode));
+      seen_dir[d] = 1;
+      ++dirs;
+    } else {
+      CHECK(strcmp(r->path + rootlen, "/link") == 0);
+      CHECK(S_ISLNK(r->st.st_mode));
+      ++links;
+    }
+  }
+  CHECK(errno == 0);
+  mtpt_iter_close(iter);
+
+  CHECK(n == expect);
+  CHECK(dirs == NDIRS);
+  CHECK(files == NDIRS * NFILES);
+  CHECK(links == 1);
+}
+
+/*
+ * Closing before the end stops the traversal, even while the threads are
+ * waiting for room in a full ring.
+ */
+static void test_close_early(void) {
+  const mtpt_iter_record_t *r;
+  mtpt_iter_t *iter;
+  size_t n = 0;
+
+  iter = mtpt_iter_open(4, 0, MTPT_CONFIG_FILE_TASKS, g_root, 2, NULL);
+  CHECK(iter != NULL);
+  if(!iter) return;
+  while(n < 5 && (r = mtpt_iter_next(iter))) ++n;
+  CHECK(n == 5);
+  mtpt_iter_close(iter);
+}
+
+static void test_missing(void) {
+  char path[256];
+  const mtpt_iter_record_t *r;
+  mtpt_iter_t *iter;
+
+  snprintf(path, sizeof(path), "%s/missing", g_root);
+  iter = mtpt_iter_open(2, 0, 0, path, 0, NULL);
+  CHECK(iter != NULL);
+  if(!iter) return;
+  r = mtpt_iter_next(iter);
+  CHECK(r == NULL);
+  CHECK(errno == ENOENT);
+  mtpt_iter_close(iter);
+}
+
+int main(int argc, char **argv) {
+  size_t expect = make_tree();
+
+  test_walk(1, 0, 0, expect);
+  test_walk(4, MTPT_CONFIG_SORT, 0, expect);
+  test_walk(8, MTPT_CONFIG_FILE_TASKS, 3, expect);
+  test_walk(16, MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_INODE_ORDER, 1, expect);
+  test_close_early();
+  test_missing();
+
+  remove_tree();
+  if(g_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], g_failures);
+    return 1;
+  }
+  printf("%s: ok\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,232 @@
+#include "mtpt.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NDIRS 10
+#define NFILES 40
+#define NTHREADS 4
+#define NDATA_THREADS 3
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++g_failures; \
+  } \
+} while(0)
+
+static char g_root[] = "/tmp/mtpt-submit-test.XXXXXX";
+
+/// the threads seen doing each kind of work
+struct threads {
+  pthread_mutex_t mutex;
+  pthread_t ids[64];
+  size_t count;
+};
+
+static struct threads g_file_threads = { PTHREAD_MUTEX_INITIALIZER };
+static struct threads g_data_threads = { PTHREAD_MUTEX_INITIALIZER };
+
+static void threads_add(struct threads *t) {
+  pthread_t self = pthread_self();
+  size_t i;
+
+  pthread_mutex_lock(&t->mutex);
+  for(i = 0; i < t->count; ++i) {
+    if(pthread_equal(t->ids[i], self)) break;
+  }
+  if(i == t->count && t->count < sizeof(t->ids) / sizeof(t->ids[0])) {
+    t->ids[t->count++] = self;
+  }
+  pthread_mutex_unlock(&t->mutex);
+}
+
+static int threads_overlap(struct threads *a, struct threads *b) {
+  size_t i, j;
+
+  for(i = 0; i < a->count; ++i) {
+    for(j = 0; j < b->count; ++j) {
+      if(pthread_equal(a->ids[i], b->ids[j])) return 1;
+    }
+  }
+  return 0;
+}
+
+static void threads_clear(struct threads *t) {
+  t->count = 0;
+}
+
+/// the continuation of each directory, counting the work done for it
+struct dir {
+  size_t files;
+  size_t routines;
+};
+
+static int g_inline;
+
+static void second_routine(void *arg) {
+  struct dir *d = arg;
+
+  threads_add(&g_data_threads);
+  __atomic_add_fetch(&d->routines, 1, __ATOMIC_RELAXED);
+}
+
+static void first_routine(void *arg) {
+  struct dir *d = arg;
+
+  threads_add(&g_data_threads);
+  // slow enough that the directory would be exited early if it did not wait
+  usleep(1000);
+  __atomic_add_fetch(&d->routines, 1, __ATOMIC_RELAXED);
+  // work submitted by submitted work joins the same directory
+  mtpt_submit(second_routine, d);
+}
+
+static int dir_enter(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *pcontinuation,
+  void **continuation
+) {
+  *continuation = calloc(1, sizeof(struct dir));
+  return 1;
+}
+
+static void * dir_exit(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *continuation,
+  mtpt_dir_entry_t **entries,
+  size_t entries_count
+) {
+  struct dir *d = continuation;
+
+  CHECK(__atomic_load_n(&d->routines, __ATOMIC_RELAXED) == 2 * d->files);
+  free(d);
+  return NULL;
+}
+
+static void * file(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *continuation
+) {
+  struct dir *d = continuation;
+  size_t before;
+
+  threads_add(&g_file_threads);
+  __atomic_add_fetch(&d->files, 1, __ATOMIC_RELAXED);
+  before = __atomic_load_n(&d->routines, __ATOMIC_RELAXED);
+  mtpt_submit(first_routine, d);
+  if(g_inline) {
+    // no data threads, so both routines have run by now
+    CHECK(__atomic_load_n(&d->routines, __ATOMIC_RELAXED) >= before + 2);
+  }
+  return NULL;
+}
+
+static void * error(void *arg, const char *path, const struct stat *st, void *continuation) {
+  perror(path);
+  ++g_failures;
+  return NULL;
+}
+
+static void make_tree(void) {
+  char path[256];
+  size_t i, j;
+  int fd;
+
+  if(!mkdtemp(g_root)) {
+    perror(g_root);
+    exit(1);
+  }
+  for(i = 0; i < NDIRS; ++i) {
+    snprintf(path, sizeof(path), "%s/d%02zu", g_root, i);
+    if(mkdir(path, 0755)) {
+      perror(path);
+      exit(1);
+    }
+    for(j = 0; j < NFILES; ++j) {
+      snprintf(path, sizeof(path), "%s/d%02zu/f%02zu", g_root, i, j);
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd == -1) {
+        perror(path);
+        exit(1);
+      }
+      close(fd);
+    }
+  }
+}
+
+static void remove_tree(void) {
+  char path[256];
+  size_t i, j;
+
+  for(i = 0; i < NDIRS; ++i) {
+    for(j = 0; j < NFILES; ++j) {
+      snprintf(path, sizeof(path), "%s/d%02zu/f%02zu", g_root, i, j);
+      unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/d%02zu", g_root, i);
+    rmdir(path);
+  }
+  rmdir(g_root);
+}
+
+static void run(int config, size_t data_threads) {
+  mtpt_options_t options;
+  int rc;
+
+  memset(&options, 0, sizeof(options));
+  options.data_threads = data_threads;
+  threads_clear(&g_file_threads);
+  threads_clear(&g_data_threads);
+  g_inline = data_threads == 0;
+  rc = mtpt_opts(NTHREADS, 0, config, g_root, dir_enter, dir_exit, file, error, NULL, NULL, &options);
+  CHECK(rc == 0);
+}
+
+/*
+ * Submitted work runs on the data threads only, and a directory is not
+ * exited until the work submitted for its files, and the work that work
+ * submitted, has returned.
+ */
+static void test_data_threads(int config) {
+  run(config, NDATA_THREADS);
+  CHECK(g_file_threads.count > 0);
+  CHECK(g_data_threads.count > 0);
+  CHECK(g_data_threads.count <= NDATA_THREADS);
+  CHECK(!threads_overlap(&g_file_threads, &g_data_threads));
+}
+
+/// without data threads the work runs in the file method's thread
+static void test_inline(void) {
+  run(MTPT_CONFIG_FILE_TASKS, 0);
+  CHECK(g_data_threads.count > 0);
+  CHECK(threads_overlap(&g_file_threads, &g_data_threads));
+}
+
+int main(int argc, char **argv) {
+  make_tree();
+  test_data_threads(0);
+  test_data_threads(MTPT_CONFIG_FILE_TASKS);
+  test_data_threads(MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT);
+  test_inline();
+  remove_tree();
+
+  if(g_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], g_failures);
+    return 1;
+  }
+  printf("%s: ok\n", argv[0]);
+  return 0;
+}
@@ -84,6 +84,7 @@ int main(int argc, char **argv) {
 
   rc = mtpt(
     4,         // nthreads
+    0,         // stacksize
     MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT, // config
     argv[1],   // path
     dir_enter, // dir_enter_method
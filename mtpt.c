@@ -30,15 +30,37 @@
 
 #include "mtpt.h"
 #include "threadpool.h"
+#include "costs.h"
+#include "hotspots.h"
+#include "memacct.h"
+#include "ratelimit.h"
+#include "seeds.h"
+#include "slab.h"
 #include <pthread.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Number of directory entries that are charged as one metadata operation to
+ * the rate limiter, roughly what a single getdents() call returns.
+ */
+#define READDIR_ENTRIES_PER_OP 1024
+
+/// mtpt_op_t entry value for operations on the directory itself
+#define NO_ENTRY ((size_t) -1)
+
+struct mtpt_op;
 
 typedef struct mtpt {
   struct threadpool tp;
@@ -48,42 +70,191 @@ typedef struct mtpt {
   mtpt_error_method_t error_method;
   void *arg;
   int config;
+  struct hotspots *hotspots;
+  struct ratelimit *ratelimit;
+  struct costs *costs;
+  mtpt_deferred_method_t deferred_method;
+  size_t readdir_buffer_size;
+  /// each thread's readdir buffer, with readdir_buffer_size set
+  pthread_key_t readdir_buffer_key;
+  /// where the tasks are allocated from
+  struct slab dir_tasks;
+  struct slab file_tasks;
+  struct slab data_tasks;
+  /// number of threads for mtpt_submit(), 0 to run submissions inline
+  size_t data_threads;
   int finished;
-  size_t spinlock_countdown;
   pthread_mutex_t mutex;
   pthread_cond_t finished_cond;
+
+  /// watchdog timeout in nanoseconds, 0 if disabled
+  uint64_t watchdog_timeout;
+  int watchdog_stop;
+  pthread_t watchdog;
+  pthread_mutex_t watchdog_mutex;
+  pthread_cond_t watchdog_cond;
+
+  /// file system calls in progress, only tracked with the watchdog enabled
+  struct mtpt_op *ops;
+
+  /// references held by mtpt() and by threads the watchdog gave up on
+  size_t refs;
 } mtpt_t;
 
+/// the thread pool's worker classes, the second only with data_threads
+#define MTPT_CLASS_META 0
+#define MTPT_CLASS_DATA 1
+
 typedef enum mtpt_task_type {
   TASK_TYPE_DIR_ENTER,
   TASK_TYPE_FILE,
   TASK_TYPE_DIR_EXIT
 } mtpt_task_type_t;
 
+/*
+ * Tasks are queued in threadpool buckets keyed by type, then by the log2
+ * class of their cost in the previous run, then by depth, so that deeper
+ * directories are finished before new subtrees are opened up.  Tasks with
+ * the same key run in the order they were queued, which is the sorted order
+ * of the entries with MTPT_CONFIG_SORT.
+ */
+#define MTPT_DEPTH_LEVELS 64
+#define MTPT_COST_CLASSES 16
+#define MTPT_BUCKETS (3 * MTPT_COST_CLASSES * MTPT_DEPTH_LEVELS)
+
+typedef struct mtpt_ino_entry {
+  ino_t ino;
+  mtpt_dir_entry_t *entry;
+} mtpt_ino_entry_t;
+
 typedef struct mtpt_dir_task {
   mtpt_task_type_t type;
-  pthread_mutex_t mutex;
+  struct threadpool_node node;
+  /// the children, the scan and the subdirectories' exits; exits when done
+  struct threadpool_group group;
   mtpt_t *mtpt;
   void **data;
   struct mtpt_dir_task *parent;
+  const struct seeds *seed;
   void *continuation;
   mtpt_dir_entry_t **entries;
   size_t entries_count;
-  size_t children;
+  /// the entries in the order they are stat'd, with MTPT_CONFIG_INODE_ORDER
+  mtpt_ino_entry_t *stat_order;
+  /// bytes allocated for entries and stat_order
+  size_t entries_bytes;
+  size_t next_entry;
+  /// number of directories above this one, the root being 0
+  unsigned depth;
+  /// cost of this subtree in the previous run, to schedule by
+  uint64_t cost;
+  /// time spent and entries found in this subtree so far, added atomically
+  uint64_t subtree_nsec;
+  uint64_t subtree_entries;
   struct stat st;
   char path[1];
 } mtpt_dir_task_t;
 
+/// an open directory being read by readdir() or getdents64()
+typedef struct mtpt_dir {
+  DIR *d;
+  int fd;
+  char *buf;
+  size_t size;
+  size_t pos;
+  size_t len;
+} mtpt_dir_t;
+
+#ifdef __linux__
+struct mtpt_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
 typedef struct mtpt_file_task {
   mtpt_task_type_t type;
+  struct threadpool_node node;
   mtpt_t *mtpt;
   void **data;
   struct mtpt_dir_task *parent;
+  unsigned depth;
   struct stat st;
   char path[1];
 } mtpt_file_task_t;
 
+/// work passed to mtpt_submit() by a file method
+typedef struct mtpt_data_task {
+  struct threadpool_node node;
+  mtpt_t *mtpt;
+  /// the directory whose group waits for this
+  struct mtpt_dir_task *dir;
+  void (*routine)(void *);
+  void *arg;
+} mtpt_data_task_t;
+
+/// what mtpt_submit() needs to know about the file method or data task calling it
+typedef struct mtpt_submitter {
+  mtpt_t *mtpt;
+  /// the directory of the file, which waits for the submitted work
+  struct mtpt_dir_task *dir;
+} mtpt_submitter_t;
+
+/// each thread's mtpt_submitter_t while it is in a file method or data task
+static pthread_key_t mtpt_submit_key;
+static pthread_once_t mtpt_submit_once = PTHREAD_ONCE_INIT;
+static int mtpt_submit_key_valid;
+
+/// number of children a scan collects before queueing them together
+#define MTPT_BATCH_SIZE 64
+
+/// children found by a scan that have not been queued yet
+typedef struct mtpt_batch {
+  struct threadpool_node *head;
+  struct threadpool_node *tail;
+  size_t count;
+} mtpt_batch_t;
+
+/// a file system call that the watchdog is keeping an eye on
+typedef struct mtpt_op {
+  struct mtpt_op *prev;
+  struct mtpt_op *next;
+  pthread_t thread;
+  uint64_t start;
+  const char *name;
+  const char *path;
+  mtpt_dir_task_t *task;
+  size_t entry;
+  /// children the blocked thread has yet to queue, or NULL
+  mtpt_batch_t *batch;
+  int abandoned;
+} mtpt_op_t;
+
 static void mtpt_dir_exit_task_handler(void *arg);
+static void mtpt_dir_enter_task_handler(void *arg);
+
+static uint64_t mtpt_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned mtpt_task_key(
+  mtpt_task_type_t type,
+  uint64_t cost,
+  unsigned depth
+) {
+  unsigned cost_class = 0;
+
+  // about a millisecond for the first class, doubling with each one after
+  for(cost >>= 20; cost && cost_class < MTPT_COST_CLASSES - 1; cost >>= 1)
+    ++cost_class;
+  if(depth >= MTPT_DEPTH_LEVELS) depth = MTPT_DEPTH_LEVELS - 1;
+  return (type * MTPT_COST_CLASSES + cost_class) * MTPT_DEPTH_LEVELS + depth;
+}
 
 static void mtpt_root_task_finished(mtpt_t *mtpt) {
   pthread_mutex_lock(&mtpt->mutex);
@@ -92,127 +263,280 @@ static void mtpt_root_task_finished(mtpt_t *mtpt) {
   pthread_mutex_unlock(&mtpt->mutex);
 }
 
-static mtpt_file_task_t * mtpt_file_task_new(const char *path) {
+static mtpt_file_task_t * mtpt_file_task_new(mtpt_t *mtpt, const char *path) {
   mtpt_file_task_t *task;
 
-  task = malloc(sizeof(mtpt_file_task_t) + strlen(path));
+  task = slab_alloc(&mtpt->file_tasks, sizeof(mtpt_file_task_t) + strlen(path));
   if(!task) return NULL;
   task->type = TASK_TYPE_FILE;
+  task->mtpt = mtpt;
   strcpy(task->path, path);
   return task;
 }
 
-static mtpt_dir_task_t * mtpt_dir_task_new(const char *path) {
+static void mtpt_file_task_delete(mtpt_file_task_t *task) {
+  slab_free(&task->mtpt->file_tasks, task, sizeof(mtpt_file_task_t) + strlen(task->path));
+}
+
+static mtpt_dir_task_t * mtpt_dir_task_new(
+  mtpt_t *mtpt,
+  mtpt_dir_task_t *parent,
+  const char *path
+) {
   mtpt_dir_task_t *task;
-  int rc;
 
-  task = malloc(sizeof(mtpt_dir_task_t) + strlen(path));
+  task = slab_alloc(&mtpt->dir_tasks, sizeof(mtpt_dir_task_t) + strlen(path));
   if(!task) return NULL;
-  rc = pthread_mutex_init(&task->mutex, NULL);
-  if(rc) {
-    free(task);
-    errno = rc;
-    return NULL;
-  }
   task->type = TASK_TYPE_DIR_ENTER;
+  task->mtpt = mtpt;
+  task->parent = parent;
+  threadpool_group_init(&task->group, parent ? &parent->group : NULL);
+  task->seed = NULL;
   task->continuation = NULL;
   task->entries = NULL;
   task->entries_count = 0;
-  task->children = 0;
+  task->stat_order = NULL;
+  task->entries_bytes = 0;
+  task->depth = 0;
+  task->cost = 0;
+  task->subtree_nsec = 0;
+  task->subtree_entries = 0;
   strcpy(task->path, path);
   return task;
 }
 
-static void mtpt_dir_task_delete(mtpt_dir_task_t *task) {
-  size_t i;
-
-  pthread_mutex_destroy(&task->mutex);
-  if(task->entries) {
-    for(i = 0; i < task->entries_count; ++i) {
-      free(task->entries[i]);
-    }
-    free(task->entries);
-  }
-  free(task);
-}
-
 static mtpt_dir_entry_t * mtpt_dir_entry_new(const char *name) {
-  mtpt_dir_entry_t *entry = malloc(sizeof(mtpt_dir_entry_t) + strlen(name));
+  size_t size = sizeof(mtpt_dir_entry_t) + strlen(name);
+  mtpt_dir_entry_t *entry = malloc(size);
   if(!entry) return NULL;
+  memacct_add(MEMACCT_NAMES, size);
   entry->data = NULL;
   strcpy(entry->name, name);
   return entry;
 }
 
+static void mtpt_dir_entries_free(
+  mtpt_dir_entry_t **entries,
+  size_t entries_count,
+  mtpt_ino_entry_t *stat_order,
+  size_t bytes
+) {
+  size_t i, names = 0;
+
+  for(i = 0; i < entries_count; ++i) {
+    names += sizeof(mtpt_dir_entry_t) + strlen(entries[i]->name);
+    free(entries[i]);
+  }
+  memacct_add(MEMACCT_NAMES, -(ssize_t) names);
+  memacct_add(MEMACCT_ENTRIES, -(ssize_t) bytes);
+  free(entries);
+  free(stat_order);
+}
+
+static void mtpt_dir_task_delete(mtpt_dir_task_t *task) {
+  if(task->entries) {
+    mtpt_dir_entries_free(task->entries, task->entries_count, task->stat_order, task->entries_bytes);
+  }
+  slab_free(&task->mtpt->dir_tasks, task, sizeof(mtpt_dir_task_t) + strlen(task->path));
+}
+
+/// queue the task that node is embedded in, as a member of a group that already counts it
+static int mtpt_queue(
+  mtpt_t *mtpt,
+  struct threadpool_node *node,
+  void (*routine)(void *),
+  void *arg,
+  unsigned key,
+  struct threadpool_group *group
+) {
+  node->next = NULL;
+  node->routine = routine;
+  node->arg = arg;
+  node->key = key;
+  node->cls = MTPT_CLASS_META;
+  node->group = group;
+  return threadpool_add_nodes(&mtpt->tp, node);
+}
+
+/// the group that a dir task's enter and scan are counted in
+static inline struct threadpool_group * mtpt_dir_task_member_of(mtpt_dir_task_t *task) {
+  return task->parent ? &task->parent->group : NULL;
+}
+
 static int mtpt_dir_entry_pcmp(const void *p1, const void *p2) {
   const mtpt_dir_entry_t * const *e1 = p1;
   const mtpt_dir_entry_t * const *e2 = p2;
   return strcmp((*e1)->name, (*e2)->name);
 }
 
-static void mtpt_dir_task_child_finished(mtpt_dir_task_t *task) {
-  mtpt_t *mtpt = task->mtpt;
-  int rc;
+static int mtpt_ino_entry_cmp(const void *p1, const void *p2) {
+  const mtpt_ino_entry_t *e1 = p1;
+  const mtpt_ino_entry_t *e2 = p2;
+  return (e1->ino > e2->ino) - (e1->ino < e2->ino);
+}
 
-  pthread_mutex_lock(&task->mutex);
-  if(--task->children == 0) {
-    task->type = TASK_TYPE_DIR_EXIT;
-    rc = threadpool_add(&mtpt->tp, mtpt_dir_exit_task_handler, task);
-    if(rc) {
-      /*
-       * Getting here is bad.  This task has no more children and needs to be
-       * put back in the queue so that its dir_exit_method can be run, but
-       * there's not enough resources to add it back to the queue.  This will
-       * have a cascading effect back up to the root task, and since the main
-       * thread is blocked waiting on it to finish, this will lead to deadlock.
-       *
-       * To try and avoid this situation, print an error message and keep
-       * trying to re-add this task's parent to the queue (a spinlock of
-       * sorts).  It is possible that all threads end up at this point, at
-       * which point we'd have a livelock on our hands.
-       *
-       * The livelock can be detected by keeping track of how many threads are
-       * in this spinlock.  When livelock happens, our only choice is to abort
-       * the process.
-       */
-      pthread_mutex_lock(&mtpt->mutex);
-      if(--mtpt->spinlock_countdown == 0) {
-        fprintf(stderr, "All threads have reached spinlock. Aborting.\n");
-        abort();
-      }
-      fprintf(stderr,
-        "Cannot requeue %s for processing because %s. Will keep trying.\n",
-        task->path,
-        strerror(rc)
-      );
-      pthread_mutex_unlock(&mtpt->mutex);
-      do {
-        sleep(1); // so we don't chew up the CPU
-        rc = threadpool_add(&mtpt->tp, mtpt_dir_exit_task_handler, task);
-      } while(rc);
-      fprintf(stderr,
-        "Successfully requeued %s for processing.\n",
-        task->path
-      );
-      pthread_mutex_lock(&mtpt->mutex);
-      ++mtpt->spinlock_countdown;
-      pthread_mutex_unlock(&mtpt->mutex);
+static int mtpt_dir_open(mtpt_t *mtpt, mtpt_dir_t *dir, const char *path) {
+#ifdef __linux__
+  if(mtpt->readdir_buffer_size) {
+    dir->buf = pthread_getspecific(mtpt->readdir_buffer_key);
+    if(!dir->buf) {
+      dir->buf = malloc(mtpt->readdir_buffer_size);
+      if(!dir->buf) return -1;
+      pthread_setspecific(mtpt->readdir_buffer_key, dir->buf);
     }
+    dir->size = mtpt->readdir_buffer_size;
+    dir->pos = dir->len = 0;
+    dir->d = NULL;
+    dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return dir->fd == -1 ? -1 : 0;
+  }
+#endif
+  dir->d = opendir(path);
+  return dir->d ? 0 : -1;
+}
+
+/**
+ * Reads the next entry of dir.  Returns 1 and sets *name and *ino if there
+ * is one, 0 at the end, or -1 if there was an error and sets errno.
+ */
+static int mtpt_dir_read(mtpt_dir_t *dir, const char **name, ino_t *ino) {
+  struct dirent *dirp;
+
+#ifdef __linux__
+  if(!dir->d) {
+    struct mtpt_dirent64 *dent;
+    long n;
+
+    if(dir->pos >= dir->len) {
+      n = syscall(SYS_getdents64, dir->fd, dir->buf, dir->size);
+      if(n == -1) return -1;
+      if(n == 0) return 0;
+      dir->pos = 0;
+      dir->len = n;
+    }
+    dent = (struct mtpt_dirent64 *) (dir->buf + dir->pos);
+    dir->pos += dent->d_reclen;
+    *name = dent->d_name;
+    *ino = dent->d_ino;
+    return 1;
+  }
+#endif
+  errno = 0;
+  dirp = readdir(dir->d);
+  if(!dirp) return errno ? -1 : 0;
+  *name = dirp->d_name;
+  *ino = dirp->d_ino;
+  return 1;
+}
+
+static void mtpt_dir_close(mtpt_dir_t *dir) {
+  if(dir->d) closedir(dir->d);
+  else close(dir->fd);
+}
+
+/**
+ * Add the subtree's totals to the parent's.  The parent's group counts this
+ * task until the calling task returns, so they are in before the parent's
+ * totals are read.
+ */
+static void mtpt_dir_task_notify_parent(mtpt_dir_task_t *task) {
+  if(task->mtpt->costs) {
+    costs_record(task->mtpt->costs, task->path, task->subtree_nsec, task->subtree_entries);
+  }
+  if(task->parent) {
+    __atomic_add_fetch(&task->parent->subtree_nsec, task->subtree_nsec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&task->parent->subtree_entries, task->subtree_entries, __ATOMIC_RELAXED);
+  } else {
+    mtpt_root_task_finished(task->mtpt);
+  }
+}
+
+/// finish a task that will never be scanned, dropping its group's creator hold
+static void mtpt_dir_task_finished(mtpt_dir_task_t *task) {
+  threadpool_group_release(&task->mtpt->tp, &task->group);
+  mtpt_dir_task_notify_parent(task);
+  mtpt_dir_task_delete(task);
+}
+
+static void mtpt_submit_key_create(void) {
+  mtpt_submit_key_valid = pthread_key_create(&mtpt_submit_key, NULL) == 0;
+}
+
+/// call the file method for a file in dir, letting it use mtpt_submit()
+static void * mtpt_call_file_method(
+  mtpt_t *mtpt,
+  mtpt_dir_task_t *dir,
+  const char *path,
+  const struct stat *st,
+  void *continuation
+) {
+  mtpt_submitter_t submitter;
+  void *data;
+
+  if(!mtpt->data_threads || !mtpt_submit_key_valid) {
+    return (*mtpt->file_method)(mtpt->arg, path, st, continuation);
   }
-  pthread_mutex_unlock(&task->mutex);
+  submitter.mtpt = mtpt;
+  submitter.dir = dir;
+  pthread_setspecific(mtpt_submit_key, &submitter);
+  data = (*mtpt->file_method)(mtpt->arg, path, st, continuation);
+  pthread_setspecific(mtpt_submit_key, NULL);
+  return data;
+}
+
+static void mtpt_data_task_handler(void *arg) {
+  mtpt_data_task_t *task = arg;
+  mtpt_submitter_t submitter;
+
+  // work submitted from here joins the same directory
+  submitter.mtpt = task->mtpt;
+  submitter.dir = task->dir;
+  pthread_setspecific(mtpt_submit_key, &submitter);
+  (*task->routine)(task->arg);
+  pthread_setspecific(mtpt_submit_key, NULL);
+  // the directory's group is released when this returns
+  slab_free(&task->mtpt->data_tasks, task, sizeof(mtpt_data_task_t));
+}
+
+void mtpt_submit(void (*routine)(void *), void *arg) {
+  mtpt_submitter_t *submitter = NULL;
+  mtpt_data_task_t *task;
+  mtpt_t *mtpt;
+
+  if(mtpt_submit_key_valid) submitter = pthread_getspecific(mtpt_submit_key);
+  if(!submitter) goto run;
+  mtpt = submitter->mtpt;
+  task = slab_alloc(&mtpt->data_tasks, sizeof(mtpt_data_task_t));
+  if(!task) goto run;
+  task->mtpt = mtpt;
+  task->dir = submitter->dir;
+  task->routine = routine;
+  task->arg = arg;
+  task->node.next = NULL;
+  task->node.routine = mtpt_data_task_handler;
+  task->node.arg = task;
+  task->node.key = mtpt_task_key(TASK_TYPE_FILE, 0, submitter->dir->depth + 1);
+  task->node.cls = MTPT_CLASS_DATA;
+  if(threadpool_group_add(&mtpt->tp, &submitter->dir->group, &task->node) == 0) return;
+  slab_free(&mtpt->data_tasks, task, sizeof(mtpt_data_task_t));
+run:
+  (*routine)(arg);
 }
 
 static void mtpt_file_task_handler(void *arg) {
   mtpt_file_task_t *task = arg;
   mtpt_t *mtpt = task->mtpt;
+  uint64_t start = 0;
 
+  if(mtpt->costs) start = mtpt_now();
   if(mtpt->file_method) {
     void *continuation = NULL;
     if(task->parent) {
       continuation = task->parent->continuation;
     }
-    *task->data = (*mtpt->file_method)(
-      mtpt->arg,
+    *task->data = mtpt_call_file_method(
+      mtpt,
+      task->parent,
       task->path,
       &task->st,
       continuation
@@ -220,19 +544,17 @@ static void mtpt_file_task_handler(void *arg) {
   }
 
   // files (non-directories) will never be the root task and will always
-  // have a parent
-  mtpt_dir_task_child_finished(task->parent);
-  free(task);
+  // have a parent, whose group is released when this returns
+  if(start) {
+    __atomic_add_fetch(&task->parent->subtree_nsec, mtpt_now() - start, __ATOMIC_RELAXED);
+  }
+  mtpt_file_task_delete(task);
 }
 
 static void mtpt_dir_exit_task_handler(void *arg) {
   mtpt_dir_task_t *task = arg;
   mtpt_t *mtpt = task->mtpt;
 
-  // wait until mtpt_dir_task_child_finished() is done with me
-  pthread_mutex_lock(&task->mutex);
-  pthread_mutex_unlock(&task->mutex);
-
   if(mtpt->dir_exit_method) {
     *task->data = (*mtpt->dir_exit_method)(
       mtpt->arg,
@@ -244,23 +566,519 @@ static void mtpt_dir_exit_task_handler(void *arg) {
     );
   }
 
-  if(task->parent) {
-    mtpt_dir_task_child_finished(task->parent);
+  mtpt_dir_task_notify_parent(task);
+  mtpt_dir_task_delete(task);
+}
+
+static void mtpt_dir_task_scan_finished(mtpt_dir_task_t *task, uint64_t nsec) {
+  mtpt_t *mtpt = task->mtpt;
+
+  __atomic_add_fetch(&task->subtree_nsec, nsec, __ATOMIC_RELAXED);
+
+  // exit once the children are done, here if they already are
+  task->type = TASK_TYPE_DIR_EXIT;
+  task->node.routine = mtpt_dir_exit_task_handler;
+  task->node.arg = task;
+  task->node.key = mtpt_task_key(TASK_TYPE_DIR_EXIT, task->cost, task->depth);
+  task->node.cls = MTPT_CLASS_META;
+  threadpool_group_continue(&task->group, &task->node);
+  threadpool_group_finish(&mtpt->tp, &task->group);
+}
+
+static void mtpt_release(mtpt_t *mtpt) {
+  int last;
+
+  // this thread may outlive mtpt, so its cached tasks go back now
+  slab_flush(&mtpt->dir_tasks);
+  slab_flush(&mtpt->file_tasks);
+  slab_flush(&mtpt->data_tasks);
+
+  pthread_mutex_lock(&mtpt->watchdog_mutex);
+  last = --mtpt->refs == 0;
+  pthread_mutex_unlock(&mtpt->watchdog_mutex);
+
+  if(last) {
+    slab_destroy(&mtpt->data_tasks);
+    slab_destroy(&mtpt->file_tasks);
+    slab_destroy(&mtpt->dir_tasks);
+    pthread_cond_destroy(&mtpt->watchdog_cond);
+    pthread_mutex_destroy(&mtpt->watchdog_mutex);
+    pthread_cond_destroy(&mtpt->finished_cond);
+    pthread_mutex_destroy(&mtpt->mutex);
+    free(mtpt);
+  }
+}
+
+static inline void mtpt_op_begin(
+  mtpt_t *mtpt,
+  mtpt_op_t *op,
+  const char *name,
+  const char *path,
+  mtpt_dir_task_t *task,
+  size_t entry,
+  mtpt_batch_t *batch
+) {
+  if(!mtpt->watchdog_timeout) return;
+  op->thread = pthread_self();
+  op->start = mtpt_now();
+  op->name = name;
+  op->path = path;
+  op->task = task;
+  op->entry = entry;
+  op->batch = batch;
+  op->abandoned = 0;
+  op->prev = NULL;
+  pthread_mutex_lock(&mtpt->watchdog_mutex);
+  op->next = mtpt->ops;
+  if(op->next) op->next->prev = op;
+  mtpt->ops = op;
+  pthread_mutex_unlock(&mtpt->watchdog_mutex);
+}
+
+/**
+ * Returns non-zero if the watchdog has given up on the operation.  The task
+ * then belongs to the watchdog: the calling thread must free anything else
+ * it owns without touching the task and call mtpt_op_abandoned().
+ */
+static inline int mtpt_op_end(mtpt_t *mtpt, mtpt_op_t *op) {
+  int abandoned;
+
+  if(!mtpt->watchdog_timeout) return 0;
+  pthread_mutex_lock(&mtpt->watchdog_mutex);
+  abandoned = op->abandoned;
+  if(!abandoned) {
+    if(op->prev) op->prev->next = op->next;
+    else mtpt->ops = op->next;
+    if(op->next) op->next->prev = op->prev;
+  }
+  pthread_mutex_unlock(&mtpt->watchdog_mutex);
+  return abandoned;
+}
+
+static void mtpt_op_abandoned(mtpt_t *mtpt) {
+  // the thread pool has already replaced this thread, and mtpt() may have
+  // returned by now, so this thread cannot go back to the pool
+  mtpt_release(mtpt);
+  pthread_exit(NULL);
+}
+
+static void mtpt_dir_scan(mtpt_dir_task_t *task);
+
+static void mtpt_dir_scan_task_handler(void *arg) {
+  mtpt_dir_scan(arg);
+}
+
+static inline void mtpt_batch_add(
+  mtpt_batch_t *batch,
+  struct threadpool_node *node,
+  void (*routine)(void *),
+  void *arg,
+  unsigned key
+) {
+  node->next = NULL;
+  node->routine = routine;
+  node->arg = arg;
+  node->key = key;
+  node->cls = MTPT_CLASS_META;
+  if(batch->tail) batch->tail->next = node;
+  else batch->head = node;
+  batch->tail = node;
+  ++batch->count;
+}
+
+/**
+ * Queue the children in batch with one call into the thread pool.  The
+ * caller must hold task's group so that it cannot exit before the children
+ * are counted.
+ */
+static void mtpt_dir_scan_flush(mtpt_dir_task_t *task, mtpt_batch_t *batch) {
+  mtpt_t *mtpt = task->mtpt;
+  struct threadpool_node *node, *next;
+  int rc;
+
+  if(batch->count == 0) return;
+  rc = threadpool_group_add(&mtpt->tp, &task->group, batch->head);
+  for(node = rc ? batch->head : NULL; node; node = next) {
+    void *arg = node->arg;
+    next = node->next;
+    if(*(mtpt_task_type_t *) arg == TASK_TYPE_FILE) {
+      mtpt_file_task_t *t = arg;
+      if(mtpt->error_method) {
+        errno = rc;
+        *task->data = (*mtpt->error_method)(mtpt->arg, t->path, &t->st, NULL);
+      }
+      mtpt_file_task_delete(t);
+    } else {
+      mtpt_dir_task_t *t = arg;
+      if(mtpt->error_method) {
+        errno = rc;
+        *task->data = (*mtpt->error_method)(mtpt->arg, t->path, &t->st, NULL);
+      }
+      threadpool_group_release(&mtpt->tp, &t->group);
+      mtpt_dir_task_delete(t);
+    }
+  }
+  batch->head = batch->tail = NULL;
+  batch->count = 0;
+}
+
+static void mtpt_defer(
+  mtpt_t *mtpt,
+  pthread_t thread,
+  const char *name,
+  const char *path,
+  mtpt_dir_task_t *task,
+  size_t entry,
+  mtpt_batch_t *batch,
+  uint64_t elapsed
+) {
+  struct threadpool_group *group;
+  int rc;
+
+  fprintf(stderr,
+    "%s on %s has not returned after %.1f seconds. Deferring.\n",
+    name,
+    path,
+    elapsed * 1e-9
+  );
+  rc = threadpool_abandon(&mtpt->tp, thread);
+  if(rc) {
+    fprintf(stderr, "Cannot replace blocked thread because %s.\n", strerror(rc));
+  }
+  if(mtpt->deferred_method) {
+    (*mtpt->deferred_method)(mtpt->arg, path);
+  }
+
+  if(entry == NO_ENTRY) {
+    // the directory itself could not be read; the blocked thread gave the
+    // task up with the op and never touches it again, so it ends here
+    if(mtpt->error_method) {
+      errno = ETIMEDOUT;
+      *task->data = (*mtpt->error_method)(mtpt->arg, task->path, &task->st, task->continuation);
+    }
+    // stand in for the blocked thread, which will never return to the pool
+    group = mtpt_dir_task_member_of(task);
+    mtpt_dir_task_finished(task);
+    if(group) threadpool_group_release(&mtpt->tp, group);
   } else {
-    mtpt_root_task_finished(mtpt);
+    // queue the children the blocked thread had found, then skip the entry
+    // and let another thread carry on with the rest
+    if(batch) mtpt_dir_scan_flush(task, batch);
+    // the blocked thread's membership in the parent's group goes with it
+    task->next_entry = entry + 1;
+    group = mtpt_dir_task_member_of(task);
+    rc = mtpt_queue(mtpt, &task->node, mtpt_dir_scan_task_handler, task,
+      mtpt_task_key(task->type, task->cost, task->depth), group);
+    if(rc) {
+      mtpt_dir_scan(task);
+      if(group) threadpool_group_release(&mtpt->tp, group);
+    }
   }
-  mtpt_dir_task_delete(task);
+}
+
+static void * mtpt_watchdog(void *arg) {
+  mtpt_t *mtpt = arg;
+  mtpt_op_t *op;
+  uint64_t now, period;
+  struct timespec ts;
+  pthread_t thread;
+  const char *name;
+  mtpt_dir_task_t *task;
+  size_t entry;
+  mtpt_batch_t batch;
+  int has_batch;
+  uint64_t elapsed;
+  char *path;
+
+  period = mtpt->watchdog_timeout / 4;
+  if(period < 10000000u) period = 10000000u;
+
+  pthread_mutex_lock(&mtpt->watchdog_mutex);
+  while(!mtpt->watchdog_stop) {
+    now = mtpt_now();
+    for(op = mtpt->ops; op; op = op->next) {
+      if(now - op->start >= mtpt->watchdog_timeout) break;
+    }
+    if(!op) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += period / 1000000000u;
+      ts.tv_nsec += period % 1000000000u;
+      if(ts.tv_nsec >= 1000000000) {
+        ts.tv_nsec -= 1000000000;
+        ++ts.tv_sec;
+      }
+      pthread_cond_timedwait(&mtpt->watchdog_cond, &mtpt->watchdog_mutex, &ts);
+      continue;
+    }
+
+    // give up on op; its thread now holds a reference to mtpt
+    path = strdup(op->path);
+    if(!path) break;
+    op->abandoned = 1;
+    if(op->prev) op->prev->next = op->next;
+    else mtpt->ops = op->next;
+    if(op->next) op->next->prev = op->prev;
+    ++mtpt->refs;
+    thread = op->thread;
+    name = op->name;
+    task = op->task;
+    entry = op->entry;
+    // the blocked thread's stack goes away if it returns and exits
+    has_batch = op->batch && op->batch->count;
+    if(has_batch) batch = *op->batch;
+    elapsed = now - op->start;
+    pthread_mutex_unlock(&mtpt->watchdog_mutex);
+
+    mtpt_defer(mtpt, thread, name, path, task, entry, has_batch ? &batch : NULL, elapsed);
+    free(path);
+
+    pthread_mutex_lock(&mtpt->watchdog_mutex);
+  }
+  pthread_mutex_unlock(&mtpt->watchdog_mutex);
+  return NULL;
+}
+
+/// an lstat of the root path, shared with the thread that makes it
+typedef struct mtpt_root_stat {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int done;
+  int rc;
+  int error;
+  /// the caller's and the thread's, whichever lets go last frees it
+  int refs;
+  struct stat st;
+  char path[1];
+} mtpt_root_stat_t;
+
+static void mtpt_root_stat_release(mtpt_root_stat_t *rs) {
+  int last;
+
+  pthread_mutex_lock(&rs->mutex);
+  last = --rs->refs == 0;
+  pthread_mutex_unlock(&rs->mutex);
+  if(last) {
+    pthread_cond_destroy(&rs->cond);
+    pthread_mutex_destroy(&rs->mutex);
+    free(rs);
+  }
+}
+
+static void * mtpt_root_stat_thread(void *arg) {
+  mtpt_root_stat_t *rs = arg;
+  int rc, error;
+
+  rc = lstat(rs->path, &rs->st);
+  error = errno;
+  pthread_mutex_lock(&rs->mutex);
+  rs->rc = rc;
+  rs->error = error;
+  rs->done = 1;
+  pthread_cond_signal(&rs->cond);
+  pthread_mutex_unlock(&rs->mutex);
+  mtpt_root_stat_release(rs);
+  return NULL;
+}
+
+/**
+ * lstat the root path as the watchdog would: before the traversal starts
+ * there is no pool to replace a blocked thread, so the call is made in a
+ * thread of its own, which is left behind if it has not returned within the
+ * timeout.  Returns -1 and sets errno to ETIMEDOUT if it has not.
+ */
+static int mtpt_root_stat(const char *path, struct stat *st, double timeout) {
+  mtpt_root_stat_t *rs;
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct timespec ts;
+  uint64_t nsec = timeout * 1e9;
+  int rc = 0, ret;
+
+  if(!nsec) return lstat(path, st);
+
+  rs = malloc(sizeof(mtpt_root_stat_t) + strlen(path));
+  if(!rs) return -1;
+  strcpy(rs->path, path);
+  rs->done = 0;
+  rs->refs = 2;
+  rc = pthread_mutex_init(&rs->mutex, NULL);
+  if(rc) goto err0;
+  rc = pthread_cond_init(&rs->cond, NULL);
+  if(rc) goto err1;
+  rc = pthread_attr_init(&attr);
+  if(rc) goto err2;
+  rc = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if(rc == 0) rc = pthread_create(&thread, &attr, mtpt_root_stat_thread, rs);
+  pthread_attr_destroy(&attr);
+  if(rc) goto err2;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += nsec / 1000000000u;
+  ts.tv_nsec += nsec % 1000000000u;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_nsec -= 1000000000;
+    ++ts.tv_sec;
+  }
+  pthread_mutex_lock(&rs->mutex);
+  while(!rs->done) {
+    if(pthread_cond_timedwait(&rs->cond, &rs->mutex, &ts) == ETIMEDOUT) break;
+  }
+  if(rs->done) {
+    ret = rs->rc;
+    rc = rs->error;
+    *st = rs->st;
+  } else {
+    fprintf(stderr,
+      "lstat on %s has not returned after %.1f seconds. Giving up.\n",
+      path,
+      timeout
+    );
+    ret = -1;
+    rc = ETIMEDOUT;
+  }
+  pthread_mutex_unlock(&rs->mutex);
+  mtpt_root_stat_release(rs);
+  if(ret) errno = rc;
+  return ret;
+
+err2:
+  pthread_cond_destroy(&rs->cond);
+err1:
+  pthread_mutex_destroy(&rs->mutex);
+err0:
+  free(rs);
+  errno = rc;
+  return -1;
+}
+
+static void mtpt_dir_scan(mtpt_dir_task_t *task) {
+  mtpt_t *mtpt = task->mtpt;
+  mtpt_dir_entry_t *entry;
+  mtpt_op_t op;
+  mtpt_batch_t batch;
+  size_t i, len;
+  int rc;
+  uint64_t dir_start = 0, dir_nsec = 0, start = 0;
+  char *path;
+
+  // the path is built on the heap so that the threads can have small stacks
+  len = strlen(task->path);
+  path = malloc(len + NAME_MAX + 2);
+  if(!path) {
+    if(mtpt->error_method) {
+      *task->data = (*mtpt->error_method)(mtpt->arg, task->path, &task->st, task->continuation);
+    }
+    task->next_entry = task->entries_count;
+  }
+  batch.head = batch.tail = NULL;
+  batch.count = 0;
+
+  if(mtpt->hotspots || mtpt->costs) {
+    dir_start = mtpt_now();
+  }
+
+  // loop through entries
+  for(i = task->next_entry; i < task->entries_count; ++i) {
+    struct stat st;
+
+    entry = task->stat_order ? task->stat_order[i].entry : task->entries[i];
+    memcpy(path, task->path, len);
+    path[len] = '/';
+    strcpy(path + len + 1, entry->name);
+    if(len + 1 + strlen(entry->name) >= PATH_MAX) {
+      // the buffer holds any name, but the system calls would refuse it
+      if(mtpt->error_method) {
+        errno = ENAMETOOLONG;
+        *task->data = (*mtpt->error_method)(mtpt->arg, path, NULL, NULL);
+      }
+      continue;
+    }
+    if(mtpt->ratelimit) ratelimit_acquire(mtpt->ratelimit, 1);
+    if(mtpt->hotspots) start = hotspots_now();
+    mtpt_op_begin(mtpt, &op, "lstat", path, task, i, &batch);
+    rc = lstat(path, &st);
+    if(mtpt_op_end(mtpt, &op)) {
+      free(path);
+      mtpt_op_abandoned(mtpt);
+    }
+    if(mtpt->hotspots) {
+      hotspots_record(mtpt->hotspots, HOTSPOT_STAT, path, hotspots_now() - start);
+    }
+    if(rc) {
+      if(errno != ENOENT) {
+        if(mtpt->error_method) {
+          *task->data = (*mtpt->error_method)(mtpt->arg, path, NULL, NULL);
+        }
+      }
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+      mtpt_dir_task_t *t = mtpt_dir_task_new(mtpt, task, path);
+      if(!t) goto task_new_fail;
+      t->data = &entry->data;
+      t->st = st;
+      if(task->seed) {
+        t->seed = seeds_child(task->seed, entry->name);
+        if(t->seed && t->seed->whole) t->seed = NULL;
+      }
+      t->depth = task->depth + 1;
+      if(mtpt->costs) t->cost = costs_lookup(mtpt->costs, path);
+      mtpt_batch_add(&batch, &t->node, mtpt_dir_enter_task_handler, t,
+        mtpt_task_key(TASK_TYPE_DIR_ENTER, t->cost, t->depth));
+    } else if(mtpt->config & MTPT_CONFIG_FILE_TASKS) {
+      mtpt_file_task_t *t = mtpt_file_task_new(mtpt, path);
+      if(!t) goto task_new_fail;
+      t->data = &entry->data;
+      t->parent = task;
+      t->depth = task->depth + 1;
+      t->st = st;
+      mtpt_batch_add(&batch, &t->node, mtpt_file_task_handler, t,
+        mtpt_task_key(TASK_TYPE_FILE, 0, t->depth));
+    } else {
+      if(mtpt->file_method) {
+        void *continuation = NULL;
+        if(task->parent) {
+          continuation = task->parent->continuation;
+        }
+        entry->data = mtpt_call_file_method(mtpt, task, path, &st, continuation);
+      }
+    }
+    if(batch.count == MTPT_BATCH_SIZE) mtpt_dir_scan_flush(task, &batch);
+    continue;
+
+task_new_fail:
+    if(mtpt->error_method) {
+      *task->data = (*mtpt->error_method)(mtpt->arg, path, &st, NULL);
+    }
+  }
+  mtpt_dir_scan_flush(task, &batch);
+  free(path);
+
+  if(mtpt->hotspots || mtpt->costs) {
+    dir_nsec = mtpt_now() - dir_start;
+  }
+  if(mtpt->hotspots) {
+    hotspots_record(mtpt->hotspots, HOTSPOT_DIR, task->path, dir_nsec);
+  }
+
+  mtpt_dir_task_scan_finished(task, dir_nsec);
 }
 
 static void mtpt_dir_enter_task_handler(void *arg) {
   mtpt_dir_task_t *task = arg;
   mtpt_t *mtpt = task->mtpt;
-  DIR *d;
-  struct dirent *dirp;
+  mtpt_dir_t dir;
+  const char *name;
+  ino_t ino;
   mtpt_dir_entry_t *entry;
   mtpt_dir_entry_t **entries;
-  size_t entries_size, entries_count, i;
-  int rc, no_children;
+  mtpt_ino_entry_t *stat_order = NULL;
+  size_t entries_size, entries_count, entries_bytes, i;
+  void *p;
+  mtpt_op_t op;
+  int rc;
+  uint64_t start = 0;
 
   if(mtpt->dir_enter_method) {
     void *pcontinuation = NULL;
@@ -275,23 +1093,47 @@ static void mtpt_dir_enter_task_handler(void *arg) {
       &task->continuation
     );
     if(!rc) {
-      if(task->parent) {
-        mtpt_dir_task_child_finished(task->parent);
-      } else {
-        mtpt_root_task_finished(mtpt);
-      }
-      mtpt_dir_task_delete(task);
+      mtpt_dir_task_finished(task);
       return;
     }
   }
 
+  if(task->seed) {
+    // only the seeded entries are traversed, and they are already sorted
+    entries_count = task->seed->count;
+    entries_bytes = sizeof(mtpt_dir_entry_t *) * (entries_count ? entries_count : 1);
+    entries = malloc(entries_bytes);
+    if(!entries) goto entries_malloc_fail;
+    memacct_add(MEMACCT_ENTRIES, entries_bytes);
+    for(i = 0; i < entries_count; ++i) {
+      entries[i] = mtpt_dir_entry_new(task->seed->children[i]->name);
+      if(!entries[i]) {
+        rc = errno;
+        mtpt_dir_entries_free(entries, i, NULL, entries_bytes);
+        errno = rc;
+        goto entries_malloc_fail;
+      }
+    }
+    goto have_entries;
+  }
+
+  if(mtpt->hotspots || mtpt->costs) {
+    start = mtpt_now();
+  }
+
   // open the directory
-  d = opendir(task->path);
-  if(!d) {
+  if(mtpt->ratelimit) ratelimit_acquire(mtpt->ratelimit, 1);
+  mtpt_op_begin(mtpt, &op, "opendir", task->path, task, NO_ENTRY, NULL);
+  rc = mtpt_dir_open(mtpt, &dir, task->path);
+  if(mtpt_op_end(mtpt, &op)) {
+    if(rc == 0) mtpt_dir_close(&dir);
+    mtpt_op_abandoned(mtpt);
+  }
+  if(rc) {
     if(mtpt->error_method) {
       *task->data = (*mtpt->error_method)(mtpt->arg, task->path, &task->st, task->continuation);
     }
-    mtpt_dir_task_delete(task);
+    mtpt_dir_task_finished(task);
     return;
   }
 
@@ -299,138 +1141,130 @@ static void mtpt_dir_enter_task_handler(void *arg) {
   entries_size = 256;
   entries_count = 0;
   entries = malloc(sizeof(mtpt_dir_entry_t *) * entries_size);
-  if(!entries) goto entries_malloc_fail;
-  while(errno = 0, (dirp = readdir(d))) {
-    if(strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+  if(!entries) {
+    mtpt_dir_close(&dir);
+    goto entries_malloc_fail;
+  }
+  entries_bytes = sizeof(mtpt_dir_entry_t *) * entries_size;
+  if(mtpt->config & MTPT_CONFIG_INODE_ORDER) {
+    stat_order = malloc(sizeof(mtpt_ino_entry_t) * entries_size);
+    if(!stat_order) {
+      free(entries);
+      mtpt_dir_close(&dir);
+      goto entries_malloc_fail;
+    }
+    entries_bytes += sizeof(mtpt_ino_entry_t) * entries_size;
+  }
+  memacct_add(MEMACCT_ENTRIES, entries_bytes);
+  mtpt_op_begin(mtpt, &op, "readdir", task->path, task, NO_ENTRY, NULL);
+  while((rc = mtpt_dir_read(&dir, &name, &ino)) == 1) {
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
       continue;
+    if(mtpt->ratelimit && entries_count % READDIR_ENTRIES_PER_OP == READDIR_ENTRIES_PER_OP - 1) {
+      // waiting for the rate limit is not the directory hanging
+      if(mtpt_op_end(mtpt, &op)) goto abandoned;
+      ratelimit_acquire(mtpt->ratelimit, 1);
+      mtpt_op_begin(mtpt, &op, "readdir", task->path, task, NO_ENTRY, NULL);
+    }
     if(entries_count == entries_size) {
+      p = realloc(entries, sizeof(mtpt_dir_entry_t *) * (entries_size << 1));
+      if(!p) goto entries_realloc_fail;
+      entries = p;
+      memacct_add(MEMACCT_ENTRIES, sizeof(mtpt_dir_entry_t *) * entries_size);
+      entries_bytes += sizeof(mtpt_dir_entry_t *) * entries_size;
+      if(stat_order) {
+        p = realloc(stat_order, sizeof(mtpt_ino_entry_t) * (entries_size << 1));
+        if(!p) goto entries_realloc_fail;
+        stat_order = p;
+        memacct_add(MEMACCT_ENTRIES, sizeof(mtpt_ino_entry_t) * entries_size);
+        entries_bytes += sizeof(mtpt_ino_entry_t) * entries_size;
+      }
       entries_size <<= 1;
-      entries = realloc(entries, sizeof(char *) * entries_size);
-      if(!entries) goto entries_realloc_fail;
     }
-    entry = mtpt_dir_entry_new(dirp->d_name);
+    entry = mtpt_dir_entry_new(name);
     if(!entry) goto entries_realloc_fail;
+    if(stat_order) {
+      stat_order[entries_count].ino = ino;
+      stat_order[entries_count].entry = entry;
+    }
     entries[entries_count++] = entry;
   }
-  if(errno) {
+  if(rc) {
 entries_realloc_fail:
     rc = errno;
-    for(i = 0; i < entries_count; ++i) {
-      free(entries[i]);
-    }
-    free(entries);
+    if(mtpt_op_end(mtpt, &op)) goto abandoned;
+    mtpt_dir_entries_free(entries, entries_count, stat_order, entries_bytes);
+    mtpt_dir_close(&dir);
     errno = rc;
 entries_malloc_fail:
     if(mtpt->error_method) {
       *task->data = (*mtpt->error_method)(mtpt->arg, task->path, &task->st, task->continuation);
     }
-    closedir(d);
-    mtpt_dir_task_delete(task);
+    mtpt_dir_task_finished(task);
     return;
   }
-  closedir(d);
+  if(mtpt_op_end(mtpt, &op)) {
+abandoned:
+    mtpt_dir_entries_free(entries, entries_count, stat_order, entries_bytes);
+    mtpt_dir_close(&dir);
+    mtpt_op_abandoned(mtpt);
+  }
+  mtpt_dir_close(&dir);
+  if(mtpt->hotspots || mtpt->costs) {
+    // no children yet, so the subtree counts need no lock
+    start = mtpt_now() - start;
+    task->subtree_nsec += start;
+  }
+  if(mtpt->hotspots) {
+    hotspots_record(mtpt->hotspots, HOTSPOT_READDIR, task->path, start);
+  }
+  if(stat_order) {
+    qsort(stat_order, entries_count, sizeof(mtpt_ino_entry_t), mtpt_ino_entry_cmp);
+  }
   if(mtpt->config & MTPT_CONFIG_SORT) {
     qsort(entries, entries_count, sizeof(mtpt_dir_entry_t *), mtpt_dir_entry_pcmp);
   }
+have_entries:
   task->entries = entries;
   task->entries_count = entries_count;
+  task->subtree_entries += entries_count;
+  task->stat_order = stat_order;
+  task->entries_bytes = entries_bytes;
+  task->next_entry = 0;
 
-  // loop through entries
-  no_children = 1;
-  pthread_mutex_lock(&task->mutex);
-  for(i = 0; i < entries_count; ++i) {
-    struct stat st;
-    char path[PATH_MAX];
-
-    entry = entries[i];
-    snprintf(path, PATH_MAX, "%s/%s", task->path, entry->name);
-    rc = lstat(path, &st);
-    if(rc) {
-      if(errno != ENOENT) {
-        if(mtpt->error_method) {
-          *task->data = (*mtpt->error_method)(mtpt->arg, path, NULL, NULL);
-        }
-      }
-      continue;
-    }
-
-    if(S_ISDIR(st.st_mode)) {
-      mtpt_dir_task_t *t = mtpt_dir_task_new(path);
-      if(!t) goto dir_task_new_fail;
-      t->mtpt = mtpt;
-      t->data = &entry->data;
-      t->parent = task;
-      t->st = st;
-      rc = threadpool_add(&mtpt->tp, mtpt_dir_enter_task_handler, t);
-      if(rc) {
-        mtpt_dir_task_delete(t);
-        errno = rc;
-dir_task_new_fail:
-        if(mtpt->error_method) {
-          *task->data = (*mtpt->error_method)(mtpt->arg, path, &st, NULL);
-        }
-      } else {
-        ++task->children;
-        no_children = 0;
-      }
-    } else if(mtpt->config & MTPT_CONFIG_FILE_TASKS) {
-      mtpt_file_task_t *t = mtpt_file_task_new(path);
-      if(!t) goto file_task_new_fail;
-      t->mtpt = mtpt;
-      t->data = &entry->data;
-      t->parent = task;
-      t->st = st;
-      rc = threadpool_add(&mtpt->tp, mtpt_file_task_handler, t);
-      if(rc) {
-        free(t);
-        errno = rc;
-file_task_new_fail:
-        if(mtpt->error_method) {
-          *task->data = (*mtpt->error_method)(mtpt->arg, path, &st, NULL);
-        }
-      } else {
-        ++task->children;
-        no_children = 0;
-      }
-    } else {
-      if(mtpt->file_method) {
-        void *continuation = NULL;
-        if(task->parent) {
-          continuation = task->parent->continuation;
-        }
-        entry->data = (*mtpt->file_method)(mtpt->arg, path, &st, continuation);
-      }
-    }
-  }
-  pthread_mutex_unlock(&task->mutex);
-
-  if(no_children) {
-    mtpt_dir_exit_task_handler(task);
-  }
+  // the group's creator hold keeps the task from exiting until the scan
+  // has queued all of its children
+  mtpt_dir_scan(task);
 }
 
-static int mtpt_task_priority_cmp(
-  const struct threadpool_task *a,
-  const struct threadpool_task *b
+int mtpt(
+  size_t nthreads,
+  size_t stacksize,
+  int config,
+  const char *path,
+  mtpt_dir_enter_method_t dir_enter_method,
+  mtpt_dir_exit_method_t dir_exit_method,
+  mtpt_file_method_t file_method,
+  mtpt_error_method_t error_method,
+  void *arg,
+  void **data
 ) {
-  mtpt_task_type_t *type_a = a->arg;
-  mtpt_task_type_t *type_b = b->arg;
-  int diff = *type_a - *type_b;
-  if(diff) return diff;
-  if(*type_a == TASK_TYPE_FILE) {
-    const mtpt_file_task_t *task_a = a->arg;
-    if(!(task_a->mtpt->config & MTPT_CONFIG_SORT)) return 0;
-    const mtpt_file_task_t *task_b = b->arg;
-    return strcmp(task_b->path, task_a->path);
-  } else {
-    const mtpt_dir_task_t *task_a = a->arg;
-    if(!(task_a->mtpt->config & MTPT_CONFIG_SORT)) return 0;
-    const mtpt_dir_task_t *task_b = b->arg;
-    return strcmp(task_b->path, task_a->path);
-  }
+  return mtpt_opts(
+    nthreads,
+    stacksize,
+    config,
+    path,
+    dir_enter_method,
+    dir_exit_method,
+    file_method,
+    error_method,
+    arg,
+    data,
+    NULL
+  );
 }
 
-int mtpt(
+int mtpt_opts(
   size_t nthreads,
   size_t stacksize,
   int config,
@@ -440,16 +1274,20 @@ int mtpt(
   mtpt_file_method_t file_method,
   mtpt_error_method_t error_method,
   void *arg,
-  void **data
+  void **data,
+  const mtpt_options_t *options
 ) {
-  mtpt_t mtpt;
+  static const mtpt_options_t default_options;
+  mtpt_t *mtpt;
   struct stat st;
   void *d = NULL;
   mtpt_dir_task_t *root_task;
   int rc, ret = 0;
 
-  // stat path
-  rc = lstat(path, &st);
+  if(!options) options = &default_options;
+
+  // stat path, which may hang like any other
+  rc = mtpt_root_stat(path, &st, options->watchdog_timeout);
   if(rc) return -1;
 
   // if the root path is not a directory, just handle it in this thread
@@ -459,68 +1297,422 @@ int mtpt(
     return 0;
   }
 
-  // create task for root path
-  root_task = mtpt_dir_task_new(path);
-  if(root_task == NULL) return -1;
-  root_task->mtpt = &mtpt;
-  root_task->data = &d;
-  root_task->parent = NULL;
-  root_task->st = st;
+  // the mtpt structure is reference counted because threads that the
+  // watchdog gave up on may still be using it after this function returns
+  mtpt = malloc(sizeof(mtpt_t));
+  if(mtpt == NULL) return -1;
 
   // initialize the mtpt structure
-  rc = pthread_mutex_init(&mtpt.mutex, NULL);
+  rc = pthread_mutex_init(&mtpt->mutex, NULL);
   if(rc) {
     errno = rc;
     ret = -1;
     goto out1;
   }
-  rc = pthread_cond_init(&mtpt.finished_cond, NULL);
+  rc = pthread_cond_init(&mtpt->finished_cond, NULL);
   if(rc) {
     errno = rc;
     ret = -1;
     goto out2;
   }
-  rc = threadpool_init_prio(&mtpt.tp, nthreads, stacksize, 0, mtpt_task_priority_cmp);
+  rc = pthread_mutex_init(&mtpt->watchdog_mutex, NULL);
   if(rc) {
     errno = rc;
     ret = -1;
     goto out3;
   }
-  mtpt.dir_enter_method = dir_enter_method;
-  mtpt.dir_exit_method = dir_exit_method;
-  mtpt.file_method = file_method;
-  mtpt.error_method = error_method;
-  mtpt.arg = arg;
-  mtpt.config = config;
-  mtpt.finished = 0;
-  mtpt.spinlock_countdown = nthreads;
+  rc = pthread_cond_init(&mtpt->watchdog_cond, NULL);
+  if(rc) {
+    errno = rc;
+    ret = -1;
+    goto out4;
+  }
+  rc = slab_init(&mtpt->dir_tasks, NULL, NULL, MEMACCT_TASKS);
+  if(rc) {
+    errno = rc;
+    ret = -1;
+    goto out5;
+  }
+  rc = slab_init(&mtpt->file_tasks, NULL, NULL, MEMACCT_TASKS);
+  if(rc) {
+    errno = rc;
+    ret = -1;
+    goto out6;
+  }
+  rc = slab_init(&mtpt->data_tasks, NULL, NULL, MEMACCT_TASKS);
+  if(rc) {
+    errno = rc;
+    ret = -1;
+    goto out7;
+  }
+
+  // create task for root path
+  root_task = mtpt_dir_task_new(mtpt, NULL, path);
+  if(root_task == NULL) {
+    ret = -1;
+    goto out8;
+  }
+  root_task->data = &d;
+  root_task->st = st;
+  if(options->seeds && !options->seeds->whole) {
+    root_task->seed = options->seeds;
+  }
+
+  mtpt->dir_enter_method = dir_enter_method;
+  mtpt->dir_exit_method = dir_exit_method;
+  mtpt->file_method = file_method;
+  mtpt->error_method = error_method;
+  mtpt->deferred_method = options->deferred_method;
+  mtpt->arg = arg;
+  mtpt->config = config;
+  mtpt->hotspots = options->hotspots;
+  mtpt->ratelimit = options->ratelimit;
+  mtpt->costs = options->costs;
+  mtpt->data_threads = options->data_threads;
+  if(mtpt->data_threads) pthread_once(&mtpt_submit_once, mtpt_submit_key_create);
+#ifdef __linux__
+  mtpt->readdir_buffer_size = options->readdir_buffer_size;
+#else
+  mtpt->readdir_buffer_size = 0;
+#endif
+  mtpt->watchdog_timeout = options->watchdog_timeout * 1e9;
+  mtpt->watchdog_stop = 0;
+  mtpt->ops = NULL;
+  mtpt->refs = 1;
+  mtpt->finished = 0;
+  if(mtpt->readdir_buffer_size) {
+    // the buffers are freed as the pool's threads exit
+    rc = pthread_key_create(&mtpt->readdir_buffer_key, free);
+    if(rc) {
+      errno = rc;
+      ret = -1;
+      goto out9;
+    }
+  }
+  if(mtpt->data_threads) {
+    size_t classes[] = { nthreads, mtpt->data_threads };
+    rc = threadpool_init_classes(&mtpt->tp, classes, 2, stacksize, 0, MTPT_BUCKETS);
+  } else {
+    rc = threadpool_init_buckets(&mtpt->tp, nthreads, stacksize, 0, MTPT_BUCKETS);
+  }
+  if(rc) {
+    errno = rc;
+    ret = -1;
+    goto out10;
+  }
+  if(options->spin != MTPT_SPIN_DEFAULT) {
+    threadpool_set_spin(&mtpt->tp, options->spin == MTPT_SPIN_NONE ? 0 : options->spin);
+  }
+  if(mtpt->watchdog_timeout) {
+    rc = pthread_create(&mtpt->watchdog, NULL, mtpt_watchdog, mtpt);
+    if(rc) {
+      errno = rc;
+      ret = -1;
+      goto out11;
+    }
+  }
 
   // 3...2...1...GO!
-  rc = threadpool_add(&mtpt.tp, mtpt_dir_enter_task_handler, root_task);
+  rc = mtpt_queue(mtpt, &root_task->node, mtpt_dir_enter_task_handler, root_task,
+    mtpt_task_key(TASK_TYPE_DIR_ENTER, root_task->cost, 0), NULL);
   if(rc) {
     errno = rc;
     ret = -1;
-    goto out4;
+    goto out12;
   }
   root_task = NULL;
 
   // wait for all tasks to finish
-  pthread_mutex_lock(&mtpt.mutex);
-  while(!mtpt.finished) {
-    pthread_cond_wait(&mtpt.finished_cond, &mtpt.mutex);
+  pthread_mutex_lock(&mtpt->mutex);
+  while(!mtpt->finished) {
+    pthread_cond_wait(&mtpt->finished_cond, &mtpt->mutex);
   }
-  pthread_mutex_unlock(&mtpt.mutex);
+  pthread_mutex_unlock(&mtpt->mutex);
 
   if(data) *data = d;
 
+out12:
+  if(mtpt->watchdog_timeout) {
+    pthread_mutex_lock(&mtpt->watchdog_mutex);
+    mtpt->watchdog_stop = 1;
+    pthread_cond_signal(&mtpt->watchdog_cond);
+    pthread_mutex_unlock(&mtpt->watchdog_mutex);
+    pthread_join(mtpt->watchdog, NULL);
+  }
+out11:
+  threadpool_destroy(&mtpt->tp);
+  if(mtpt->readdir_buffer_size) pthread_key_delete(mtpt->readdir_buffer_key);
+  if(root_task) mtpt_dir_task_delete(root_task);
+  mtpt_release(mtpt);
+  return ret;
+
+out10:
+  if(mtpt->readdir_buffer_size) pthread_key_delete(mtpt->readdir_buffer_key);
+out9:
+  mtpt_dir_task_delete(root_task);
+out8:
+  slab_destroy(&mtpt->data_tasks);
+out7:
+  slab_destroy(&mtpt->file_tasks);
+out6:
+  slab_destroy(&mtpt->dir_tasks);
+out5:
+  pthread_cond_destroy(&mtpt->watchdog_cond);
 out4:
-  threadpool_destroy(&mtpt.tp);
+  pthread_mutex_destroy(&mtpt->watchdog_mutex);
 out3:
-  pthread_cond_destroy(&mtpt.finished_cond);
+  pthread_cond_destroy(&mtpt->finished_cond);
 out2:
-  pthread_mutex_destroy(&mtpt.mutex);
+  pthread_mutex_destroy(&mtpt->mutex);
 out1:
-  if(root_task) mtpt_dir_task_delete(root_task);
+  free(mtpt);
 
   return ret;
 }
+
+#define MTPT_ITER_DEFAULT_CAPACITY 1024
+
+struct mtpt_iter {
+  size_t nthreads;
+  size_t stacksize;
+  int config;
+  char *path;
+  mtpt_options_t options;
+  pthread_t thread;
+
+  pthread_mutex_t mutex;
+  /// signaled when the channel stops being empty, or the traversal ends
+  pthread_cond_t not_empty;
+  /// signaled when the channel stops being full, or the iterator closes
+  pthread_cond_t not_full;
+
+  /// records waiting to be pulled, a ring buffer
+  mtpt_iter_record_t *ring;
+  size_t capacity;
+  size_t head;
+  size_t count;
+
+  /// records taken from the ring at once, so that most pulls need no lock
+  mtpt_iter_record_t *batch;
+  size_t batch_pos;
+  size_t batch_len;
+
+  /// the record last returned, freed by the next pull
+  mtpt_iter_record_t current;
+
+  int done;
+  int closing;
+  int error;
+};
+
+static void mtpt_iter_push(
+  mtpt_iter_t *iter,
+  const char *path,
+  const struct stat *st,
+  int error
+) {
+  mtpt_iter_record_t *r;
+  char *copy;
+
+  copy = strdup(path);
+  if(!copy) return;
+
+  pthread_mutex_lock(&iter->mutex);
+  while(iter->count == iter->capacity && !iter->closing) {
+    pthread_cond_wait(&iter->not_full, &iter->mutex);
+  }
+  if(iter->closing) {
+    pthread_mutex_unlock(&iter->mutex);
+    free(copy);
+    return;
+  }
+  r = &iter->ring[(iter->head + iter->count) % iter->capacity];
+  r->path = copy;
+  if(st) r->st = *st;
+  else memset(&r->st, 0, sizeof(r->st));
+  r->error = error;
+  // the consumer only waits when the ring is empty
+  if(iter->count++ == 0) pthread_cond_signal(&iter->not_empty);
+  pthread_mutex_unlock(&iter->mutex);
+}
+
+static int mtpt_iter_dir_enter(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *pcontinuation,
+  void **continuation
+) {
+  mtpt_iter_t *iter = arg;
+
+  mtpt_iter_push(iter, path, st, 0);
+  // once closing, nothing more is read; the traversal just winds down
+  return !__atomic_load_n(&iter->closing, __ATOMIC_RELAXED);
+}
+
+static void * mtpt_iter_file(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *continuation
+) {
+  mtpt_iter_push(arg, path, st, 0);
+  return NULL;
+}
+
+static void * mtpt_iter_error(
+  void *arg,
+  const char *path,
+  const struct stat *st,
+  void *continuation
+) {
+  mtpt_iter_t *iter = arg;
+
+  // the deferred method reports these
+  if(errno == ETIMEDOUT && iter->options.watchdog_timeout) return NULL;
+  mtpt_iter_push(iter, path, st, errno);
+  return NULL;
+}
+
+static void mtpt_iter_deferred(void *arg, const char *path) {
+  mtpt_iter_push(arg, path, NULL, ETIMEDOUT);
+}
+
+static void * mtpt_iter_thread(void *arg) {
+  mtpt_iter_t *iter = arg;
+  int rc;
+
+  rc = mtpt_opts(
+    iter->nthreads,
+    iter->stacksize,
+    iter->config,
+    iter->path,
+    mtpt_iter_dir_enter,
+    NULL,
+    mtpt_iter_file,
+    mtpt_iter_error,
+    iter,
+    NULL,
+    &iter->options
+  );
+
+  pthread_mutex_lock(&iter->mutex);
+  iter->error = rc ? errno : 0;
+  iter->done = 1;
+  pthread_cond_signal(&iter->not_empty);
+  pthread_mutex_unlock(&iter->mutex);
+  return NULL;
+}
+
+mtpt_iter_t * mtpt_iter_open(
+  size_t nthreads,
+  size_t stacksize,
+  int config,
+  const char *path,
+  size_t capacity,
+  const mtpt_options_t *options
+) {
+  mtpt_iter_t *iter;
+  int rc;
+
+  iter = calloc(1, sizeof(mtpt_iter_t));
+  if(!iter) return NULL;
+  iter->nthreads = nthreads;
+  iter->stacksize = stacksize;
+  iter->config = config;
+  if(options) iter->options = *options;
+  iter->options.deferred_method = mtpt_iter_deferred;
+  iter->capacity = capacity ? capacity : MTPT_ITER_DEFAULT_CAPACITY;
+
+  iter->path = strdup(path);
+  if(!iter->path) goto err0;
+  iter->ring = malloc(sizeof(mtpt_iter_record_t) * iter->capacity);
+  if(!iter->ring) goto err1;
+  iter->batch = malloc(sizeof(mtpt_iter_record_t) * iter->capacity);
+  if(!iter->batch) goto err2;
+  rc = pthread_mutex_init(&iter->mutex, NULL);
+  if(rc) goto err3;
+  rc = pthread_cond_init(&iter->not_empty, NULL);
+  if(rc) goto err4;
+  rc = pthread_cond_init(&iter->not_full, NULL);
+  if(rc) goto err5;
+  rc = pthread_create(&iter->thread, NULL, mtpt_iter_thread, iter);
+  if(rc) goto err6;
+  return iter;
+
+err6:
+  pthread_cond_destroy(&iter->not_full);
+err5:
+  pthread_cond_destroy(&iter->not_empty);
+err4:
+  pthread_mutex_destroy(&iter->mutex);
+err3:
+  errno = rc;
+  free(iter->batch);
+err2:
+  free(iter->ring);
+err1:
+  free(iter->path);
+err0:
+  rc = errno;
+  free(iter);
+  errno = rc;
+  return NULL;
+}
+
+const mtpt_iter_record_t * mtpt_iter_next(mtpt_iter_t *iter) {
+  size_t n;
+
+  free((char *) iter->current.path);
+  iter->current.path = NULL;
+
+  if(iter->batch_pos == iter->batch_len) {
+    pthread_mutex_lock(&iter->mutex);
+    while(iter->count == 0 && !iter->done) {
+      pthread_cond_wait(&iter->not_empty, &iter->mutex);
+    }
+    if(iter->count == 0) {
+      pthread_mutex_unlock(&iter->mutex);
+      errno = iter->error;
+      return NULL;
+    }
+    // take everything that is waiting
+    for(n = 0; n < iter->count; ++n) {
+      iter->batch[n] = iter->ring[(iter->head + n) % iter->capacity];
+    }
+    if(iter->count == iter->capacity) pthread_cond_broadcast(&iter->not_full);
+    iter->batch_pos = 0;
+    iter->batch_len = n;
+    iter->head = (iter->head + n) % iter->capacity;
+    iter->count = 0;
+    pthread_mutex_unlock(&iter->mutex);
+  }
+
+  iter->current = iter->batch[iter->batch_pos++];
+  return &iter->current;
+}
+
+void mtpt_iter_close(mtpt_iter_t *iter) {
+  size_t i;
+
+  pthread_mutex_lock(&iter->mutex);
+  __atomic_store_n(&iter->closing, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&iter->not_full);
+  pthread_mutex_unlock(&iter->mutex);
+  pthread_join(iter->thread, NULL);
+
+  free((char *) iter->current.path);
+  for(i = iter->batch_pos; i < iter->batch_len; ++i) {
+    free((char *) iter->batch[i].path);
+  }
+  for(i = 0; i < iter->count; ++i) {
+    free((char *) iter->ring[(iter->head + i) % iter->capacity].path);
+  }
+  pthread_cond_destroy(&iter->not_full);
+  pthread_cond_destroy(&iter->not_empty);
+  pthread_mutex_destroy(&iter->mutex);
+  free(iter->batch);
+  free(iter->ring);
+  free(iter->path);
+  free(iter);
+}
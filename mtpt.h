@@ -51,6 +51,112 @@
  */
 #define MTPT_CONFIG_SORT 0x2
 
+/**
+ * Stat the entries of each directory in inode number order, which on file
+ * systems that keep inodes in tables (ext4, XFS) turns the stats into mostly
+ * sequential reads.  The entries passed to mtpt_dir_exit_method_t are not
+ * affected.
+ */
+#define MTPT_CONFIG_INODE_ORDER 0x4
+
+/**
+ * Values of mtpt_options_t spin: use THREADPOOL_SPIN, or never spin and
+ * sleep as soon as a thread is idle.
+ */
+#define MTPT_SPIN_DEFAULT 0
+#define MTPT_SPIN_NONE (-1)
+
+struct costs;
+struct hotspots;
+struct ratelimit;
+struct seeds;
+
+/**
+ * The type expected for callbacks to use when the watchdog gives up on a
+ * file system call.
+ *
+ * @param arg
+ * The arg parameter that was passed to mtpt().
+ *
+ * @param path
+ * The path that was being read or stat'd.  It and everything below it have
+ * been skipped.
+ */
+typedef void (*mtpt_deferred_method_t)(
+  void *arg,
+  const char *path
+);
+
+/**
+ * Optional settings for mtpt_opts().  A zero-initialized structure gives the
+ * same behavior as mtpt().
+ */
+typedef struct mtpt_options {
+  /**
+   * If not NULL, the time taken to read each directory, stat each entry and
+   * process each directory is recorded here.
+   */
+  struct hotspots *hotspots;
+
+  /**
+   * If not NULL, every opendir, stat and batch of directory entries read
+   * takes a token from this rate limiter.
+   */
+  struct ratelimit *ratelimit;
+
+  /**
+   * If not NULL, subtrees are started most expensive first according to the
+   * costs loaded into it from a previous run, and the cost of each large
+   * subtree in this run is recorded in it.
+   */
+  struct costs *costs;
+
+  /**
+   * If not NULL, only the seeded subtrees are traversed.  Directories above
+   * them are entered and exited as usual, but without being read: their
+   * entries are only the seeded paths that exist below them, so data
+   * returned from the seeded subtrees is rolled up to the root.
+   */
+  const struct seeds *seeds;
+
+  /**
+   * If non-zero, an opendir, readdir or lstat that has not returned after
+   * this many seconds is reported and its path is skipped.  The blocked
+   * thread is replaced so that the rest of the traversal can continue.  A
+   * directory that could not be read gets the error method called with errno
+   * set to ETIMEDOUT.  If the root path itself cannot be stat'd in time,
+   * mtpt_opts() returns -1 with errno set to ETIMEDOUT.
+   */
+  double watchdog_timeout;
+
+  /**
+   * The method to call for each path skipped by the watchdog.  Can be NULL.
+   */
+  mtpt_deferred_method_t deferred_method;
+
+  /**
+   * If non-zero, directories are read with buffers of this many bytes, so
+   * that each read fetches as many entries as the file system will return at
+   * once.  Only supported on Linux; ignored elsewhere.
+   */
+  size_t readdir_buffer_size;
+
+  /**
+   * How many times an idle thread checks for a new task before it sleeps.
+   * Spinning saves a wakeup per task when tasks take microseconds, such as
+   * a stat of a cached inode.  MTPT_SPIN_DEFAULT uses THREADPOOL_SPIN;
+   * MTPT_SPIN_NONE sleeps at once.
+   */
+  long spin;
+
+  /**
+   * If non-zero, this many more threads run the work that file methods pass
+   * to mtpt_submit(), apart from the nthreads that traverse the tree, so
+   * that long copies do not hold up the reading of directories.
+   */
+  size_t data_threads;
+} mtpt_options_t;
+
 typedef struct mtpt_dir_entry {
   void *data;
   char name[1];
@@ -216,4 +322,94 @@ int mtpt(
   void **data
 );
 
+/**
+ * Same as mtpt(), with additional settings.
+ *
+ * @param options
+ * Additional settings, or NULL to use the defaults.
+ */
+int mtpt_opts(
+  size_t nthreads,
+  size_t stacksize,
+  int config,
+  const char *path,
+  mtpt_dir_enter_method_t dir_enter_method,
+  mtpt_dir_exit_method_t dir_exit_method,
+  mtpt_file_method_t file_method,
+  mtpt_error_method_t error_method,
+  void *arg,
+  void **data,
+  const mtpt_options_t *options
+);
+
+/**
+ * Runs routine(arg) on one of the data threads.  Only has an effect when
+ * called from a file method of a traversal with data_threads set, or from a
+ * routine submitted by one: the directory of the file is not exited until
+ * routine returns.  Otherwise, or if the work cannot be queued, routine is
+ * run before this returns.
+ */
+void mtpt_submit(void (*routine)(void *), void *arg);
+
+/**
+ * A record returned by mtpt_iter_next().
+ */
+typedef struct mtpt_iter_record {
+  /// the path, owned by the iterator
+  const char *path;
+
+  /// the stat of the path, zeroed if it could not be stat'd
+  struct stat st;
+
+  /**
+   * 0, or the error number if path could not be stat'd or read.  With the
+   * watchdog enabled, each path that it skips is returned once with
+   * ETIMEDOUT.
+   */
+  int error;
+} mtpt_iter_record_t;
+
+typedef struct mtpt_iter mtpt_iter_t;
+
+/**
+ * Starts a traversal whose paths are pulled with mtpt_iter_next() instead
+ * of being passed to callbacks.  Each directory is returned before the
+ * paths in it.
+ *
+ * The threads stop traversing while capacity records are waiting to be
+ * pulled, so a slow consumer holds back the traversal instead of letting
+ * records pile up in memory.
+ *
+ * @param capacity
+ * Number of records that can wait to be pulled, 0 for the default.
+ *
+ * @param options
+ * Additional settings, or NULL to use the defaults.  The deferred_method
+ * is not used.
+ *
+ * @return The iterator, or NULL if there was an error and sets errno.
+ */
+mtpt_iter_t * mtpt_iter_open(
+  size_t nthreads,
+  size_t stacksize,
+  int config,
+  const char *path,
+  size_t capacity,
+  const mtpt_options_t *options
+);
+
+/**
+ * Gets the next record.  Must only be called by one thread at a time.
+ *
+ * @return The record, valid until the next call, or NULL at the end.  If
+ * the traversal could not be started, NULL is returned with errno set;
+ * otherwise errno is set to 0.
+ */
+const mtpt_iter_record_t * mtpt_iter_next(mtpt_iter_t *iter);
+
+/**
+ * Stops the traversal if it has not finished and frees the iterator.
+ */
+void mtpt_iter_close(mtpt_iter_t *iter);
+
 #endif // MTPT_H
@@ -30,18 +30,31 @@
 
 #include "mtpt.h"
 #include "exclude.h"
+#include "memacct.h"
+#include "output.h"
+#include "toolopts.h"
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define DEFAULT_NTHREADS 4
-#define STACKSIZE (2<<20) // 2 MB
 
 static int g_error = 0;
 static int g_verbose = 0;
 static const char **g_exclude = NULL;
 static size_t g_exclude_count = 0;
+static struct toolopts g_opts;
+
+static const struct option long_options[] = {
+  TOOLOPTS_LONG_OPTIONS,
+  {NULL, 0, NULL, 0}
+};
+
+static inline void metadata_op(void) {
+  if(g_opts.options.ratelimit) ratelimit_acquire(g_opts.options.ratelimit, 1);
+}
 
 static void usage(FILE *file, const char *arg0) {
   fprintf(file,
@@ -49,9 +62,11 @@ static void usage(FILE *file, const char *arg0) {
     "Options:\n"
     "  -h    Print this message\n"
     "  -v    Be verbose\n"
-    "  -j N  Operate on N files at a time (default %d)\n"
+    "  -j N  Operate on N files at a time (default %d, or as tuned\n"
+    "        for the file system)\n"
     "  -e P  Exclude files matching P\n"
     , arg0, DEFAULT_NTHREADS);
+  toolopts_usage(&g_opts, file);
 }
 
 static int traverse_dir_enter(
@@ -87,13 +102,14 @@ static void * traverse_dir_exit(
   for(i = 0; i < entries_count; ++i) {
     if(entries[i]->data == NULL) return NULL;
   }
+  metadata_op();
   rc = rmdir(path);
   if(rc) {
     perror(path);
     g_error = 1;
     return NULL;
   }
-  if(g_verbose) printf("removed directory: `%s'\n", path);
+  if(g_verbose) output_printf("removed directory: `%s'\n", path);
   return (void *) -1l;
 }
 
@@ -120,13 +136,14 @@ static void * traverse_file(
   if(excluded(g_exclude, g_exclude_count, rel_path, 0))
     return NULL;
 
+  metadata_op();
   rc = unlink(path);
   if(rc) {
     perror(path);
     g_error = 1;
     return NULL;
   }
-  if(g_verbose) printf("removed `%s'\n", path);
+  if(g_verbose) output_printf("removed `%s'\n", path);
   return (void *) -1l;
 }
 
@@ -141,13 +158,34 @@ static void * traverse_error(
   return NULL;
 }
 
+static int remove_path(const char *path, size_t threads) {
+  mtpt_options_t options = g_opts.options;
+  int config = MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT;
+  size_t l = strlen(path);
+
+  toolopts_tune(&g_opts, path, &threads, &config, &options);
+  return mtpt_opts(
+    threads,
+    g_opts.stacksize,
+    config,
+    path,
+    traverse_dir_enter,
+    traverse_dir_exit,
+    traverse_file,
+    traverse_error,
+    &l,
+    NULL,
+    &options
+  );
+}
+
 int main(int argc, char **argv) {
   int rc, opt;
-  size_t threads, l;
+  size_t deferred;
 
-  threads = DEFAULT_NTHREADS;
+  toolopts_init(&g_opts, TOOLOPTS_RETRY, DEFAULT_NTHREADS);
 
-  while((opt = getopt(argc, argv, "hvj:e:")) != -1) {
+  while((opt = getopt_long(argc, argv, "hvj:e:", long_options, NULL)) != -1) {
     switch(opt) {
     case 'h':
       usage(stdout, argv[0]);
@@ -155,48 +193,57 @@ int main(int argc, char **argv) {
     case 'v':
       g_verbose += 1;
       break;
-    case 'j':
-      threads = atoi(optarg);
-      if(threads <= 0) {
-        fprintf(stderr, "Error: number of threads (-j) must be a positive integer\n");
-        exit(2);
-      }
-      break;
     case 'e':
       g_exclude = realloc(g_exclude, (g_exclude_count+1) * sizeof(char *));
       g_exclude[g_exclude_count++] = optarg;
       break;
     default:
+      if(toolopts_parse(&g_opts, opt, optarg)) break;
       usage(stderr, argv[0]);
       exit(2);
     }
   }
 
+  toolopts_setup(&g_opts, argv[0]);
+
   if(argc == optind) {
     fprintf(stderr, "Error: path not given\n");
     usage(stderr, argv[0]);
     exit(2);
   }
 
+  rc = output_init(STDOUT_FILENO, 0, isatty(STDOUT_FILENO) ? OUTPUT_ORDERED : 0);
+  if(rc) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+    exit(1);
+  }
+
   for(; optind < argc; ++optind) {
-    l = strlen(argv[optind]);
-    rc = mtpt(
-      threads,
-      STACKSIZE,
-      MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT,
-      argv[optind],
-      traverse_dir_enter,
-      traverse_dir_exit,
-      traverse_file,
-      traverse_error,
-      &l,
-      NULL
-    );
+    deferred = g_opts.deferred_count;
+    rc = remove_path(argv[optind], g_opts.threads);
     if(rc) {
       perror(argv[optind]);
       g_error = 1;
     }
+    if(g_opts.deferred_count > deferred) {
+      // everything else is gone, so walking the root again only visits the
+      // deferred paths and their parents
+      toolopts_forget_deferred(&g_opts, deferred);
+      fprintf(stderr, "Retrying %s\n", argv[optind]);
+      rc = remove_path(argv[optind], g_opts.threads);
+      if(rc) {
+        perror(argv[optind]);
+        g_error = 1;
+      }
+    }
   }
+  rc = output_destroy();
+  if(rc) {
+    fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(rc));
+    g_error = 1;
+  }
+
+  if(toolopts_finish(&g_opts)) g_error = 1;
   if(g_exclude) free(g_exclude);
   return g_error;
 }
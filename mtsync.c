@@ -32,11 +32,18 @@
 #define _FILE_OFFSET_BITS 64
 #include <pthread.h>
 #include "mtpt.h"
+#include "copy.h"
 #include "exclude.h"
+#include "hash.h"
+#include "memacct.h"
+#include "output.h"
+#include "toolopts.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,8 +54,12 @@
 #include <utime.h>
 
 #define IO_BUFFER_SIZE (1<<20) // 1 MB
+#define DIRECT_IO_BUFFER_SIZE (16<<20) // 16 MB
+#define MIN_IO_BUFFER_SIZE COPY_DIRECT_ALIGN
+#define MAX_IO_BUFFER_SIZE (64<<20) // 64 MB
 #define DEFAULT_NTHREADS 4
-#define STACKSIZE (2<<20) // 2 MB
+#define DEFAULT_DATA_NTHREADS 4
+#define DEFAULT_CHUNK_SIZE (256<<20) // 256 MB
 
 struct traverse_arg {
   const char *src_root;
@@ -63,6 +74,27 @@ struct traverse_continuation {
   struct stat src_st;
 };
 
+/**
+ * Buffers that each thread keeps on the heap rather than the stack, so that
+ * the thread pool can run many threads with small stacks.  io is allocated
+ * the first time the thread copies a file, and replaced by a larger one if a
+ * later file asks for io_want bytes more than its io_size.
+ */
+struct thread_buffers {
+  char *io;
+  size_t io_size;
+  size_t io_want;
+  char dst_path[PATH_MAX];
+  char dst_p[PATH_MAX];
+  char src_target[PATH_MAX];
+  char dst_target[PATH_MAX];
+};
+
+struct unlink_dir_level {
+  DIR *d;
+  size_t len;
+};
+
 struct hardlink_entry {
   dev_t src_dev;
   ino_t src_ino;
@@ -91,7 +123,61 @@ static int g_one_file_system = 0;
 static dev_t g_dev;
 static struct hardlink_entry **g_hardlinks;
 static size_t g_hardlinks_size, g_hardlinks_count;
+static int g_memacct_hardlinks = -1;
 static pthread_mutex_t g_hardlinks_mutex;
+static pthread_key_t g_buffers_key;
+static int g_memacct_buffers = -1;
+static struct toolopts g_opts;
+static enum copy_method g_copy_method = COPY_AUTO;
+static int g_copy_flags = COPY_PREALLOCATE;
+/// bytes of each thread's copy buffer, or 0 until the options are read
+static size_t g_buffer_size = 0;
+/// --buffer-size=auto: size the buffers from st_blksize, at least g_buffer_size
+static int g_buffer_auto = 0;
+static int g_stats = 0;
+static int g_checksum = 0;
+static size_t g_chunk_size = DEFAULT_CHUNK_SIZE;
+static size_t g_chunk_threads = 0;
+/// how dst files are opened: --copy-method=delta reads them too
+static int g_dst_flags = O_WRONLY;
+
+/// totals for --stats, added to atomically
+static struct {
+  uint64_t files;
+  uint64_t cloned;
+  uint64_t copied;
+  uint64_t holes;
+  uint64_t same;
+  uint64_t checked;
+} g_totals;
+
+enum {
+  OPT_COPY_METHOD = TOOLOPTS_OPT_END,
+  OPT_STATS,
+  OPT_CHUNK_SIZE,
+  OPT_CHUNK_THREADS,
+  OPT_NO_PREALLOCATE,
+  OPT_DIRECT,
+  OPT_BUFFER_SIZE,
+};
+
+static const struct option long_options[] = {
+  TOOLOPTS_LONG_OPTIONS,
+  TOOLOPTS_SEEDS_LONG_OPTIONS,
+  TOOLOPTS_COSTS_LONG_OPTIONS,
+  {"copy-method", required_argument, NULL, OPT_COPY_METHOD},
+  {"stats", no_argument, NULL, OPT_STATS},
+  {"chunk-size", required_argument, NULL, OPT_CHUNK_SIZE},
+  {"chunk-threads", required_argument, NULL, OPT_CHUNK_THREADS},
+  {"no-preallocate", no_argument, NULL, OPT_NO_PREALLOCATE},
+  {"direct", no_argument, NULL, OPT_DIRECT},
+  {"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+  {NULL, 0, NULL, 0}
+};
+
+static inline void metadata_op(void) {
+  if(g_opts.options.ratelimit) ratelimit_acquire(g_opts.options.ratelimit, 1);
+}
 
 static void usage(FILE *file, const char *arg0) {
   fprintf(file,
@@ -99,12 +185,18 @@ static void usage(FILE *file, const char *arg0) {
     "Options:\n"
     "  -h    Print this message\n"
     "  -v    Be verbose\n"
-    "  -j N  Copy N files at a time (default %d)\n"
+    "  -j N  Copy N files at a time (default %d, or as tuned\n"
+    "        for the file system)\n"
+    "  -J N  Copy the contents of N files at a time in separate threads, so\n"
+    "        that large files do not hold up the -j threads (default %d, 0 to\n"
+    "        copy contents in the -j threads)\n"
     "  -a    Archive; equals -pot\n"
     "  -p    Preserve permissions\n"
     "  -o    Preserve ownership (only preserves user if root)\n"
     "  -t    Preserve modification times\n"
     "  -H    Preserve hard links\n"
+    "  -c    Compare files of the same size by a hash of their contents on the\n"
+    "        -J threads, rather than by mtime\n"
     "  -D    Do not delete files not in source from destination\n"
     "  -e P  Exclude files matching P\n"
     "  -E P  Exclude and delete from destination files matching P\n"
@@ -113,7 +205,37 @@ static void usage(FILE *file, const char *arg0) {
 #endif
     "  -w S  mtime can be within S seconds to assume equal\n"
     "  -x    Do not cross file system boundaries\n"
-    , arg0, DEFAULT_NTHREADS);
+    , arg0, DEFAULT_NTHREADS, DEFAULT_DATA_NTHREADS);
+  toolopts_usage(&g_opts, file);
+  fprintf(file,
+    "      --copy-method=M Copy file contents only with M: clone (reflink),\n"
+    "                      copy_file_range, sendfile or read_write (default\n"
+    "                      auto, which tries each in turn), or with delta,\n"
+    "                      which rewrites only the blocks of dst that differ\n"
+    "      --stats         Report the files and bytes copied and the bytes of\n"
+    "                      holes skipped in sparse files\n"
+    "      --chunk-size=N  Copy files larger than N bytes in N byte chunks on\n"
+    "                      several -J threads at once (default 256M, 0 to copy\n"
+    "                      each file on one thread), rounded up to 4K\n"
+    "      --chunk-threads=N\n"
+    "                      Copy up to N chunks of a file at once (default -J)\n"
+    "      --no-preallocate\n"
+    "                      Let dst files grow as they are written, rather than\n"
+    "                      allocating them with fallocate() first\n"
+    "      --direct        Copy with O_DIRECT reads and writes, bypassing the\n"
+    "                      page cache\n"
+    "      --buffer-size=N Copy through N byte buffers (default 1M, 16M with\n"
+    "                      --direct), or with auto, through buffers of the\n"
+    "                      st_blksize of the files if that is larger; rounded\n"
+    "                      up to 4K and at most 64M\n"
+  );
+}
+
+/**
+ * Round size up to a whole number of O_DIRECT blocks.
+ */
+static inline size_t direct_align_up(size_t size) {
+  return (size + COPY_DIRECT_ALIGN - 1) / COPY_DIRECT_ALIGN * COPY_DIRECT_ALIGN;
 }
 
 static void *xmalloc(size_t size) {
@@ -134,23 +256,120 @@ static void *xrealloc(void *ptr, size_t size) {
   return p;
 }
 
+static void thread_buffers_free(void *arg) {
+  struct thread_buffers *b = arg;
+  if(b->io) {
+    memacct_add(g_memacct_buffers, -(ssize_t) b->io_size);
+    free(b->io);
+  }
+  memacct_add(g_memacct_buffers, -(ssize_t) sizeof(struct thread_buffers));
+  free(b);
+}
+
+static struct thread_buffers * thread_buffers(void) {
+  struct thread_buffers *b = pthread_getspecific(g_buffers_key);
+  if(!b) {
+    b = xmalloc(sizeof(struct thread_buffers));
+    memacct_add(g_memacct_buffers, sizeof(struct thread_buffers));
+    b->io = NULL;
+    b->io_size = 0;
+    b->io_want = g_buffer_size;
+    pthread_setspecific(g_buffers_key, b);
+  }
+  return b;
+}
+
+/**
+ * The thread's copy buffer for copy_data(), allocated when first needed.  It
+ * is aligned for O_DIRECT.
+ */
+static char * thread_io_buffer(size_t *size) {
+  struct thread_buffers *tb = thread_buffers();
+  void *p;
+
+  if(tb->io && tb->io_size < tb->io_want) {
+    memacct_add(g_memacct_buffers, -(ssize_t) tb->io_size);
+    free(tb->io);
+    tb->io = NULL;
+  }
+  if(!tb->io) {
+    if(posix_memalign(&p, COPY_DIRECT_ALIGN, tb->io_want)) {
+      perror(NULL);
+      exit(EXIT_FAILURE);
+    }
+    tb->io = p;
+    tb->io_size = tb->io_want;
+    memacct_add(g_memacct_buffers, tb->io_size);
+  }
+  *size = tb->io_size;
+  return tb->io;
+}
+
+/**
+ * Set the size of the buffer the thread copies the next file through, from
+ * the st_blksize of its source and destination with --buffer-size=auto.
+ * Lustre and GPFS report their stripe or block size there, which is the size
+ * they stream best in.
+ */
+static void thread_io_want(blksize_t src_blksize, blksize_t dst_blksize) {
+  size_t size = g_buffer_size;
+
+  if(g_buffer_auto) {
+    if((size_t) src_blksize > size) size = src_blksize;
+    if((size_t) dst_blksize > size) size = dst_blksize;
+    if(size > MAX_IO_BUFFER_SIZE) size = MAX_IO_BUFFER_SIZE;
+    size -= size % COPY_DIRECT_ALIGN;
+  }
+  thread_buffers()->io_want = size;
+}
+
+/**
+ * Remove the directory at path and everything under it.  The directories
+ * being read are kept in a list on the heap rather than by recursion, so a
+ * deep tree does not overflow a small thread stack.
+ */
 static void unlink_dir(const char *path) {
   int rc;
   DIR *d;
   struct dirent *dirp;
   struct stat st;
-  char p[PATH_MAX];
+  struct unlink_dir_level *levels;
+  size_t depth, size, len;
+  char *p;
 
+  metadata_op();
   d = opendir(path);
   if(!d) {
     g_error = 1;
     return;
   }
-  while((dirp = readdir(d))) {
+  p = xmalloc(PATH_MAX);
+  snprintf(p, PATH_MAX, "%s", path);
+  size = 16;
+  levels = xmalloc(sizeof(struct unlink_dir_level) * size);
+  levels[0].d = d;
+  levels[0].len = strlen(p);
+  depth = 1;
+  while(depth) {
+    d = levels[depth-1].d;
+    len = levels[depth-1].len;
+    p[len] = '\0';
+    dirp = readdir(d);
+    if(!dirp) {
+      closedir(d);
+      --depth;
+      metadata_op();
+      rc = rmdir(p);
+      if(rc) {
+        perror(p);
+        g_error = 1;
+      }
+      continue;
+    }
     if(strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0) {
       continue;
     }
-    snprintf(p, PATH_MAX, "%s/%s", path, dirp->d_name);
+    snprintf(p + len, PATH_MAX - len, "/%s", dirp->d_name);
 #ifdef _DIRENT_HAVE_D_TYPE
     switch(dirp->d_type) {
     case DT_UNKNOWN:
@@ -161,6 +380,7 @@ static void unlink_dir(const char *path) {
       goto delete_other;
     }
 #endif
+    metadata_op();
     rc = lstat(p, &st);
     if(rc) {
       perror(p);
@@ -171,20 +391,29 @@ static void unlink_dir(const char *path) {
 #ifdef _DIRENT_HAVE_D_TYPE
     delete_dir:
 #endif
-      unlink_dir(p);
+      metadata_op();
+      d = opendir(p);
+      if(!d) {
+        g_error = 1;
+        continue;
+      }
+      if(depth == size) {
+        size <<= 1;
+        levels = xrealloc(levels, sizeof(struct unlink_dir_level) * size);
+      }
+      levels[depth].d = d;
+      levels[depth].len = strlen(p);
+      ++depth;
     } else {
 #ifdef _DIRENT_HAVE_D_TYPE
     delete_other:
 #endif
+      metadata_op();
       unlink(p);
     }
   }
-  closedir(d);
-  rc = rmdir(path);
-  if(rc) {
-    perror(path);
-    g_error = 1;
-  }
+  free(levels);
+  free(p);
 }
 
 static inline int samemtime(const struct stat *a, const struct stat *b) {
@@ -232,219 +461,576 @@ static int hardlink_entry_pcmp_src(const void *a, const void *b) {
   return memcmp(*hla, *hlb, sizeof(dev_t) + sizeof(ino_t));
 }
 
-static void sync_file(
+/**
+ * Set the length of dst_fd once its data has been copied, then its mode,
+ * ownership and mtime as asked, and close it.
+ */
+static void finish_copy(
   const struct stat *src_st,
-  const char *src_path,
   const char *dst_path,
-  const char *rel_path
+  int dst_exists,
+  const struct stat *dst_st,
+  int dst_fd,
+  off_t length
 ) {
-  int rc, dst_exists;
-  struct stat dst_st;
+  int rc;
 
-  // stat dst
-  rc = lstat(dst_path, &dst_st);
-  dst_exists = 1;
+  rc = ftruncate(dst_fd, length);
   if(rc) {
-    if(errno != ENOENT) {
-      perror(dst_path);
-      g_error = 1;
-      return;
-    }
-    dst_exists = 0;
-  }
-
-  if(excluded(g_exclude_delete, g_exclude_delete_count, rel_path, 0)) {
-    if(dst_exists) {
-      if(S_ISDIR(dst_st.st_mode)) {
-        unlink_dir(dst_path);
-      } else {
-        unlink(dst_path);
-      }
-    }
+    perror(dst_path);
+    g_error = 1;
+    close(dst_fd);
     return;
   }
 
-  // remove dst if not a regular file
-  if(dst_exists && !S_ISREG(dst_st.st_mode)) {
-    if(S_ISDIR(dst_st.st_mode)) {
-      unlink_dir(dst_path);
-    } else {
-      unlink(dst_path);
-    }
-    dst_exists = 0;
-  }
-
-  if(!dst_exists ||
-     src_st->st_size != dst_st.st_size ||
-     !samemtime(src_st, &dst_st)
-  ) { // dst does not exist or file size or mtime differ
-    ssize_t a, b, c;
-    off_t length;
-    int src_fd, dst_fd;
-    char buf[IO_BUFFER_SIZE];
-
-    // remove dst if it has more than one link
-    if(dst_exists && dst_st.st_nlink > 1) {
-      unlink(dst_path);
-      dst_exists = 0;
-    }
-
-    // open src for reading
-    src_fd = open(src_path, O_RDONLY);
-    if(src_fd == -1) {
-      if(errno != ENOENT) {
-        perror(src_path);
+  if(g_preserve_mode) {
+    if(!dst_exists ||
+       src_st->st_mode != dst_st->st_mode
+    ) {
+      metadata_op();
+      rc = fchmod(dst_fd, src_st->st_mode);
+      if(rc) {
+        perror(dst_path);
         g_error = 1;
+        close(dst_fd);
+        return;
       }
-      return;
     }
+  }
 
-    if(g_verbose) printf("%s\n", rel_path);
-
-    if(dst_exists && g_euid != 0) {
-      // make sure I can write to dst
-      rc = access(dst_path, W_OK);
+  if(g_preserve_ownership) {
+    if(!dst_exists ||
+       (g_euid == 0 && src_st->st_uid != dst_st->st_uid) ||
+       src_st->st_gid != dst_st->st_gid
+    ) {
+      uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
+      metadata_op();
+      rc = fchown(dst_fd, uid, src_st->st_gid);
       if(rc) {
-        if(errno == EACCES) {
-          mode_t m = dst_st.st_mode | S_IWUSR;
-          if(dst_st.st_uid != g_euid) {
-            // if I'm not the owner of the file then perhaps I have access
-            // through the group
-            m |= S_IWGRP;
-          }
-          rc = chmod(dst_path, m);
-          if(rc) {
-            perror(dst_path);
-            g_error = 1;
-            close(src_fd);
-            return;
-          }
-        } else if(errno == ENOENT) {
-          dst_exists = 0;
-        } else {
-          perror(dst_path);
-          g_error = 1;
-          close(src_fd);
-          return;
-        }
+        perror(dst_path);
+        g_error = 1;
+        close(dst_fd);
+        return;
       }
     }
+  }
 
-    // open dst for writing
-    dst_fd = open(dst_path, O_WRONLY | O_CREAT, 0600);
-    if(dst_fd == -1) {
+  close(dst_fd);
+
+  if(g_preserve_mtime) {
+    metadata_op();
+    rc = settimes(dst_path, src_st);
+    if(rc) {
       perror(dst_path);
       g_error = 1;
-      close(src_fd);
       return;
     }
+  }
+}
 
-    // copy the data
-    length = 0;
-    while(1) {
-      a = read(src_fd, buf, sizeof(buf));
-      if(a == -1) {
-        // read error
-        perror(src_path);
-        g_error = 1;
-        close(src_fd);
-        close(dst_fd);
-        return;
-      } else if(a == 0) {
-        // end of file
-        break;
-      } else {
-        c = 0;
-        length += a;
-        do {
-          b = write(dst_fd, buf + c, a - c);
-          if(b == -1) {
-            // write error
-            perror(dst_path);
-            g_error = 1;
-            close(src_fd);
-            close(dst_fd);
-            return;
-          } else {
-            c += b;
-          }
-        } while(c < a);
-      }
-    }
+/// a large file whose chunks are copied at once by several data threads
+struct chunked_copy {
+  struct stat src_st;
+  struct stat dst_st;
+  int dst_exists;
+  /// kept open for finish_copy() by the last part to finish
+  int dst_fd;
+  /// the size of dst before the copy, to know which holes to punch
+  off_t dst_size;
+  blksize_t dst_blksize;
+  /// flags for copy_data_range()
+  int flags;
+  /// the parts still running, and non-zero if any of them failed
+  size_t remaining;
+  int failed;
+  size_t parts;
+  char *src_path;
+  char *dst_path;
+  size_t size;
+};
+
+/// one of the parts of a chunked_copy, which copies every parts'th chunk
+struct chunk_job {
+  struct chunked_copy *copy;
+  size_t part;
+};
+
+static void chunk_job_run(void *arg) {
+  struct chunk_job *job = arg;
+  struct chunked_copy *copy = job->copy;
+  struct copy_result result;
+  off_t offset, end, stride;
+  int src_fd, dst_fd;
+
+  result.copied = 0;
+  result.holes = 0;
+  result.same = 0;
+  result.read_error = 0;
+
+  // each part has its own descriptors, as sendfile() moves the offset of dst
+  metadata_op();
+  src_fd = open(copy->src_path, O_RDONLY);
+  if(src_fd == -1) {
+    perror(copy->src_path);
+    goto fail;
+  }
+  metadata_op();
+  dst_fd = open(copy->dst_path, g_dst_flags);
+  if(dst_fd == -1) {
+    perror(copy->dst_path);
     close(src_fd);
-    rc = ftruncate(dst_fd, length);
-    if(rc) {
-      perror(dst_path);
+    goto fail;
+  }
+  thread_io_want(copy->src_st.st_blksize, copy->dst_blksize);
+  stride = (off_t) g_chunk_size * copy->parts;
+  for(offset = (off_t) g_chunk_size * job->part; offset < copy->src_st.st_size; offset += stride) {
+    end = offset + (off_t) g_chunk_size;
+    if(end > copy->src_st.st_size) end = copy->src_st.st_size;
+    if(copy_data_range(src_fd, dst_fd, g_copy_method, copy->flags, thread_io_buffer,
+                       offset, end, copy->dst_size, &result)
+    ) {
+      perror(result.read_error ? copy->src_path : copy->dst_path);
+      break;
+    }
+    // another part may have failed already
+    if(__atomic_load_n(&copy->failed, __ATOMIC_RELAXED)) break;
+  }
+  close(src_fd);
+  close(dst_fd);
+  if(offset < copy->src_st.st_size) goto fail;
+  goto done;
+
+fail:
+  g_error = 1;
+  __atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+done:
+  if(g_stats) {
+    __atomic_add_fetch(&g_totals.copied, result.copied, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_totals.holes, result.holes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_totals.same, result.same, __ATOMIC_RELAXED);
+  }
+  memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct chunk_job));
+  free(job);
+  if(__atomic_sub_fetch(&copy->remaining, 1, __ATOMIC_ACQ_REL)) return;
+
+  // the last part to finish sets the length, mode and times
+  if(__atomic_load_n(&copy->failed, __ATOMIC_RELAXED)) {
+    close(copy->dst_fd);
+  } else {
+    if(g_stats) __atomic_add_fetch(&g_totals.files, 1, __ATOMIC_RELAXED);
+    finish_copy(&copy->src_st, copy->dst_path, copy->dst_exists, &copy->dst_st,
+                copy->dst_fd, copy->src_st.st_size);
+  }
+  memacct_add(MEMACCT_DATA, -(ssize_t) copy->size);
+  free(copy);
+}
+
+/**
+ * Copy a file larger than --chunk-size in chunks of that size, spread over
+ * up to --chunk-threads data threads.  The length the file has now is the
+ * length copied.  Takes over src_fd and dst_fd.
+ */
+static void submit_chunks(
+  const char *src_path,
+  const char *dst_path,
+  int dst_exists,
+  const struct stat *dst_st,
+  int src_fd,
+  int dst_fd
+) {
+  size_t src_len = strlen(src_path) + 1;
+  size_t dst_len = strlen(dst_path) + 1;
+  size_t size = sizeof(struct chunked_copy) + src_len + dst_len;
+  struct chunked_copy *copy;
+  struct chunk_job *job;
+  struct stat st;
+  size_t i, chunks, parts;
+
+  copy = xmalloc(size);
+  memacct_add(MEMACCT_DATA, size);
+  copy->size = size;
+  if(fstat(src_fd, &copy->src_st) == -1) {
+    perror(src_path);
+    goto fail;
+  }
+  if(fstat(dst_fd, &st) == -1) {
+    perror(dst_path);
+    goto fail;
+  }
+  close(src_fd);
+  if(dst_exists) copy->dst_st = *dst_st;
+  copy->dst_exists = dst_exists;
+  copy->dst_fd = dst_fd;
+  copy->dst_size = st.st_size;
+  copy->dst_blksize = st.st_blksize;
+  copy->flags = g_copy_flags;
+  if(copy_is_sparse(&copy->src_st)) copy->flags |= COPY_SPARSE;
+  copy->failed = 0;
+  chunks = (copy->src_st.st_size + g_chunk_size - 1) / g_chunk_size;
+  parts = chunks < g_chunk_threads ? chunks : g_chunk_threads;
+  if(!parts) parts = 1;
+  copy->parts = parts;
+  copy->remaining = parts;
+  copy->src_path = (char *) (copy + 1);
+  copy->dst_path = copy->src_path + src_len;
+  memcpy(copy->src_path, src_path, src_len);
+  memcpy(copy->dst_path, dst_path, dst_len);
+
+  for(i = 0; i < parts; ++i) {
+    job = xmalloc(sizeof(struct chunk_job));
+    memacct_add(MEMACCT_DATA, sizeof(struct chunk_job));
+    job->copy = copy;
+    job->part = i;
+    // the parts may all have finished and freed copy by the time this returns
+    mtpt_submit(chunk_job_run, job);
+  }
+  return;
+
+fail:
+  g_error = 1;
+  close(src_fd);
+  close(dst_fd);
+  memacct_add(MEMACCT_DATA, -(ssize_t) size);
+  free(copy);
+}
+
+/**
+ * Copy the contents of src_path over dst_path, which are known to differ,
+ * and then its mode, ownership and mtime as asked.  dst_st is the stat of
+ * dst_path if dst_exists.
+ */
+static void copy_file(
+  const struct stat *src_st,
+  const char *src_path,
+  const char *dst_path,
+  const char *rel_path,
+  int dst_exists,
+  const struct stat *dst_st
+) {
+  int rc;
+  int src_fd, dst_fd;
+  struct copy_result result;
+
+  // remove dst if it has more than one link
+  if(dst_exists && dst_st->st_nlink > 1) {
+    metadata_op();
+    unlink(dst_path);
+    dst_exists = 0;
+  }
+
+  // open src for reading
+  metadata_op();
+  src_fd = open(src_path, O_RDONLY);
+  if(src_fd == -1) {
+    if(errno != ENOENT) {
+      perror(src_path);
       g_error = 1;
-      close(dst_fd);
-      return;
     }
+    return;
+  }
 
-    if(g_preserve_mode) {
-      if(!dst_exists ||
-         src_st->st_mode != dst_st.st_mode
-      ) {
-        rc = fchmod(dst_fd, src_st->st_mode);
+  if(g_verbose) output_printf("%s\n", rel_path);
+
+  if(dst_exists && g_euid != 0) {
+    // make sure I can write to dst
+    metadata_op();
+    rc = access(dst_path, g_dst_flags == O_RDWR ? R_OK | W_OK : W_OK);
+    if(rc) {
+      if(errno == EACCES) {
+        mode_t m = dst_st->st_mode | S_IWUSR;
+        if(g_dst_flags == O_RDWR) m |= S_IRUSR;
+        if(dst_st->st_uid != g_euid) {
+          // if I'm not the owner of the file then perhaps I have access
+          // through the group
+          m |= S_IWGRP;
+          if(g_dst_flags == O_RDWR) m |= S_IRGRP;
+        }
+        metadata_op();
+        rc = chmod(dst_path, m);
         if(rc) {
           perror(dst_path);
           g_error = 1;
-          close(dst_fd);
+          close(src_fd);
           return;
         }
+      } else if(errno == ENOENT) {
+        dst_exists = 0;
+      } else {
+        perror(dst_path);
+        g_error = 1;
+        close(src_fd);
+        return;
       }
     }
+  }
 
-    if(g_preserve_ownership) {
-      if(!dst_exists ||
-         (g_euid == 0 && src_st->st_uid != dst_st.st_uid) ||
-         src_st->st_gid != dst_st.st_gid
-      ) {
-        uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
-        rc = fchown(dst_fd, uid, src_st->st_gid);
-        if(rc) {
-          perror(dst_path);
-          g_error = 1;
-          close(dst_fd);
-          return;
-        }
+  // open dst for writing
+  metadata_op();
+  dst_fd = open(dst_path, g_dst_flags | O_CREAT, 0600);
+  if(dst_fd == -1) {
+    perror(dst_path);
+    g_error = 1;
+    close(src_fd);
+    return;
+  }
+
+  if(g_chunk_size && g_opts.options.data_threads && g_chunk_threads > 1 &&
+     src_st->st_size > (off_t) g_chunk_size && g_copy_method != COPY_CLONE
+  ) {
+    // a large file is cloned whole if it can be, or else split up
+    if(g_copy_method == COPY_AUTO && copy_clone(src_fd, dst_fd) == 0) {
+      if(g_stats) {
+        __atomic_add_fetch(&g_totals.files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_totals.cloned, 1, __ATOMIC_RELAXED);
       }
+      close(src_fd);
+      finish_copy(src_st, dst_path, dst_exists, dst_st, dst_fd, src_st->st_size);
+    } else {
+      submit_chunks(src_path, dst_path, dst_exists, dst_st, src_fd, dst_fd);
     }
+    return;
+  }
 
+  // copy the data
+  if(g_buffer_auto) {
+    struct stat st;
+    thread_io_want(src_st->st_blksize, fstat(dst_fd, &st) == 0 ? st.st_blksize : 0);
+  } else {
+    thread_io_want(0, 0);
+  }
+  rc = copy_data(src_fd, dst_fd, g_copy_method, g_copy_flags, thread_io_buffer, &result);
+  if(g_stats) {
+    __atomic_add_fetch(&g_totals.copied, result.copied, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_totals.holes, result.holes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_totals.same, result.same, __ATOMIC_RELAXED);
+  }
+  if(rc) {
+    perror(result.read_error ? src_path : dst_path);
+    g_error = 1;
+    close(src_fd);
     close(dst_fd);
+    return;
+  }
+  if(g_stats) {
+    __atomic_add_fetch(&g_totals.files, 1, __ATOMIC_RELAXED);
+    if(result.method == COPY_CLONE) __atomic_add_fetch(&g_totals.cloned, 1, __ATOMIC_RELAXED);
+  }
+  close(src_fd);
+  finish_copy(src_st, dst_path, dst_exists, dst_st, dst_fd, result.length);
+}
+
+/// set the mode and ownership of dst_path, whose contents are already right
+static void sync_attrs(
+  const struct stat *src_st,
+  const char *dst_path,
+  const struct stat *dst_st
+) {
+  int rc;
 
-    if(g_preserve_mtime) {
-      rc = settimes(dst_path, src_st);
+  if(g_preserve_mode) {
+    if(src_st->st_mode != dst_st->st_mode) {
+      metadata_op();
+      rc = chmod(dst_path, src_st->st_mode);
       if(rc) {
         perror(dst_path);
         g_error = 1;
         return;
       }
     }
-  } else { // file size and mtime are the same
-    if(g_preserve_mode) {
-      if(src_st->st_mode != dst_st.st_mode) {
-        rc = chmod(dst_path, src_st->st_mode);
-        if(rc) {
-          perror(dst_path);
-          g_error = 1;
-          return;
-        }
+  }
+
+  if(g_preserve_ownership) {
+    if((g_euid == 0 && src_st->st_uid != dst_st->st_uid) ||
+       src_st->st_gid != dst_st->st_gid
+    ) {
+      uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
+      metadata_op();
+      rc = chown(dst_path, uid, src_st->st_gid);
+      if(rc) {
+        perror(dst_path);
+        g_error = 1;
+        return;
       }
     }
+  }
+}
 
-    if(g_preserve_ownership) {
-      if((g_euid == 0 && src_st->st_uid != dst_st.st_uid) ||
-         src_st->st_gid != dst_st.st_gid
-      ) {
-        uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
-        rc = chown(dst_path, uid, src_st->st_gid);
-        if(rc) {
-          perror(dst_path);
-          g_error = 1;
-          return;
-        }
+/// hash the contents of path, or return -1 with errno set
+static int hash_file(const char *path, uint64_t *digest) {
+  int fd, rc, err;
+
+  metadata_op();
+  fd = open(path, O_RDONLY);
+  if(fd == -1) return -1;
+  rc = hash64_fd(fd, thread_io_buffer, digest);
+  err = errno;
+  close(fd);
+  errno = err;
+  return rc;
+}
+
+/**
+ * For -c, copy src_path over dst_path, which has the same size, only if
+ * their contents hash differently.  Otherwise only the mode, ownership and
+ * mtime are set as asked.
+ */
+static void check_file(
+  const struct stat *src_st,
+  const char *src_path,
+  const char *dst_path,
+  const char *rel_path,
+  const struct stat *dst_st
+) {
+  uint64_t src_digest, dst_digest;
+
+  if(g_stats) __atomic_add_fetch(&g_totals.checked, 1, __ATOMIC_RELAXED);
+  thread_io_want(src_st->st_blksize, dst_st->st_blksize);
+  if(hash_file(src_path, &src_digest)) {
+    if(errno != ENOENT) {
+      perror(src_path);
+      g_error = 1;
+    }
+    return;
+  }
+  if(hash_file(dst_path, &dst_digest) || src_digest != dst_digest) {
+    // an unreadable dst is rewritten
+    copy_file(src_st, src_path, dst_path, rel_path, 1, dst_st);
+    return;
+  }
+  sync_attrs(src_st, dst_path, dst_st);
+  if(g_preserve_mtime && !samemtime(src_st, dst_st)) {
+    metadata_op();
+    if(settimes(dst_path, src_st)) {
+      perror(dst_path);
+      g_error = 1;
+    }
+  }
+}
+
+/// a file for a data thread to copy
+struct copy_job {
+  struct stat src_st;
+  struct stat dst_st;
+  int dst_exists;
+  /// non-zero to compare the hashes of the two first, for -c
+  int check;
+  char *src_path;
+  char *dst_path;
+  char *rel_path;
+  size_t size;
+};
+
+static void copy_job_run(void *arg) {
+  struct copy_job *job = arg;
+
+  if(job->check) {
+    check_file(&job->src_st, job->src_path, job->dst_path, job->rel_path, &job->dst_st);
+  } else {
+    copy_file(&job->src_st, job->src_path, job->dst_path, job->rel_path, job->dst_exists, &job->dst_st);
+  }
+  memacct_add(MEMACCT_DATA, -(ssize_t) job->size);
+  free(job);
+}
+
+/**
+ * Copy a file, or with check compare it first, on one of the data threads,
+ * if there are any, so that the thread that found it can go back to reading
+ * directories.
+ */
+static void submit_copy(
+  const struct stat *src_st,
+  const char *src_path,
+  const char *dst_path,
+  const char *rel_path,
+  int dst_exists,
+  const struct stat *dst_st,
+  int check
+) {
+  size_t src_len = strlen(src_path) + 1;
+  size_t dst_len = strlen(dst_path) + 1;
+  size_t rel_len = strlen(rel_path) + 1;
+  size_t size = sizeof(struct copy_job) + src_len + dst_len + rel_len;
+  struct copy_job *job = xmalloc(size);
+
+  memacct_add(MEMACCT_DATA, size);
+  job->size = size;
+  job->src_st = *src_st;
+  if(dst_exists) job->dst_st = *dst_st;
+  job->dst_exists = dst_exists;
+  job->check = check;
+  job->src_path = (char *) (job + 1);
+  job->dst_path = job->src_path + src_len;
+  job->rel_path = job->dst_path + dst_len;
+  memcpy(job->src_path, src_path, src_len);
+  memcpy(job->dst_path, dst_path, dst_len);
+  memcpy(job->rel_path, rel_path, rel_len);
+  mtpt_submit(copy_job_run, job);
+}
+
+static void sync_file(
+  const struct stat *src_st,
+  const char *src_path,
+  const char *dst_path,
+  const char *rel_path
+) {
+  int rc, dst_exists;
+  struct stat dst_st;
+
+  // stat dst
+  metadata_op();
+  rc = lstat(dst_path, &dst_st);
+  dst_exists = 1;
+  if(rc) {
+    if(errno != ENOENT) {
+      perror(dst_path);
+      g_error = 1;
+      return;
+    }
+    dst_exists = 0;
+  }
+
+  if(excluded(g_exclude_delete, g_exclude_delete_count, rel_path, 0)) {
+    if(dst_exists) {
+      if(S_ISDIR(dst_st.st_mode)) {
+        unlink_dir(dst_path);
+      } else {
+        metadata_op();
+        unlink(dst_path);
+      }
+    }
+    return;
+  }
+
+  // remove dst if not a regular file
+  if(dst_exists && !S_ISREG(dst_st.st_mode)) {
+    if(S_ISDIR(dst_st.st_mode)) {
+      unlink_dir(dst_path);
+    } else {
+      metadata_op();
+      unlink(dst_path);
+    }
+    dst_exists = 0;
+  }
+
+  if(!dst_exists ||
+     src_st->st_size != dst_st.st_size ||
+     g_checksum ||
+     !samemtime(src_st, &dst_st)
+  ) { // dst does not exist, file size or mtime differ, or contents are hashed
+    int check = g_checksum && dst_exists && src_st->st_size == dst_st.st_size;
+    if(!g_opts.options.data_threads || (g_preserve_hardlinks && src_st->st_nlink > 1)) {
+      // with -H, traverse_file() records the inode of dst for the other
+      // links as soon as this returns, so it has to exist by then
+      if(check) {
+        check_file(src_st, src_path, dst_path, rel_path, &dst_st);
+      } else {
+        copy_file(src_st, src_path, dst_path, rel_path, dst_exists, &dst_st);
       }
+    } else {
+      submit_copy(src_st, src_path, dst_path, rel_path, dst_exists, &dst_st, check);
     }
+  } else { // file size and mtime are the same
+    sync_attrs(src_st, dst_path, &dst_st);
   }
 }
 
@@ -457,10 +1043,12 @@ static void sync_symlink(
   int rc, dst_exists;
   struct stat dst_st;
   ssize_t src_len, dst_len;
-  char src_target[PATH_MAX];
-  char dst_target[PATH_MAX];
+  struct thread_buffers *tb = thread_buffers();
+  char *src_target = tb->src_target;
+  char *dst_target = tb->dst_target;
 
   // stat dst
+  metadata_op();
   rc = lstat(dst_path, &dst_st);
   dst_exists = 1;
   if(rc) {
@@ -477,6 +1065,7 @@ static void sync_symlink(
       if(S_ISDIR(dst_st.st_mode)) {
         unlink_dir(dst_path);
       } else {
+        metadata_op();
         unlink(dst_path);
       }
     }
@@ -484,11 +1073,13 @@ static void sync_symlink(
   }
 
   // read src target
+  metadata_op();
   src_len = readlink(src_path, src_target, PATH_MAX-1);
   if(src_len == -1) {
     if(errno == ENOENT) {
       // src was removed
       if(dst_exists) {
+        metadata_op();
         unlink(dst_path);
       }
     } else {
@@ -504,6 +1095,7 @@ static void sync_symlink(
     if(S_ISDIR(dst_st.st_mode)) {
       unlink_dir(dst_path);
     } else {
+      metadata_op();
       unlink(dst_path);
     }
     dst_exists = 0;
@@ -511,9 +1103,11 @@ static void sync_symlink(
 
   if(dst_exists) {
     // read dst target
+    metadata_op();
     dst_len = readlink(dst_path, dst_target, PATH_MAX-1);
     if(dst_len == -1) {
       if(errno != ENOENT) {
+        metadata_op();
         rc = unlink(dst_path);
         if(rc && errno != ENOENT) {
           perror(dst_path);
@@ -526,6 +1120,7 @@ static void sync_symlink(
       dst_target[dst_len] = '\0';
       // remove dst if target differs
       if(src_len != dst_len || strcmp(src_target, dst_target) != 0) {
+        metadata_op();
         unlink(dst_path);
         dst_exists = 0;
       }
@@ -534,7 +1129,8 @@ static void sync_symlink(
 
   // create dst
   if(!dst_exists) {
-    if(g_verbose) printf("%s\n", rel_path);
+    if(g_verbose) output_printf("%s\n", rel_path);
+    metadata_op();
     rc = symlink(src_target, dst_path);
     if(rc) {
       perror(dst_path);
@@ -549,6 +1145,7 @@ static void sync_symlink(
        src_st->st_gid != dst_st.st_gid
     ) {
       uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
+      metadata_op();
       rc = lchown(dst_path, uid, src_st->st_gid);
       if(rc) {
         perror(dst_path);
@@ -571,6 +1168,7 @@ static void sync_special(
   struct stat dst_st;
 
   // stat dst
+  metadata_op();
   rc = lstat(dst_path, &dst_st);
   dst_exists = 1;
   if(rc) {
@@ -587,6 +1185,7 @@ static void sync_special(
       if(S_ISDIR(dst_st.st_mode)) {
         unlink_dir(dst_path);
       } else {
+        metadata_op();
         unlink(dst_path);
       }
     }
@@ -598,6 +1197,7 @@ static void sync_special(
     if(S_ISDIR(dst_st.st_mode)) {
       unlink_dir(dst_path);
     } else {
+      metadata_op();
       unlink(dst_path);
     }
     dst_exists = 0;
@@ -605,6 +1205,7 @@ static void sync_special(
 
   if(usedev) {
     if(dst_exists && src_st->st_dev != dst_st.st_dev) {
+      metadata_op();
       unlink(dst_path);
       dst_exists = 0;
     }
@@ -612,10 +1213,12 @@ static void sync_special(
 
   // create dst
   if(!dst_exists) {
-    if(g_verbose) printf("%s\n", rel_path);
+    if(g_verbose) output_printf("%s\n", rel_path);
     if(usedev) {
+      metadata_op();
       rc = mknod(dst_path, src_st->st_mode, src_st->st_dev);
     } else {
+      metadata_op();
       rc = mknod(dst_path, src_st->st_mode, 0);
     }
     if(rc) {
@@ -624,6 +1227,7 @@ static void sync_special(
       return;
     }
   } else if(g_preserve_mode && src_st->st_mode != dst_st.st_mode) {
+    metadata_op();
     rc = chmod(dst_path, src_st->st_mode);
     if(rc) {
       perror(dst_path);
@@ -638,6 +1242,7 @@ static void sync_special(
        src_st->st_gid != dst_st.st_gid
     ) {
       uid_t uid = g_euid == 0 ? src_st->st_uid : (uid_t)-1;
+      metadata_op();
       rc = chown(dst_path, uid, src_st->st_gid);
       if(rc) {
         perror(dst_path);
@@ -660,7 +1265,7 @@ static int traverse_dir_enter(
   const char *p, *rel_path;
   int rc, dst_exists;
   struct stat dst_st;
-  char dst_path[PATH_MAX];
+  char *dst_path = thread_buffers()->dst_path;
 
   if(g_one_file_system && g_dev != src_st->st_dev) return 0;
 
@@ -675,9 +1280,10 @@ static int traverse_dir_enter(
 
   if(excluded(g_exclude, g_exclude_count, rel_path, 1)) return 0;
 
-  if(g_verbose > 1) printf(">>> %s/\n", src_path);
+  if(g_verbose > 1) output_printf(">>> %s/\n", src_path);
 
   // stat dst
+  metadata_op();
   rc = lstat(dst_path, &dst_st);
   dst_exists = 1;
   if(rc) {
@@ -694,6 +1300,7 @@ static int traverse_dir_enter(
       if(S_ISDIR(dst_st.st_mode)) {
         unlink_dir(dst_path);
       } else {
+        metadata_op();
         unlink(dst_path);
       }
     }
@@ -702,14 +1309,16 @@ static int traverse_dir_enter(
 
   // remove dst if not a directory
   if(dst_exists && !S_ISDIR(dst_st.st_mode)) {
+    metadata_op();
     unlink(dst_path);
     dst_exists = 0;
   }
 
   // create dst
   if(!dst_exists) {
-    if(g_verbose) printf("%s/\n", rel_path);
+    if(g_verbose) output_printf("%s/\n", rel_path);
 
+    metadata_op();
     rc = mkdir(dst_path, 0700);
     if(rc && errno != EEXIST) {
       perror(dst_path);
@@ -719,6 +1328,7 @@ static int traverse_dir_enter(
   }
 
   cont = malloc(sizeof(struct traverse_continuation));
+  memacct_add(MEMACCT_DATA, sizeof(struct traverse_continuation));
   cont->dst_exists = dst_exists;
   cont->dst_st = dst_st;
   cont->src_st = *src_st;
@@ -743,20 +1353,27 @@ static void * traverse_dir_exit(
 ) {
   struct traverse_arg *t = arg;
   struct traverse_continuation *cont = continuation;
-  const char *p;
+  const char *p, *rel_path;
   DIR *d;
   struct dirent *dirp;
   int rc;
   struct stat st;
-  char dst_path[PATH_MAX];
-  char dst_p[PATH_MAX];
+  struct thread_buffers *tb = thread_buffers();
+  char *dst_path = tb->dst_path;
+  char *dst_p = tb->dst_p;
 
   p = src_path + t->src_root_len;
   strcpy(dst_path, t->dst_root);
   strcpy(dst_path + t->dst_root_len, p);
+  rel_path = *p ? p + 1 : ".";
 
-  if(g_delete && cont->dst_exists && !samemtime(&cont->src_st, &cont->dst_st)) {
+  // a directory above the seeded ones only has the seeded entries, so
+  // nothing can be said about what else belongs in it
+  if(g_delete && cont->dst_exists && !samemtime(&cont->src_st, &cont->dst_st) &&
+     (!g_opts.seeds || seeds_covers(g_opts.seeds, rel_path))
+  ) {
     // delete files in dst that are not in src
+    metadata_op();
     d = opendir(dst_path);
     if(!d) {
       perror(dst_path);
@@ -780,6 +1397,7 @@ static void * traverse_dir_exit(
             goto delete_other;
           }
 #endif
+          metadata_op();
           rc = lstat(dst_p, &st);
           if(rc) {
             if(errno != ENOENT) {
@@ -792,13 +1410,14 @@ static void * traverse_dir_exit(
 #ifdef _DIRENT_HAVE_D_TYPE
           delete_dir:
 #endif
-            if(g_verbose) printf("deleting %s\n", dst_p);
+            if(g_verbose) output_printf("deleting %s\n", dst_p);
             unlink_dir(dst_p);
           } else {
 #ifdef _DIRENT_HAVE_D_TYPE
           delete_other:
 #endif
-            if(g_verbose) printf("deleting %s\n", dst_p);
+            if(g_verbose) output_printf("deleting %s\n", dst_p);
+            metadata_op();
             unlink(dst_p);
           }
         }
@@ -807,12 +1426,13 @@ static void * traverse_dir_exit(
     }
   }
 
-  if(g_verbose > 1) printf("<<< %s/\n", src_path);
+  if(g_verbose > 1) output_printf("<<< %s/\n", src_path);
 
   if(g_preserve_mode) {
     if(!cont->dst_exists ||
        cont->src_st.st_mode != cont->dst_st.st_mode
     ) {
+      metadata_op();
       rc = chmod(dst_path, cont->src_st.st_mode);
       if(rc) {
         perror(dst_path);
@@ -828,6 +1448,7 @@ static void * traverse_dir_exit(
        cont->src_st.st_gid != cont->dst_st.st_gid
     ) {
       uid_t uid = g_euid == 0 ? cont->src_st.st_uid : (uid_t)-1;
+      metadata_op();
       rc = chown(dst_path, uid, cont->src_st.st_gid);
       if(rc) {
         perror(dst_path);
@@ -838,6 +1459,7 @@ static void * traverse_dir_exit(
   }
 
   if(g_preserve_mtime) {
+    metadata_op();
     rc = settimes(dst_path, src_st);
     if(rc) {
       perror(dst_path);
@@ -848,6 +1470,7 @@ static void * traverse_dir_exit(
 
 out:
   free(cont);
+  memacct_add(MEMACCT_DATA, -(ssize_t) sizeof(struct traverse_continuation));
   return NULL;
 }
 
@@ -862,7 +1485,7 @@ static void * traverse_file(
   struct hardlink_entry hl, *hlp, **hlpp;
   struct stat dst_st;
   int rc;
-  char dst_path[PATH_MAX];
+  char *dst_path = thread_buffers()->dst_path;
 
   strcpy(dst_path, t->dst_root);
   p = src_path + t->src_root_len;
@@ -887,6 +1510,7 @@ static void * traverse_file(
     if(hlpp) {
       hlp = *hlpp;
       // the inode has already been sync'd, just link to it
+      metadata_op();
       rc = lstat(dst_path, &dst_st);
       if(rc == 0) {
         if(hlp->dst_dev == dst_st.st_dev && hlp->dst_ino == dst_st.st_ino) {
@@ -898,6 +1522,7 @@ static void * traverse_file(
         if(S_ISDIR(dst_st.st_mode)) {
           unlink_dir(dst_path);
         } else {
+          metadata_op();
           unlink(dst_path);
         }
       } else if(errno != ENOENT) {
@@ -907,8 +1532,9 @@ static void * traverse_file(
         pthread_mutex_unlock(&g_hardlinks_mutex);
         return NULL;
       }
-      if(g_verbose) printf("%s\n", rel_path);
+      if(g_verbose) output_printf("%s\n", rel_path);
       // make the link
+      metadata_op();
       rc = link(hlp->dst_path, dst_path);
       if(rc) {
         perror(dst_path);
@@ -938,6 +1564,7 @@ static void * traverse_file(
   }
 
   if(g_preserve_hardlinks && src_st->st_nlink > 1) {
+    metadata_op();
     rc = lstat(dst_path, &dst_st);
     if(rc) {
       /* What has likely happened here is that the file was matched by a pattern
@@ -950,10 +1577,12 @@ static void * traverse_file(
       return NULL;
     }
     if(g_hardlinks_count == g_hardlinks_size) {
+      g_hardlinks = xrealloc(g_hardlinks, sizeof(struct hardlink_entry *) * (g_hardlinks_size << 1));
+      memacct_add(g_memacct_hardlinks, sizeof(struct hardlink_entry *) * g_hardlinks_size);
       g_hardlinks_size <<= 1;
-      g_hardlinks = xrealloc(g_hardlinks, sizeof(struct hardlink_entry) * g_hardlinks_size);
     }
     hlp = xmalloc(sizeof(hl));
+    memacct_add(g_memacct_hardlinks, sizeof(hl) + strlen(dst_path) + 1);
     hlp->src_dev = hl.src_dev;
     hlp->src_ino = hl.src_ino;
     hlp->dst_dev = dst_st.st_dev;
@@ -968,6 +1597,38 @@ static void * traverse_file(
   return NULL;
 }
 
+/**
+ * Set the times of the dst directory above src_path to those of its src,
+ * after a retry has changed it by creating src_path's dst.
+ */
+static void reset_parent_times(struct traverse_arg *t, const char *src_path) {
+  char *src_parent, *dst_parent, *slash;
+  struct stat st;
+
+  if(strlen(src_path) <= t->src_root_len) return;
+  src_parent = xmalloc(strlen(src_path) + 1);
+  strcpy(src_parent, src_path);
+  slash = strrchr(src_parent, '/');
+  if(!slash || (size_t) (slash - src_parent) < t->src_root_len) {
+    free(src_parent);
+    return;
+  }
+  *slash = '\0';
+  dst_parent = xmalloc(t->dst_root_len + strlen(src_parent + t->src_root_len) + 1);
+  strcpy(dst_parent, t->dst_root);
+  strcpy(dst_parent + t->dst_root_len, src_parent + t->src_root_len);
+  metadata_op();
+  if(lstat(src_parent, &st)) {
+    perror(src_parent);
+    g_error = 1;
+  } else if(settimes(dst_parent, &st)) {
+    perror(dst_parent);
+    g_error = 1;
+  }
+  free(dst_parent);
+  free(src_parent);
+}
+
 static void * traverse_error(
   void *arg,
   const char *src_path,
@@ -980,16 +1641,19 @@ static void * traverse_error(
 }
 
 int main(int argc, char *argv[]) {
-  int rc, opt;
-  size_t threads;
+  int rc, opt, config = MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT;
+  size_t i, threads, deferred_count;
+  char **deferred;
+  mtpt_options_t retry_options;
   const char *src_path, *dst_path;
   struct traverse_arg t;
   struct stat st;
 
   g_euid = geteuid();
-  threads = DEFAULT_NTHREADS;
+  toolopts_init(&g_opts, TOOLOPTS_SEEDS | TOOLOPTS_COSTS | TOOLOPTS_RETRY, DEFAULT_NTHREADS);
+  g_opts.options.data_threads = DEFAULT_DATA_NTHREADS;
 
-  while((opt = getopt(argc, argv, "hvj:apotHDe:E:sw:x")) != -1) {
+  while((opt = getopt_long(argc, argv, "hvj:J:apotHcDe:E:sw:x", long_options, NULL)) != -1) {
     switch(opt) {
     case 'h':
       usage(stdout, argv[0]);
@@ -997,13 +1661,16 @@ int main(int argc, char *argv[]) {
     case 'v':
       g_verbose += 1;
       break;
-    case 'j':
-      threads = atoi(optarg);
-      if(threads <= 0) {
-        fprintf(stderr, "Error: number of threads (-j) must be a positive integer\n");
+    case 'J': {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if(*optarg == '\0' || *end != '\0' || n < 0) {
+        fprintf(stderr, "Error: number of data threads (-J) must be a non-negative integer\n");
         exit(2);
       }
+      g_opts.options.data_threads = n;
       break;
+    }
     case 'a':
       g_preserve_mode = 1;
       g_preserve_ownership = 1;
@@ -1021,6 +1688,9 @@ int main(int argc, char *argv[]) {
     case 'H':
       g_preserve_hardlinks = 1;
       break;
+    case 'c':
+      g_checksum = 1;
+      break;
     case 'D':
       g_delete = 0;
       break;
@@ -1050,12 +1720,67 @@ int main(int argc, char *argv[]) {
     case 'x':
       g_one_file_system = 1;
       break;
+    case OPT_STATS:
+      g_stats = 1;
+      break;
+    case OPT_DIRECT:
+      g_copy_flags |= COPY_DIRECT;
+      break;
+    case OPT_BUFFER_SIZE:
+      if(strcmp(optarg, "auto") == 0) {
+        g_buffer_auto = 1;
+        g_buffer_size = 0;
+      } else if(fstune_parse_size(optarg, &g_buffer_size) || g_buffer_size < MIN_IO_BUFFER_SIZE) {
+        fprintf(stderr, "Error: invalid buffer size: %s\n", optarg);
+        exit(2);
+      } else {
+        g_buffer_auto = 0;
+        if(g_buffer_size > MAX_IO_BUFFER_SIZE) g_buffer_size = MAX_IO_BUFFER_SIZE;
+        g_buffer_size = direct_align_up(g_buffer_size);
+      }
+      break;
+    case OPT_NO_PREALLOCATE:
+      g_copy_flags &= ~COPY_PREALLOCATE;
+      break;
+    case OPT_CHUNK_SIZE:
+      if(fstune_parse_size(optarg, &g_chunk_size) || g_chunk_size > SIZE_MAX - COPY_DIRECT_ALIGN) {
+        fprintf(stderr, "Error: invalid chunk size: %s\n", optarg);
+        exit(2);
+      }
+      // every chunk but the last is copied with O_DIRECT under --direct
+      g_chunk_size = direct_align_up(g_chunk_size);
+      break;
+    case OPT_CHUNK_THREADS: {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if(*optarg == '\0' || *end != '\0' || n < 1) {
+        fprintf(stderr, "Error: number of chunk threads must be a positive integer\n");
+        exit(2);
+      }
+      g_chunk_threads = n;
+      break;
+    }
+    case OPT_COPY_METHOD:
+      rc = copy_method_parse(optarg, &g_copy_method);
+      if(rc) {
+        fprintf(stderr, "Error: %s copy method: %s\n", rc == ENOSYS ? "unsupported" : "invalid", optarg);
+        exit(2);
+      }
+      g_dst_flags = g_copy_method == COPY_DELTA ? O_RDWR : O_WRONLY;
+      break;
     default:
+      if(toolopts_parse(&g_opts, opt, optarg)) break;
       usage(stderr, argv[0]);
       exit(2);
     }
   }
 
+  toolopts_setup(&g_opts, argv[0]);
+  if(memacct_enabled) {
+    g_memacct_hardlinks = memacct_register("hardlink table");
+    g_memacct_buffers = memacct_register("thread buffers");
+  }
+
   if(argc - optind != 2) {
     fprintf(stderr, "Error: incorrect number of arguments\n");
     usage(stderr, argv[0]);
@@ -1075,10 +1800,17 @@ int main(int argc, char *argv[]) {
     g_dev = st.st_dev;
   }
 
+  rc = output_init(STDOUT_FILENO, 0, isatty(STDOUT_FILENO) ? OUTPUT_ORDERED : 0);
+  if(rc) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+    exit(1);
+  }
+
   if(g_preserve_hardlinks) {
     g_hardlinks_count = 0;
     g_hardlinks_size = 32;
     g_hardlinks = xmalloc(sizeof(struct hardlink_entry *) * g_hardlinks_size);
+    memacct_add(g_memacct_hardlinks, sizeof(struct hardlink_entry *) * g_hardlinks_size);
     pthread_mutex_init(&g_hardlinks_mutex, NULL);
   }
 
@@ -1086,32 +1818,109 @@ int main(int argc, char *argv[]) {
   t.dst_root = dst_path;
   t.src_root_len = strlen(src_path);
   t.dst_root_len = strlen(dst_path);
-  rc = mtpt(
+
+  rc = pthread_key_create(&g_buffers_key, thread_buffers_free);
+  if(rc) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+
+  threads = g_opts.threads;
+  toolopts_tune(&g_opts, src_path, &threads, &config, &g_opts.options);
+  if(!g_chunk_threads) g_chunk_threads = g_opts.options.data_threads;
+  if(!g_buffer_size) {
+    g_buffer_size = g_copy_flags & COPY_DIRECT ? DIRECT_IO_BUFFER_SIZE : IO_BUFFER_SIZE;
+  }
+
+  rc = mtpt_opts(
     threads,
-    STACKSIZE,
-    MTPT_CONFIG_FILE_TASKS | MTPT_CONFIG_SORT,
+    g_opts.stacksize,
+    config,
     src_path,
     traverse_dir_enter,
     traverse_dir_exit,
     traverse_file,
     traverse_error,
     &t,
-    NULL
+    NULL,
+    &g_opts.options
   );
   if(rc) {
     perror(src_path);
     g_error = 1;
   }
 
+  // retry what the watchdog skipped, once
+  deferred = g_opts.deferred;
+  deferred_count = g_opts.deferred_count;
+  g_opts.deferred = NULL;
+  g_opts.deferred_count = 0;
+  for(i = 0; i < deferred_count; ++i) {
+    fprintf(stderr, "Retrying %s\n", deferred[i]);
+    retry_options = g_opts.options;
+    if(g_opts.seeds) {
+      retry_options.seeds = seeds_lookup(g_opts.seeds, deferred[i] + t.src_root_len);
+    }
+    rc = mtpt_opts(
+      threads,
+      g_opts.stacksize,
+      config,
+      deferred[i],
+      traverse_dir_enter,
+      traverse_dir_exit,
+      traverse_file,
+      traverse_error,
+      &t,
+      NULL,
+      &retry_options
+    );
+    if(rc) {
+      perror(deferred[i]);
+      g_error = 1;
+    } else if(g_preserve_mtime) {
+      // the parent's times were set before the retry changed it
+      reset_parent_times(&t, deferred[i]);
+    }
+    free(deferred[i]);
+  }
+  free(deferred);
+
   if(g_preserve_hardlinks) {
     size_t i;
     for(i = 0; i < g_hardlinks_count; ++i) {
+      memacct_add(g_memacct_hardlinks, -(ssize_t) (sizeof(struct hardlink_entry) + strlen(g_hardlinks[i]->dst_path) + 1));
       free(g_hardlinks[i]->dst_path);
       free(g_hardlinks[i]);
     }
+    memacct_add(g_memacct_hardlinks, -(ssize_t) (sizeof(struct hardlink_entry *) * g_hardlinks_size));
     free(g_hardlinks);
   }
 
+  rc = output_destroy();
+  if(rc) {
+    fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(rc));
+    g_error = 1;
+  }
+
+  if(g_stats) {
+    fprintf(stderr,
+      "Files copied: %llu (%llu cloned)\n"
+      "Bytes copied: %llu\n"
+      "Bytes skipped in holes: %llu\n",
+      (unsigned long long) g_totals.files,
+      (unsigned long long) g_totals.cloned,
+      (unsigned long long) g_totals.copied,
+      (unsigned long long) g_totals.holes
+    );
+    if(g_copy_method == COPY_DELTA) {
+      fprintf(stderr, "Bytes already the same: %llu\n", (unsigned long long) g_totals.same);
+    }
+    if(g_checksum) {
+      fprintf(stderr, "Files compared by hash: %llu\n", (unsigned long long) g_totals.checked);
+    }
+  }
+  if(toolopts_finish(&g_opts)) g_error = 1;
+
   if(g_exclude) free(g_exclude);
   if(g_exclude_delete) free(g_exclude_delete);
   exit(g_error);
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "output.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BLOCK_SIZE (1<<16) // 64 KB
+
+/// number of full blocks that can wait for the writer before producers block
+#define MAX_QUEUED_BLOCKS 64
+
+/// longest time a partial block waits for more records, in milliseconds
+#define SWEEP_INTERVAL_MS 200
+
+struct output_block {
+  struct output_block *next;
+  size_t len;
+  size_t size;
+  char data[1];
+};
+
+struct output_thread {
+  struct output_thread *prev;
+  struct output_thread *next;
+  /// protects block, which the writer takes when sweeping
+  pthread_mutex_t mutex;
+  struct output_block *block;
+};
+
+static struct {
+  int fd;
+  int flags;
+  int error;
+  int stop;
+  int writing;
+  size_t block_size;
+  pthread_t writer;
+  pthread_key_t key;
+  pthread_mutex_t mutex;
+  /// wakes the writer
+  pthread_cond_t writer_cond;
+  /// wakes producers waiting for room and callers of output_flush()
+  pthread_cond_t done_cond;
+  /// blocks ready to be written
+  struct output_block *head, *tail;
+  size_t queued;
+  /// with OUTPUT_ORDERED, the block all threads append to
+  struct output_block *shared;
+  /// per-thread buffers
+  struct output_thread *threads;
+} g_output;
+
+static struct output_block * output_block_new(size_t size) {
+  struct output_block *block = malloc(sizeof(struct output_block) + size);
+  if(!block) return NULL;
+  block->next = NULL;
+  block->len = 0;
+  block->size = size;
+  return block;
+}
+
+// must be called with g_output.mutex held
+static void output_enqueue(struct output_block *block) {
+  block->next = NULL;
+  if(g_output.tail) {
+    g_output.tail->next = block;
+  } else {
+    g_output.head = block;
+    pthread_cond_signal(&g_output.writer_cond);
+  }
+  g_output.tail = block;
+  ++g_output.queued;
+}
+
+// must be called with g_output.mutex held
+static void output_sweep(void) {
+  struct output_thread *t;
+
+  for(t = g_output.threads; t; t = t->next) {
+    pthread_mutex_lock(&t->mutex);
+    if(t->block && t->block->len) {
+      output_enqueue(t->block);
+      t->block = NULL;
+    }
+    pthread_mutex_unlock(&t->mutex);
+  }
+  if(g_output.shared && g_output.shared->len) {
+    output_enqueue(g_output.shared);
+    g_output.shared = NULL;
+  }
+}
+
+static int output_write_all(const char *buf, size_t len) {
+  ssize_t n;
+
+  while(len) {
+    n = write(g_output.fd, buf, len);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void * output_writer(void *arg) {
+  struct output_block *blocks, *block;
+  struct timespec ts;
+  int rc;
+
+  pthread_mutex_lock(&g_output.mutex);
+  while(1) {
+    while(!g_output.head) {
+      if(g_output.shared && g_output.shared->len) {
+        // ordered records are written as soon as the writer is free
+        output_enqueue(g_output.shared);
+        g_output.shared = NULL;
+        break;
+      }
+      if(g_output.stop) {
+        pthread_mutex_unlock(&g_output.mutex);
+        return NULL;
+      }
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += SWEEP_INTERVAL_MS * 1000000l;
+      if(ts.tv_nsec >= 1000000000l) {
+        ts.tv_nsec -= 1000000000l;
+        ++ts.tv_sec;
+      }
+      rc = pthread_cond_timedwait(&g_output.writer_cond, &g_output.mutex, &ts);
+      if(rc == ETIMEDOUT) output_sweep();
+    }
+
+    blocks = g_output.head;
+    g_output.head = g_output.tail = NULL;
+    g_output.writing = 1;
+    pthread_mutex_unlock(&g_output.mutex);
+
+    while((block = blocks)) {
+      blocks = block->next;
+      if(!g_output.error) {
+        rc = output_write_all(block->data, block->len);
+        if(rc) g_output.error = rc;
+      }
+      free(block);
+      pthread_mutex_lock(&g_output.mutex);
+      --g_output.queued;
+      pthread_mutex_unlock(&g_output.mutex);
+    }
+
+    pthread_mutex_lock(&g_output.mutex);
+    g_output.writing = 0;
+    pthread_cond_broadcast(&g_output.done_cond);
+  }
+}
+
+static void output_thread_exit(void *arg) {
+  struct output_thread *t = arg;
+
+  pthread_mutex_lock(&g_output.mutex);
+  if(t->block) {
+    if(t->block->len) output_enqueue(t->block);
+    else free(t->block);
+  }
+  if(t->prev) t->prev->next = t->next;
+  else g_output.threads = t->next;
+  if(t->next) t->next->prev = t->prev;
+  pthread_mutex_unlock(&g_output.mutex);
+  pthread_mutex_destroy(&t->mutex);
+  free(t);
+}
+
+static struct output_thread * output_thread_get(void) {
+  struct output_thread *t;
+
+  t = pthread_getspecific(g_output.key);
+  if(t) return t;
+  t = malloc(sizeof(struct output_thread));
+  if(!t) return NULL;
+  pthread_mutex_init(&t->mutex, NULL);
+  t->block = NULL;
+  t->prev = NULL;
+  pthread_mutex_lock(&g_output.mutex);
+  t->next = g_output.threads;
+  if(t->next) t->next->prev = t;
+  g_output.threads = t;
+  pthread_mutex_unlock(&g_output.mutex);
+  pthread_setspecific(g_output.key, t);
+  return t;
+}
+
+// must be called with g_output.mutex held
+static void output_wait_for_room(void) {
+  while(g_output.queued >= MAX_QUEUED_BLOCKS && !g_output.error) {
+    pthread_cond_wait(&g_output.done_cond, &g_output.mutex);
+  }
+}
+
+// must be called with g_output.mutex held
+static void output_hand_off(struct output_block *block) {
+  output_wait_for_room();
+  output_enqueue(block);
+}
+
+static struct output_block * output_block_for(size_t len) {
+  return output_block_new(len + 1 > g_output.block_size ? len + 1 : g_output.block_size);
+}
+
+static int output_record_ordered(size_t len, const char *format, va_list ap) {
+  struct output_block *block;
+
+  pthread_mutex_lock(&g_output.mutex);
+  block = g_output.shared;
+  if(block && block->size - block->len < len + 1) {
+    output_hand_off(block);
+    block = g_output.shared = NULL;
+  }
+  if(!block) {
+    block = g_output.shared = output_block_for(len);
+    if(!block) {
+      pthread_mutex_unlock(&g_output.mutex);
+      return -1;
+    }
+  }
+  vsnprintf(block->data + block->len, len + 1, format, ap);
+  block->len += len;
+  if(!g_output.writing) pthread_cond_signal(&g_output.writer_cond);
+  pthread_mutex_unlock(&g_output.mutex);
+  return len;
+}
+
+/*
+ * Formats a record of len bytes into the calling thread's block.  The
+ * writer locks t->mutex while holding g_output.mutex when it sweeps, so a
+ * full block is detached first and handed off without t->mutex held.
+ */
+static int output_record(size_t len, const char *format, va_list ap) {
+  struct output_thread *t;
+  struct output_block *block;
+
+  if(g_output.flags & OUTPUT_ORDERED) {
+    return output_record_ordered(len, format, ap);
+  }
+
+  t = output_thread_get();
+  if(!t) return -1;
+
+  pthread_mutex_lock(&t->mutex);
+  block = t->block;
+  if(block && block->size - block->len >= len + 1) {
+    vsnprintf(block->data + block->len, len + 1, format, ap);
+    block->len += len;
+    pthread_mutex_unlock(&t->mutex);
+    return len;
+  }
+  t->block = NULL;
+  pthread_mutex_unlock(&t->mutex);
+
+  if(block) {
+    pthread_mutex_lock(&g_output.mutex);
+    output_hand_off(block);
+    pthread_mutex_unlock(&g_output.mutex);
+  }
+
+  // only this thread installs blocks, so t->block is still NULL below
+  block = output_block_for(len);
+  if(!block) return -1;
+  vsnprintf(block->data, len + 1, format, ap);
+  block->len = len;
+  pthread_mutex_lock(&t->mutex);
+  t->block = block;
+  pthread_mutex_unlock(&t->mutex);
+  return len;
+}
+
+int output_printf(const char *format, ...) {
+  va_list ap;
+  int len;
+  char c;
+
+  // measure first so that the record can be formatted in place
+  va_start(ap, format);
+  len = vsnprintf(&c, 1, format, ap);
+  va_end(ap);
+  if(len < 0) return len;
+
+  va_start(ap, format);
+  len = output_record(len, format, ap);
+  va_end(ap);
+  return len;
+}
+
+int output_write(const void *buf, size_t len) {
+  return output_printf("%.*s", (int)len, (const char *)buf);
+}
+
+int output_flush(void) {
+  pthread_mutex_lock(&g_output.mutex);
+  output_sweep();
+  while(g_output.head || g_output.writing) {
+    pthread_cond_wait(&g_output.done_cond, &g_output.mutex);
+  }
+  pthread_mutex_unlock(&g_output.mutex);
+  return g_output.error;
+}
+
+int output_init(int fd, size_t block_size, int flags) {
+  int rc;
+
+  g_output.fd = fd;
+  g_output.flags = flags;
+  g_output.error = 0;
+  g_output.stop = 0;
+  g_output.writing = 0;
+  g_output.block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+  g_output.head = g_output.tail = NULL;
+  g_output.queued = 0;
+  g_output.shared = NULL;
+  g_output.threads = NULL;
+
+  rc = pthread_key_create(&g_output.key, output_thread_exit);
+  if(rc) goto err0;
+  rc = pthread_mutex_init(&g_output.mutex, NULL);
+  if(rc) goto err1;
+  rc = pthread_cond_init(&g_output.writer_cond, NULL);
+  if(rc) goto err2;
+  rc = pthread_cond_init(&g_output.done_cond, NULL);
+  if(rc) goto err3;
+  rc = pthread_create(&g_output.writer, NULL, output_writer, NULL);
+  if(rc) goto err4;
+  return 0;
+
+err4:
+  pthread_cond_destroy(&g_output.done_cond);
+err3:
+  pthread_cond_destroy(&g_output.writer_cond);
+err2:
+  pthread_mutex_destroy(&g_output.mutex);
+err1:
+  pthread_key_delete(g_output.key);
+err0:
+  return rc;
+}
+
+int output_destroy(void) {
+  struct output_thread *t;
+
+  // the calling thread's buffer would otherwise only be released at exit
+  t = pthread_getspecific(g_output.key);
+  if(t) {
+    pthread_setspecific(g_output.key, NULL);
+    output_thread_exit(t);
+  }
+
+  pthread_mutex_lock(&g_output.mutex);
+  output_sweep();
+  g_output.stop = 1;
+  pthread_cond_signal(&g_output.writer_cond);
+  pthread_mutex_unlock(&g_output.mutex);
+  pthread_join(g_output.writer, NULL);
+
+  pthread_key_delete(g_output.key);
+  pthread_cond_destroy(&g_output.done_cond);
+  pthread_cond_destroy(&g_output.writer_cond);
+  pthread_mutex_destroy(&g_output.mutex);
+  return g_output.error;
+}
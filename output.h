@@ -0,0 +1,72 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Buffered output shared by all threads
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+/**
+ * Hand each record to the writer as soon as it is complete, so that records
+ * from different threads come out in the order they were made.  Otherwise
+ * each thread fills a whole block before handing it over, and only the
+ * records of a single thread keep their order.  Either way a record is
+ * never split or interleaved with another.
+ */
+#define OUTPUT_ORDERED 0x1
+
+/**
+ * Start a writer thread for fd.  Output is collected in blocks of
+ * block_size bytes (0 for the default).
+ */
+int output_init(int fd, size_t block_size, int flags);
+
+/// format a record and queue it for writing
+int output_printf(const char *format, ...)
+  __attribute__((format(printf, 1, 2)));
+
+/// queue a record for writing
+int output_write(const void *buf, size_t len);
+
+/// write everything queued so far by all threads, and wait for it
+int output_flush(void);
+
+/**
+ * Write everything and stop the writer thread.  Returns 0, or the error
+ * number of the first failed write.
+ */
+int output_destroy(void);
+
+#endif
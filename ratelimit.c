@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ratelimit.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// how long a full bucket lasts at the configured rate
+#define BURST_SECONDS 0.1
+
+/// longest a caller sleeps before checking whether the rate was reloaded
+#define RELOAD_CHECK_SECONDS 1.0
+
+static struct ratelimit *g_signal_ratelimit;
+static int g_signal_signo;
+
+static uint64_t ratelimit_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// must be called with rl->mutex held
+static void ratelimit_refill_locked(struct ratelimit *rl) {
+  uint64_t now = ratelimit_now();
+  double added = (now - rl->last) * 1e-9 * rl->rate;
+
+  rl->tokens += added;
+  rl->paid += added;
+  if(rl->tokens > rl->burst) rl->tokens = rl->burst;
+  rl->last = now;
+}
+
+// must be called with rl->mutex held
+static void ratelimit_set_rate_locked(struct ratelimit *rl, double rate) {
+  // what was earned so far was earned at the old rate
+  ratelimit_refill_locked(rl);
+  rl->rate = rate > 0 ? rate : 0;
+  rl->burst = rl->rate * BURST_SECONDS;
+  if(rl->burst < 1) rl->burst = 1;
+  if(rl->tokens > rl->burst) rl->tokens = rl->burst;
+  // let the sleepers work out their wait again at the new rate
+  pthread_cond_broadcast(&rl->cond);
+}
+
+// must be called with rl->mutex held
+static int ratelimit_load_locked(struct ratelimit *rl) {
+  FILE *file;
+  double rate;
+  int rc;
+
+  rl->reload = 0;
+  file = fopen(rl->control_file, "r");
+  if(!file) return errno;
+  rc = fscanf(file, "%lf", &rate);
+  fclose(file);
+  if(rc != 1) return EINVAL;
+  ratelimit_set_rate_locked(rl, rate);
+  return 0;
+}
+
+int ratelimit_init(struct ratelimit *rl, double rate, const char *control_file) {
+  pthread_condattr_t attr;
+  int rc;
+
+  rc = pthread_mutex_init(&rl->mutex, NULL);
+  if(rc) return rc;
+  rc = pthread_condattr_init(&attr);
+  if(rc == 0) {
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if(rc == 0) rc = pthread_cond_init(&rl->cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  if(rc) {
+    pthread_mutex_destroy(&rl->mutex);
+    return rc;
+  }
+  rl->rate = 0;
+  rl->burst = 0;
+  rl->tokens = 0;
+  rl->paid = 0;
+  rl->last = ratelimit_now();
+  rl->control_file = control_file;
+  rl->reload = 0;
+  ratelimit_set_rate_locked(rl, rate);
+  rl->tokens = rl->burst;
+  if(control_file) {
+    rc = ratelimit_load_locked(rl);
+    if(rc) {
+      pthread_cond_destroy(&rl->cond);
+      pthread_mutex_destroy(&rl->mutex);
+      return rc;
+    }
+    rl->tokens = rl->burst;
+  }
+  return 0;
+}
+
+void ratelimit_set_rate(struct ratelimit *rl, double rate) {
+  pthread_mutex_lock(&rl->mutex);
+  ratelimit_set_rate_locked(rl, rate);
+  pthread_mutex_unlock(&rl->mutex);
+}
+
+int ratelimit_load(struct ratelimit *rl) {
+  int rc;
+
+  if(!rl->control_file) return EINVAL;
+  pthread_mutex_lock(&rl->mutex);
+  rc = ratelimit_load_locked(rl);
+  pthread_mutex_unlock(&rl->mutex);
+  return rc;
+}
+
+static void ratelimit_signal_handler(int signo) {
+  if(g_signal_ratelimit) g_signal_ratelimit->reload = 1;
+}
+
+int ratelimit_reload_on_signal(struct ratelimit *rl, int signo) {
+  struct sigaction sa;
+
+  g_signal_ratelimit = rl;
+  g_signal_signo = signo;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = ratelimit_signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if(sigaction(signo, &sa, NULL)) return errno;
+  return 0;
+}
+
+// must be called with rl->mutex held
+static void ratelimit_check_reload_locked(struct ratelimit *rl) {
+  int rc;
+
+  if(rl->reload) {
+    rc = ratelimit_load_locked(rl);
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", rl->control_file, strerror(rc));
+    }
+  }
+}
+
+void ratelimit_acquire(struct ratelimit *rl, unsigned n) {
+  uint64_t deadline;
+  double ticket, wait;
+  struct timespec ts;
+
+  pthread_mutex_lock(&rl->mutex);
+  ratelimit_check_reload_locked(rl);
+  if(rl->rate == 0) {
+    pthread_mutex_unlock(&rl->mutex);
+    return;
+  }
+
+  // take the tokens now, going into debt if needed, and then sleep until
+  // the debt up to this caller has been paid off; this keeps callers in
+  // FIFO order, and the ticket stays right if the rate changes meanwhile
+  ratelimit_refill_locked(rl);
+  rl->tokens -= n;
+  ticket = rl->paid - (rl->tokens < 0 ? rl->tokens : 0);
+  while(rl->rate > 0 && rl->paid < ticket) {
+    // wake now and then, as the reload signal cannot wake anyone
+    wait = (ticket - rl->paid) / rl->rate;
+    if(wait > RELOAD_CHECK_SECONDS) wait = RELOAD_CHECK_SECONDS;
+    deadline = ratelimit_now() + (uint64_t) (wait * 1e9);
+    ts.tv_sec = deadline / 1000000000u;
+    ts.tv_nsec = deadline % 1000000000u;
+    pthread_cond_timedwait(&rl->cond, &rl->mutex, &ts);
+    ratelimit_check_reload_locked(rl);
+    ratelimit_refill_locked(rl);
+  }
+  pthread_mutex_unlock(&rl->mutex);
+}
+
+void ratelimit_destroy(struct ratelimit *rl) {
+  if(g_signal_ratelimit == rl) {
+    signal(g_signal_signo, SIG_DFL);
+    g_signal_ratelimit = NULL;
+  }
+  pthread_cond_destroy(&rl->cond);
+  pthread_mutex_destroy(&rl->mutex);
+}
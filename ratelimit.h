@@ -0,0 +1,97 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Token bucket rate limiter
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+
+struct ratelimit {
+  /// mutex
+  pthread_mutex_t mutex;
+
+  /// signaled when the rate changes, for callers sleeping off debt
+  pthread_cond_t cond;
+
+  /// tokens added per second, 0 for unlimited
+  double rate;
+
+  /// maximum number of tokens that can accumulate
+  double burst;
+
+  /// tokens available, negative when callers are waiting
+  double tokens;
+
+  /// all the tokens added since init, against which waiting callers'
+  /// debts are measured
+  double paid;
+
+  /// time of the last refill in nanoseconds
+  uint64_t last;
+
+  /// file to read the rate from, or NULL
+  const char *control_file;
+
+  /// non-zero when the control file should be re-read
+  volatile sig_atomic_t reload;
+};
+
+/**
+ * Initialize a rate limiter.  If control_file is not NULL, the rate is read
+ * from it instead of using the rate parameter.
+ */
+int ratelimit_init(struct ratelimit *rl, double rate, const char *control_file);
+
+/// change the rate; 0 means unlimited
+void ratelimit_set_rate(struct ratelimit *rl, double rate);
+
+/// re-read the rate from the control file
+int ratelimit_load(struct ratelimit *rl);
+
+/**
+ * Re-read the control file of rl whenever signo is received.  Only one rate
+ * limiter per process can be registered this way.
+ */
+int ratelimit_reload_on_signal(struct ratelimit *rl, int signo);
+
+/// take n tokens, sleeping until they are available
+void ratelimit_acquire(struct ratelimit *rl, unsigned n);
+
+/// destroy a rate limiter
+void ratelimit_destroy(struct ratelimit *rl);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "seeds.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct seeds * seeds_new(void) {
+  struct seeds *root = malloc(sizeof(struct seeds));
+  if(!root) return NULL;
+  root->name = NULL;
+  root->whole = 0;
+  root->children = NULL;
+  root->count = 0;
+  root->size = 0;
+  return root;
+}
+
+static void seeds_free_children(struct seeds *node) {
+  size_t i;
+
+  for(i = 0; i < node->count; ++i) {
+    seeds_free(node->children[i]);
+  }
+  free(node->children);
+  node->children = NULL;
+  node->count = 0;
+  node->size = 0;
+}
+
+void seeds_free(struct seeds *root) {
+  seeds_free_children(root);
+  free(root->name);
+  free(root);
+}
+
+// binary search for name; returns the index it is at or should be inserted at
+static size_t seeds_find(const struct seeds *node, const char *name, size_t len, int *found) {
+  size_t lo = 0, hi = node->count, mid;
+  int rc;
+
+  *found = 0;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    rc = strncmp(node->children[mid]->name, name, len);
+    if(rc == 0) rc = node->children[mid]->name[len] ? 1 : 0;
+    if(rc == 0) {
+      *found = 1;
+      return mid;
+    }
+    if(rc < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int seeds_add(struct seeds *root, const char *path) {
+  struct seeds *node = root, *child, **children;
+  const char *p = path;
+  size_t len, i;
+  int found;
+
+  while(1) {
+    if(node->whole) return 0;
+
+    // skip separators and "." components
+    while(*p == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0'))) ++p;
+    if(*p == '\0') break;
+    len = strcspn(p, "/");
+
+    i = seeds_find(node, p, len, &found);
+    if(found) {
+      node = node->children[i];
+    } else {
+      if(node->count == node->size) {
+        node->size = node->size ? node->size << 1 : 4;
+        children = realloc(node->children, sizeof(struct seeds *) * node->size);
+        if(!children) return ENOMEM;
+        node->children = children;
+      }
+      child = seeds_new();
+      if(!child) return ENOMEM;
+      child->name = strndup(p, len);
+      if(!child->name) {
+        free(child);
+        return ENOMEM;
+      }
+      memmove(&node->children[i+1], &node->children[i], sizeof(struct seeds *) * (node->count - i));
+      node->children[i] = child;
+      ++node->count;
+      node = child;
+    }
+    p += len;
+  }
+
+  // everything below is included, so the children are not needed
+  node->whole = 1;
+  seeds_free_children(node);
+  return 0;
+}
+
+struct seeds * seeds_load(const char *file) {
+  struct seeds *root;
+  FILE *f;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int rc = 0;
+
+  f = fopen(file, "r");
+  if(!f) return NULL;
+  root = seeds_new();
+  if(!root) {
+    fclose(f);
+    return NULL;
+  }
+  while((len = getline(&line, &size, f)) != -1) {
+    if(len && line[len-1] == '\n') line[--len] = '\0';
+    if(len == 0 || line[0] == '#') continue;
+    rc = seeds_add(root, line);
+    if(rc) break;
+  }
+  if(!rc && ferror(f)) rc = errno;
+  free(line);
+  fclose(f);
+  if(rc) {
+    seeds_free(root);
+    errno = rc;
+    return NULL;
+  }
+  return root;
+}
+
+const struct seeds * seeds_child(const struct seeds *node, const char *name) {
+  size_t i;
+  int found;
+
+  i = seeds_find(node, name, strlen(name), &found);
+  return found ? node->children[i] : NULL;
+}
+
+const struct seeds * seeds_lookup(const struct seeds *root, const char *path) {
+  const struct seeds *node = root;
+  const char *p = path;
+  size_t len, i;
+  int found;
+
+  while(1) {
+    if(node->whole) return node;
+    while(*p == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0'))) ++p;
+    if(*p == '\0') return node;
+    len = strcspn(p, "/");
+    i = seeds_find(node, p, len, &found);
+    if(!found) return NULL;
+    node = node->children[i];
+    p += len;
+  }
+}
+
+int seeds_covers(const struct seeds *root, const char *path) {
+  const struct seeds *node = seeds_lookup(root, path);
+  return node && node->whole;
+}
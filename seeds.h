@@ -0,0 +1,89 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Set of subtrees to limit a traversal to
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEEDS_H
+#define SEEDS_H
+
+#include <stddef.h>
+
+/**
+ * A node in a tree of path components.  The root node represents the root
+ * of the traversal.
+ */
+struct seeds {
+  /// path component, NULL for the root
+  char *name;
+
+  /// non-zero if everything below this node is included
+  int whole;
+
+  /// child nodes, sorted by name
+  struct seeds **children;
+  size_t count;
+  size_t size;
+};
+
+/// create an empty set of seeds
+struct seeds * seeds_new(void);
+
+/**
+ * Read seeds from a file with one path per line, relative to the root of
+ * the traversal.  Empty lines and lines starting with '#' are ignored.
+ */
+struct seeds * seeds_load(const char *file);
+
+/// include path and everything below it
+int seeds_add(struct seeds *root, const char *path);
+
+/// find the child of node named name, or NULL
+const struct seeds * seeds_child(const struct seeds *node, const char *name);
+
+/**
+ * Find the node for path (relative to the root), or the node of the first
+ * parent of path that is included whole.  Returns NULL if path is not
+ * seeded.
+ */
+const struct seeds * seeds_lookup(const struct seeds *root, const char *path);
+
+/**
+ * Check if path (relative to the root, "." for the root itself) is
+ * traversed completely, as opposed to only the seeded paths below it.
+ */
+int seeds_covers(const struct seeds *root, const char *path);
+
+/// free a set of seeds
+void seeds_free(struct seeds *root);
+
+#endif
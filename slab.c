@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "slab.h"
+#include "memacct.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// returns SLAB_CLASSES if size is too large for any class
+static inline unsigned slab_class(size_t size) {
+  unsigned c = 0;
+  size = (size - 1) >> SLAB_MIN_SHIFT;
+  while(size && c < SLAB_CLASSES) {
+    size >>= 1;
+    ++c;
+  }
+  return c;
+}
+
+// must be called with s->mutex held; moves up to n objects from *from to *to
+static void slab_move(
+  struct slab_object **from,
+  size_t *from_count,
+  struct slab_object **to,
+  size_t *to_count,
+  size_t n
+) {
+  struct slab_object *o;
+
+  while(n-- && *from) {
+    o = *from;
+    *from = o->next;
+    --*from_count;
+    o->next = *to;
+    *to = o;
+    ++*to_count;
+  }
+}
+
+static void slab_cache_release(void *arg) {
+  struct slab_cache *cache = arg;
+  struct slab *s = cache->slab;
+  unsigned c;
+
+  pthread_mutex_lock(&s->mutex);
+  for(c = 0; c < SLAB_CLASSES; ++c) {
+    slab_move(&cache->free[c], &cache->count[c], &s->free[c], &s->count[c], (size_t) -1);
+  }
+  pthread_mutex_unlock(&s->mutex);
+  memacct_add(s->category, -(ssize_t) sizeof(struct slab_cache));
+  free(cache);
+}
+
+static struct slab_cache * slab_cache(struct slab *s) {
+  struct slab_cache *cache = pthread_getspecific(s->key);
+  unsigned c;
+
+  if(cache) return cache;
+  cache = malloc(sizeof(struct slab_cache));
+  if(!cache) return NULL;
+  memacct_add(s->category, sizeof(struct slab_cache));
+  cache->slab = s;
+  for(c = 0; c < SLAB_CLASSES; ++c) {
+    cache->free[c] = NULL;
+    cache->count[c] = 0;
+  }
+  pthread_setspecific(s->key, cache);
+  return cache;
+}
+
+// must be called with s->mutex held
+static int slab_carve(struct slab *s, struct slab_cache *cache, unsigned c) {
+  struct slab_chunk *chunks;
+  struct slab_object *o;
+  size_t size = (size_t) 1 << (SLAB_MIN_SHIFT + c);
+  char *mem, *p;
+
+  if(s->chunks_count == s->chunks_size) {
+    size_t n = s->chunks_size ? s->chunks_size << 1 : 16;
+    chunks = realloc(s->chunks, sizeof(struct slab_chunk) * n);
+    if(!chunks) return -1;
+    memacct_add(s->category, sizeof(struct slab_chunk) * (n - s->chunks_size));
+    s->chunks = chunks;
+    s->chunks_size = n;
+  }
+  mem = malloc(SLAB_CHUNK_SIZE);
+  if(!mem) return -1;
+  memacct_add(s->category, SLAB_CHUNK_SIZE);
+  s->chunks[s->chunks_count].mem = mem;
+  s->chunks[s->chunks_count].size_class = c;
+  ++s->chunks_count;
+  for(p = mem; p + size <= mem + SLAB_CHUNK_SIZE; p += size) {
+    if(s->init) (*s->init)(p);
+    o = (struct slab_object *) p;
+    o->next = cache->free[c];
+    cache->free[c] = o;
+    ++cache->count[c];
+  }
+  return 0;
+}
+
+int slab_init(struct slab *s, void (*init)(void *), void (*fini)(void *), int category) {
+  unsigned c;
+  int rc;
+
+  rc = pthread_mutex_init(&s->mutex, NULL);
+  if(rc) return rc;
+  rc = pthread_key_create(&s->key, slab_cache_release);
+  if(rc) {
+    pthread_mutex_destroy(&s->mutex);
+    return rc;
+  }
+  s->init = init;
+  s->fini = fini;
+  s->category = category;
+  for(c = 0; c < SLAB_CLASSES; ++c) {
+    s->free[c] = NULL;
+    s->count[c] = 0;
+  }
+  s->chunks = NULL;
+  s->chunks_count = 0;
+  s->chunks_size = 0;
+  return 0;
+}
+
+void * slab_alloc(struct slab *s, size_t size) {
+  struct slab_cache *cache;
+  struct slab_object *o;
+  unsigned c = slab_class(size);
+  int rc = 0;
+
+  if(c == SLAB_CLASSES) return malloc(size);
+  cache = slab_cache(s);
+  if(!cache) return NULL;
+  if(!cache->free[c]) {
+    pthread_mutex_lock(&s->mutex);
+    if(s->free[c]) {
+      slab_move(&s->free[c], &s->count[c], &cache->free[c], &cache->count[c], SLAB_BATCH);
+    } else {
+      rc = slab_carve(s, cache, c);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    if(rc) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  o = cache->free[c];
+  cache->free[c] = o->next;
+  --cache->count[c];
+  return o;
+}
+
+void slab_free(struct slab *s, void *p, size_t size) {
+  struct slab_cache *cache;
+  struct slab_object *o = p;
+  unsigned c = slab_class(size);
+
+  if(c == SLAB_CLASSES) {
+    free(p);
+    return;
+  }
+  cache = slab_cache(s);
+  if(!cache) {
+    // no cache to keep it in, so give it straight back
+    pthread_mutex_lock(&s->mutex);
+    o->next = s->free[c];
+    s->free[c] = o;
+    ++s->count[c];
+    pthread_mutex_unlock(&s->mutex);
+    return;
+  }
+  o->next = cache->free[c];
+  cache->free[c] = o;
+  if(++cache->count[c] >= 2 * SLAB_BATCH) {
+    // this thread frees more than it allocates; share the surplus
+    pthread_mutex_lock(&s->mutex);
+    slab_move(&cache->free[c], &cache->count[c], &s->free[c], &s->count[c], SLAB_BATCH);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+void slab_flush(struct slab *s) {
+  struct slab_cache *cache = pthread_getspecific(s->key);
+
+  if(!cache) return;
+  pthread_setspecific(s->key, NULL);
+  slab_cache_release(cache);
+}
+
+void slab_destroy(struct slab *s) {
+  size_t i;
+  char *p, *mem;
+  size_t size;
+
+  slab_flush(s);
+  pthread_key_delete(s->key);
+  for(i = 0; i < s->chunks_count; ++i) {
+    mem = s->chunks[i].mem;
+    if(s->fini) {
+      size = (size_t) 1 << (SLAB_MIN_SHIFT + s->chunks[i].size_class);
+      for(p = mem; p + size <= mem + SLAB_CHUNK_SIZE; p += size) {
+        (*s->fini)(p);
+      }
+    }
+    free(mem);
+  }
+  memacct_add(s->category, -(ssize_t) ((SLAB_CHUNK_SIZE * s->chunks_count) + sizeof(struct slab_chunk) * s->chunks_size));
+  free(s->chunks);
+  pthread_mutex_destroy(&s->mutex);
+}
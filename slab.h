@@ -0,0 +1,132 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Slab allocator with per-thread caches
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/// the smallest size class is 2^SLAB_MIN_SHIFT bytes
+#define SLAB_MIN_SHIFT 8
+
+/// number of size classes, each twice the size of the one before
+#define SLAB_CLASSES 6
+
+/// bytes carved into objects of one size class at a time
+#define SLAB_CHUNK_SIZE (64<<10)
+
+/// objects moved between a thread's cache and the shared lists at a time
+#define SLAB_BATCH 32
+
+/// a free object; the link overwrites its first pointer-sized bytes
+struct slab_object {
+  struct slab_object *next;
+};
+
+/// memory carved into objects of one size class
+struct slab_chunk {
+  void *mem;
+  unsigned size_class;
+};
+
+/// the free objects kept by one thread
+struct slab_cache {
+  struct slab *slab;
+  struct slab_object *free[SLAB_CLASSES];
+  size_t count[SLAB_CLASSES];
+};
+
+struct slab {
+  /// mutex, protects the shared lists and the chunks
+  pthread_mutex_t mutex;
+
+  /// each thread's struct slab_cache
+  pthread_key_t key;
+
+  /// called on each object when it is carved and when its chunk is freed
+  void (*init)(void *);
+  void (*fini)(void *);
+
+  /// memacct category of the chunks and caches
+  int category;
+
+  /// free objects given back by threads
+  struct slab_object *free[SLAB_CLASSES];
+  size_t count[SLAB_CLASSES];
+
+  struct slab_chunk *chunks;
+  size_t chunks_count;
+  size_t chunks_size;
+};
+
+/**
+ * Initialize a slab allocator.  Objects up to
+ * 2^(SLAB_MIN_SHIFT + SLAB_CLASSES - 1) bytes are carved from chunks and
+ * recycled through a cache in each thread, so that allocating and freeing
+ * them rarely takes a lock and never calls malloc() once the caches are
+ * warm.  Objects freed by one thread and allocated by another travel through
+ * the shared lists SLAB_BATCH at a time.  Larger objects are left to
+ * malloc().
+ *
+ * init, if not NULL, is called on each object once when its chunk is
+ * carved, and fini when the chunk is freed, so that an object can keep a
+ * mutex or similar across reuse.  Neither may touch the first pointer-sized
+ * bytes of the object, which hold a link while it is free.
+ *
+ * @return 0 if successful, or an error number
+ */
+int slab_init(struct slab *s, void (*init)(void *), void (*fini)(void *), int category);
+
+/// allocate an object of size bytes, or return NULL and set errno
+void * slab_alloc(struct slab *s, size_t size);
+
+/// free an object allocated with the same size
+void slab_free(struct slab *s, void *p, size_t size);
+
+/**
+ * Give the calling thread's cache back to the shared lists.  This happens
+ * by itself when a thread exits, and must be done by hand by a thread that
+ * outlives the allocator.
+ */
+void slab_flush(struct slab *s);
+
+/**
+ * Destroy a slab allocator once every object has been freed and every
+ * other thread that used it has exited or called slab_flush().
+ */
+void slab_destroy(struct slab *s);
+
+#endif
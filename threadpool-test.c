@@ -0,0 +1,368 @@
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NTHREADS 4
+#define FANOUT 4
+#define DEPTH 4
+#define NRELEASES 1000
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++g_failures; \
+  } \
+} while(0)
+
+static struct threadpool g_tp;
+
+/// set by the last continuation of a test, which main() waits for
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static int g_done;
+
+static void done(void) {
+  pthread_mutex_lock(&g_mutex);
+  g_done = 1;
+  pthread_cond_signal(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void wait_done(void) {
+  pthread_mutex_lock(&g_mutex);
+  while(!g_done) pthread_cond_wait(&g_cond, &g_mutex);
+  g_done = 0;
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void set_node(struct threadpool_node *node, void (*routine)(void *), void *arg) {
+  node->routine = routine;
+  node->arg = arg;
+  node->key = 0;
+  node->cls = 0;
+  node->group = NULL;
+}
+
+/*
+ * A tree of tasks, each inner one running its children in a group nested in
+ * the group it runs in.  The continuation of each group checks that all of
+ * its children, and the continuations of their groups, have finished.
+ */
+struct tree {
+  struct threadpool_node node;
+  struct threadpool_group group;
+  struct threadpool_node continuation;
+  struct threadpool_group *member_of;
+  struct tree *parent;
+  struct tree *children;
+  size_t children_done;
+  int depth;
+};
+
+static size_t g_leaves, g_continuations;
+
+static void tree_child_done(struct tree *t) {
+  if(t->parent) __atomic_add_fetch(&t->parent->children_done, 1, __ATOMIC_RELAXED);
+}
+
+static void tree_continuation(void *arg) {
+  struct tree *t = arg;
+
+  CHECK(__atomic_load_n(&t->children_done, __ATOMIC_RELAXED) == FANOUT);
+  __atomic_add_fetch(&g_continuations, 1, __ATOMIC_RELAXED);
+  free(t->children);
+  tree_child_done(t);
+}
+
+static void tree_task(void *arg) {
+  struct tree *t = arg;
+  struct threadpool_node *list = NULL;
+  int i;
+
+  if(t->depth == DEPTH) {
+    __atomic_add_fetch(&g_leaves, 1, __ATOMIC_RELAXED);
+    tree_child_done(t);
+    return;
+  }
+  t->children = calloc(FANOUT, sizeof(struct tree));
+  threadpool_group_init(&t->group, t->member_of);
+  for(i = FANOUT - 1; i >= 0; --i) {
+    struct tree *c = &t->children[i];
+    set_node(&c->node, tree_task, c);
+    c->member_of = &t->group;
+    c->parent = t;
+    c->depth = t->depth + 1;
+    c->node.next = list;
+    list = &c->node;
+  }
+  set_node(&t->continuation, tree_continuation, t);
+  threadpool_group_continue(&t->group, &t->continuation);
+  CHECK(threadpool_group_add(&g_tp, &t->group, list) == 0);
+  threadpool_group_finish(&g_tp, &t->group);
+}
+
+static void tree_root_done(void *arg) {
+  size_t inner = 0, n = 1;
+  int d;
+
+  for(d = 0; d < DEPTH; ++d) {
+    inner += n;
+    n *= FANOUT;
+  }
+  CHECK(__atomic_load_n(&g_leaves, __ATOMIC_RELAXED) == n);
+  CHECK(__atomic_load_n(&g_continuations, __ATOMIC_RELAXED) == inner);
+  done();
+}
+
+static void test_nested_groups(void) {
+  struct threadpool_group root;
+  struct threadpool_node root_done;
+  struct tree t = {{0}};
+
+  g_leaves = g_continuations = 0;
+  threadpool_group_init(&root, NULL);
+  set_node(&root_done, tree_root_done, NULL);
+  threadpool_group_continue(&root, &root_done);
+  set_node(&t.node, tree_task, &t);
+  t.node.next = NULL;
+  t.member_of = &root;
+  CHECK(threadpool_group_add(&g_tp, &root, &t.node) == 0);
+  threadpool_group_finish(&g_tp, &root);
+  wait_done();
+}
+
+/*
+ * Holds dropped from other tasks count as members too, and the
+ * continuation runs once, after the last of them.
+ */
+static struct threadpool_group g_held;
+static size_t g_released, g_held_runs;
+
+static void release_task(void *arg) {
+  __atomic_add_fetch(&g_released, 1, __ATOMIC_RELAXED);
+  threadpool_group_release(&g_tp, &g_held);
+}
+
+static void held_done(void *arg) {
+  CHECK(__atomic_load_n(&g_released, __ATOMIC_RELAXED) == NRELEASES);
+  CHECK(__atomic_add_fetch(&g_held_runs, 1, __ATOMIC_RELAXED) == 1);
+  done();
+}
+
+static void test_holds(void) {
+  struct threadpool_node continuation;
+  size_t i;
+
+  g_released = g_held_runs = 0;
+  threadpool_group_init(&g_held, NULL);
+  threadpool_group_hold(&g_held, NRELEASES);
+  set_node(&continuation, held_done, NULL);
+  threadpool_group_continue(&g_held, &continuation);
+  for(i = 0; i < NRELEASES; ++i) {
+    CHECK(threadpool_add_key(&g_tp, release_task, NULL, 0) == 0);
+  }
+  threadpool_group_finish(&g_tp, &g_held);
+  wait_done();
+  CHECK(g_held_runs == 1);
+}
+
+/*
+ * With nothing else holding the group, finishing it runs the continuation
+ * in the calling thread before returning.
+ */
+static pthread_t g_ran_on;
+
+static void record_thread(void *arg) {
+  g_ran_on = pthread_self();
+  *(int *) arg = 1;
+}
+
+static void test_finish_inline(void) {
+  struct threadpool_group g;
+  struct threadpool_node continuation;
+  int ran = 0;
+
+  threadpool_group_init(&g, NULL);
+  set_node(&continuation, record_thread, &ran);
+  threadpool_group_continue(&g, &continuation);
+  threadpool_group_finish(&g_tp, &g);
+  CHECK(ran);
+  CHECK(pthread_equal(g_ran_on, pthread_self()));
+}
+
+/*
+ * Each class of worker runs only its own tasks, so a class whose threads
+ * are all blocked does not hold up another.
+ */
+#define CLASS_TASKS 200
+
+static pthread_t g_class_threads[2][8];
+static size_t g_class_counts[2];
+static pthread_mutex_t g_class_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_class_cond = PTHREAD_COND_INITIALIZER;
+static size_t g_class_blocked;
+static int g_class_release;
+static size_t g_class_ran[2];
+
+static void class_record(unsigned cls) {
+  pthread_t self = pthread_self();
+  size_t i;
+
+  pthread_mutex_lock(&g_class_mutex);
+  for(i = 0; i < g_class_counts[cls]; ++i) {
+    if(pthread_equal(g_class_threads[cls][i], self)) break;
+  }
+  if(i == g_class_counts[cls] && i < 8) g_class_threads[cls][g_class_counts[cls]++] = self;
+  ++g_class_ran[cls];
+  pthread_cond_broadcast(&g_class_cond);
+  pthread_mutex_unlock(&g_class_mutex);
+}
+
+static void class0_task(void *arg) {
+  class_record(0);
+}
+
+static void class1_task(void *arg) {
+  class_record(1);
+  pthread_mutex_lock(&g_class_mutex);
+  ++g_class_blocked;
+  pthread_cond_broadcast(&g_class_cond);
+  while(!g_class_release) pthread_cond_wait(&g_class_cond, &g_class_mutex);
+  pthread_mutex_unlock(&g_class_mutex);
+}
+
+static void classes_done(void *arg) {
+  done();
+}
+
+static void test_classes(void) {
+  static struct threadpool_node nodes[2][CLASS_TASKS];
+  const size_t nthreads[] = { 2, 3 };
+  struct threadpool tp;
+  struct threadpool_group g;
+  struct threadpool_node continuation, *list = NULL;
+  size_t i, j;
+  unsigned c;
+
+  CHECK(threadpool_init_classes(&tp, nthreads, 2, 0, 0, 4) == 0);
+  threadpool_group_init(&g, NULL);
+  for(c = 0; c < 2; ++c) {
+    for(i = 0; i < CLASS_TASKS; ++i) {
+      set_node(&nodes[c][i], c ? class1_task : class0_task, NULL);
+      nodes[c][i].cls = c;
+      nodes[c][i].key = i % 4;
+      nodes[c][i].next = list;
+      list = &nodes[c][i];
+    }
+  }
+  set_node(&continuation, classes_done, NULL);
+  threadpool_group_continue(&g, &continuation);
+  CHECK(threadpool_group_add(&tp, &g, list) == 0);
+
+  // every class 1 thread is stuck, yet class 0 runs all of its tasks
+  pthread_mutex_lock(&g_class_mutex);
+  while(g_class_blocked < nthreads[1] || g_class_ran[0] < CLASS_TASKS) {
+    pthread_cond_wait(&g_class_cond, &g_class_mutex);
+  }
+  CHECK(g_class_ran[1] == nthreads[1]);
+  g_class_release = 1;
+  pthread_cond_broadcast(&g_class_cond);
+  pthread_mutex_unlock(&g_class_mutex);
+
+  threadpool_group_finish(&tp, &g);
+  wait_done();
+  CHECK(g_class_ran[0] == CLASS_TASKS);
+  CHECK(g_class_ran[1] == CLASS_TASKS);
+  CHECK(g_class_counts[0] <= nthreads[0]);
+  CHECK(g_class_counts[1] <= nthreads[1]);
+  for(i = 0; i < g_class_counts[0]; ++i) {
+    for(j = 0; j < g_class_counts[1]; ++j) {
+      CHECK(!pthread_equal(g_class_threads[0][i], g_class_threads[1][j]));
+    }
+  }
+  threadpool_destroy(&tp);
+}
+
+/*
+ * Tasks added one at a time while a thread is spinning wake a sleeping
+ * thread for each task the spinner cannot take, so they run at once.
+ */
+#define WAKE_TASKS 4
+
+static pthread_mutex_t g_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wake_cond = PTHREAD_COND_INITIALIZER;
+static size_t g_wake_started, g_wake_together, g_wake_finished;
+
+static void wake_task(void *arg) {
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 1;
+  pthread_mutex_lock(&g_wake_mutex);
+  ++g_wake_started;
+  pthread_cond_broadcast(&g_wake_cond);
+  while(g_wake_started < WAKE_TASKS) {
+    if(pthread_cond_timedwait(&g_wake_cond, &g_wake_mutex, &deadline)) break;
+  }
+  if(g_wake_started == WAKE_TASKS) ++g_wake_together;
+  ++g_wake_finished;
+  pthread_cond_broadcast(&g_wake_cond);
+  pthread_mutex_unlock(&g_wake_mutex);
+}
+
+static void noop_task(void *arg) {
+}
+
+static void test_spin_wakeups(void) {
+  struct threadpool tp;
+  size_t i, spinning = 0, idle = 0;
+
+  CHECK(threadpool_init_buckets(&tp, WAKE_TASKS, 0, 0, 1) == 0);
+  // one spinner, however many CPUs there are, spinning long enough that
+  // every task is added while it still spins
+  threadpool_set_spin(&tp, 1 << 24);
+  pthread_mutex_lock(&tp.mutex);
+  tp.max_spinning = 1;
+  pthread_mutex_unlock(&tp.mutex);
+  // the thread that runs this spins once it is done, and the rest sleep
+  CHECK(threadpool_add(&tp, noop_task, NULL) == 0);
+  while(spinning != 1 || idle != WAKE_TASKS - 1) {
+    usleep(100);
+    pthread_mutex_lock(&tp.mutex);
+    spinning = tp.classes[0].spinning;
+    idle = tp.classes[0].idle;
+    pthread_mutex_unlock(&tp.mutex);
+  }
+  threadpool_set_spin(&tp, 0);
+
+  for(i = 0; i < WAKE_TASKS; ++i) {
+    CHECK(threadpool_add(&tp, wake_task, NULL) == 0);
+  }
+  pthread_mutex_lock(&g_wake_mutex);
+  while(g_wake_finished < WAKE_TASKS) pthread_cond_wait(&g_wake_cond, &g_wake_mutex);
+  pthread_mutex_unlock(&g_wake_mutex);
+  CHECK(g_wake_together == WAKE_TASKS);
+  threadpool_destroy(&tp);
+}
+
+int main(int argc, char **argv) {
+  CHECK(threadpool_init_buckets(&g_tp, NTHREADS, 0, 0, 1) == 0);
+  test_nested_groups();
+  test_holds();
+  test_finish_inline();
+  threadpool_destroy(&g_tp);
+  test_classes();
+  test_spin_wakeups();
+
+  if(g_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], g_failures);
+    return 1;
+  }
+  printf("%s: ok\n", argv[0]);
+  return 0;
+}
@@ -29,27 +29,119 @@
  */
 
 #include "threadpool.h"
+#include "memacct.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * A class's qcount is read without the lock by spinning threads, so it is
+ * written atomically, though always with tp->mutex held.
+ */
+static inline void threadpool_qcount_set(struct threadpool_class *cls, size_t qcount) {
+  __atomic_store_n(&cls->qcount, qcount, __ATOMIC_RELAXED);
+}
+
+// must be called with tp->mutex held after a task is queued for cls
+static inline void threadpool_queued(struct threadpool *tp, struct threadpool_class *cls) {
+  threadpool_qcount_set(cls, cls->qcount + 1);
+  ++tp->qcount;
+}
+
+// tell the CPU that this is a spin loop
+static inline void threadpool_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// must be called with tp->mutex held
+static void threadpool_bucket_push(struct threadpool_class *cls, struct threadpool_node *node) {
+  struct threadpool_bucket *b = &cls->buckets[node->key];
+
+  node->next = NULL;
+  if(b->head) {
+    b->tail->next = node;
+  } else {
+    b->head = node;
+    cls->bucket_bits[node->key >> 6] |= (uint64_t) 1 << (node->key & 63);
+    cls->bucket_summary |= (uint64_t) 1 << (node->key >> 6);
+  }
+  b->tail = node;
+}
+
+// must be called with tp->mutex held and at least one task queued for cls
+static struct threadpool_node * threadpool_bucket_pop(struct threadpool_class *cls) {
+  struct threadpool_node *node;
+  struct threadpool_bucket *b;
+  unsigned word, key;
+
+  word = 63 - __builtin_clzll(cls->bucket_summary);
+  key = (word << 6) | (63 - __builtin_clzll(cls->bucket_bits[word]));
+  b = &cls->buckets[key];
+  node = b->head;
+  b->head = node->next;
+  if(!b->head) {
+    cls->bucket_bits[word] &= ~((uint64_t) 1 << (key & 63));
+    if(!cls->bucket_bits[word]) cls->bucket_summary &= ~((uint64_t) 1 << word);
+  }
+  return node;
+}
 
 static void * threadpool_consumer(void *arg) {
-  struct threadpool *tp = arg;
+  struct threadpool_class *cls = arg;
+  struct threadpool *tp = cls->tp;
   struct threadpool_task task;
+  struct threadpool_group *group;
 
   pthread_mutex_lock(&tp->mutex);
   while(1) {
+    int spun = 0;
     // wait for a task to arrive in the queue
-    while(tp->qcount == 0) {
+    while(cls->qcount == 0) {
       if(tp->stop) {
         pthread_mutex_unlock(&tp->mutex);
         return NULL;
       }
-      pthread_cond_wait(&tp->consumer, &tp->mutex);
+      if(!spun && tp->spin && tp->spinning < tp->max_spinning) {
+        // tasks often come in quick succession, so watch the queue for a
+        // while before paying for a sleep and a wakeup
+        size_t i, spin = tp->spin;
+        spun = 1;
+        ++tp->spinning;
+        ++cls->spinning;
+        pthread_mutex_unlock(&tp->mutex);
+        for(i = 0; i < spin && __atomic_load_n(&cls->qcount, __ATOMIC_RELAXED) == 0; ++i) {
+          threadpool_relax();
+        }
+        pthread_mutex_lock(&tp->mutex);
+        --cls->spinning;
+        --tp->spinning;
+        continue;
+      }
+      ++cls->idle;
+      pthread_cond_wait(&cls->consumer, &tp->mutex);
+      --cls->idle;
+      if(cls->signalled) --cls->signalled;
     }
+    threadpool_qcount_set(cls, cls->qcount - 1);
     if(tp->qcount-- == tp->qmax)
       pthread_cond_signal(&tp->producer);
-    if(tp->priority_cmp) {
+    group = NULL;
+    if(tp->nbuckets) {
+      struct threadpool_node *node = threadpool_bucket_pop(cls);
+      task.routine = node->routine;
+      task.arg = node->arg;
+      // the routine may free the node
+      group = node->group;
+      if(node->pooled) {
+        memacct_add(MEMACCT_QUEUE, -(ssize_t) sizeof(struct threadpool_node));
+        free(node);
+      }
+    } else if(tp->priority_cmp) {
       size_t c, p, l, r;
       task = tp->q[0];
       c = tp->qcount;
@@ -83,40 +175,40 @@ static void * threadpool_consumer(void *arg) {
     ++tp->running;
     pthread_mutex_unlock(&tp->mutex);
     (*task.routine)(task.arg);
+    if(group) threadpool_group_release(tp, group);
     pthread_mutex_lock(&tp->mutex);
     --tp->running;
   }
 }
 
-int threadpool_add(struct threadpool *tp, void (*routine)(void *), void *arg) {
-  int rc, ret = 0;
+// must be called with tp->mutex held and room in the queue
+static int threadpool_push(struct threadpool *tp, void (*routine)(void *), void *arg, unsigned key) {
+  int rc;
   struct threadpool_task *task;
 
-  rc = pthread_mutex_lock(&tp->mutex);
-  if(rc) return rc;
-  if(tp->stop) {
-    ret = EINVAL;
-    goto out;
-  }
-  if(tp->qmax) {
-    while(tp->qcount == tp->qmax) {
-      pthread_cond_wait(&tp->producer, &tp->mutex);
-    }
-  }
-  if(tp->priority_cmp) {
+  if(tp->nbuckets) {
+    struct threadpool_node *node;
+    assert(key < tp->nbuckets);
+    node = malloc(sizeof(struct threadpool_node));
+    if(node == NULL) return errno;
+    memacct_add(MEMACCT_QUEUE, sizeof(struct threadpool_node));
+    node->routine = routine;
+    node->arg = arg;
+    node->key = key;
+    node->cls = 0;
+    node->pooled = 1;
+    node->group = NULL;
+    threadpool_bucket_push(&tp->classes[0], node);
+    goto queued;
+  } else if(tp->priority_cmp) {
     size_t c, p;
     struct threadpool_task t;
     if(tp->qcount == tp->qsize) {
-      if(tp->qsize == ~(((size_t)-1) >> 1)) {
-        ret = ENOMEM;
-        goto out;
-      }
+      if(tp->qsize == ~(((size_t)-1) >> 1)) return ENOMEM;
       task = realloc(tp->q, sizeof(struct threadpool_task) * (tp->qsize << 1));
-      if(task == NULL) {
-        ret = errno;
-        goto out;
-      }
+      if(task == NULL) return errno;
       tp->q = task;
+      memacct_add(MEMACCT_QUEUE, sizeof(struct threadpool_task) * tp->qsize);
       tp->qsize <<= 1;
     }
     t.routine = routine;
@@ -134,20 +226,15 @@ int threadpool_add(struct threadpool *tp, void (*routine)(void *), void *arg) {
     size_t i, mask;
     mask = tp->qsize - 1;
     if(tp->qcount == tp->qsize) {
-      if(tp->qsize == ~(((size_t)-1) >> 1)) {
-        ret = ENOMEM;
-        goto out;
-      }
+      if(tp->qsize == ~(((size_t)-1) >> 1)) return ENOMEM;
       task = malloc(sizeof(struct threadpool_task) * (tp->qsize << 1));
-      if(task == NULL) {
-        ret = errno;
-        goto out;
-      }
+      if(task == NULL) return errno;
       for(i = 0; i < tp->qsize; ++i) {
         task[i] = tp->q[(tp->qhead + i) & mask];
       }
       free(tp->q);
       tp->q = task;
+      memacct_add(MEMACCT_QUEUE, sizeof(struct threadpool_task) * tp->qsize);
       tp->qsize <<= 1;
       tp->qhead = 0;
       mask = tp->qsize - 1;
@@ -156,13 +243,203 @@ int threadpool_add(struct threadpool *tp, void (*routine)(void *), void *arg) {
   }
   task->routine = routine;
   task->arg = arg;
-  if(tp->qcount++ == 0)
-    pthread_cond_signal(&tp->consumer);
+queued:
+  threadpool_queued(tp, &tp->classes[0]);
+  return 0;
+}
+
+/**
+ * Wake enough sleeping threads of cls to take the tasks queued for it that
+ * its spinning threads and the threads already signalled will not.  Must be
+ * called with tp->mutex held.
+ */
+static void threadpool_wake(struct threadpool_class *cls) {
+  size_t pending = cls->spinning + cls->signalled, n;
+
+  if(cls->qcount <= pending) return;
+  n = cls->qcount - pending;
+  if(n >= cls->idle - cls->signalled) {
+    cls->signalled = cls->idle;
+    pthread_cond_broadcast(&cls->consumer);
+  } else {
+    cls->signalled += n;
+    while(n--) pthread_cond_signal(&cls->consumer);
+  }
+}
+
+int threadpool_add(struct threadpool *tp, void (*routine)(void *), void *arg) {
+  return threadpool_add_key(tp, routine, arg, 0);
+}
+
+int threadpool_add_key(struct threadpool *tp, void (*routine)(void *), void *arg, unsigned key) {
+  int rc, ret = 0;
+
+  rc = pthread_mutex_lock(&tp->mutex);
+  if(rc) return rc;
+  if(tp->stop) {
+    ret = EINVAL;
+    goto out;
+  }
+  if(tp->qmax) {
+    while(tp->qcount == tp->qmax) {
+      pthread_cond_wait(&tp->producer, &tp->mutex);
+    }
+  }
+  ret = threadpool_push(tp, routine, arg, key);
+  if(ret) goto out;
+  threadpool_wake(&tp->classes[0]);
+out:
+  pthread_mutex_unlock(&tp->mutex);
+  return ret;
+}
+
+// wake threads for the tasks queued for each class since its last wakeup
+static void threadpool_wake_classes(struct threadpool *tp, size_t *n) {
+  size_t c;
+
+  for(c = 0; c < tp->nclasses; ++c) {
+    if(n[c]) threadpool_wake(&tp->classes[c]);
+    n[c] = 0;
+  }
+}
+
+int threadpool_add_nodes(struct threadpool *tp, struct threadpool_node *nodes) {
+  int rc, ret = 0;
+  struct threadpool_node *node, *next;
+  struct threadpool_class *cls;
+  size_t n[THREADPOOL_MAX_CLASSES] = {0};
+
+  assert(tp->nbuckets);
+  rc = pthread_mutex_lock(&tp->mutex);
+  if(rc) return rc;
+  if(tp->stop) {
+    ret = EINVAL;
+    goto out;
+  }
+  for(node = nodes; node; node = next) {
+    next = node->next;
+    if(tp->qmax && tp->qcount == tp->qmax) {
+      // let the consumers at what has been queued so far before waiting
+      threadpool_wake_classes(tp, n);
+      while(tp->qcount == tp->qmax) {
+        pthread_cond_wait(&tp->producer, &tp->mutex);
+      }
+    }
+    assert(node->key < tp->nbuckets);
+    assert(node->cls < tp->nclasses);
+    cls = &tp->classes[node->cls];
+    node->pooled = 0;
+    threadpool_bucket_push(cls, node);
+    threadpool_queued(tp, cls);
+    ++n[node->cls];
+  }
+  threadpool_wake_classes(tp, n);
 out:
   pthread_mutex_unlock(&tp->mutex);
   return ret;
 }
 
+void threadpool_group_init(struct threadpool_group *g, struct threadpool_group *parent) {
+  g->count = 1;
+  g->parent = parent;
+  g->continuation = NULL;
+  if(parent) threadpool_group_hold(parent, 1);
+}
+
+void threadpool_group_hold(struct threadpool_group *g, size_t n) {
+  __atomic_add_fetch(&g->count, n, __ATOMIC_RELAXED);
+}
+
+void threadpool_group_continue(struct threadpool_group *g, struct threadpool_node *continuation) {
+  g->continuation = continuation;
+}
+
+int threadpool_group_add(struct threadpool *tp, struct threadpool_group *g, struct threadpool_node *nodes) {
+  struct threadpool_node *node;
+  size_t n = 0;
+  int rc;
+
+  for(node = nodes; node; node = node->next) {
+    node->group = g;
+    ++n;
+  }
+  if(n == 0) return 0;
+  threadpool_group_hold(g, n);
+  rc = threadpool_add_nodes(tp, nodes);
+  if(rc) __atomic_sub_fetch(&g->count, n, __ATOMIC_RELAXED);
+  return rc;
+}
+
+/**
+ * Drop a hold on g and on each parent whose count reaches zero with it.
+ * With run set, the first continuation reached is run here, not queued.
+ */
+static void threadpool_group_drop(struct threadpool *tp, struct threadpool_group *g, int run) {
+  struct threadpool_group *parent;
+  struct threadpool_node *c;
+
+  while(g && __atomic_sub_fetch(&g->count, 1, __ATOMIC_ACQ_REL) == 0) {
+    // the continuation may free g
+    parent = g->parent;
+    c = g->continuation;
+    if(c) {
+      c->group = parent;
+      c->next = NULL;
+      if(!run && threadpool_add_nodes(tp, c) == 0) return;
+      // run it here, when asked or when the pool is stopping
+      (*c->routine)(c->arg);
+      run = 0;
+    }
+    g = parent;
+  }
+}
+
+void threadpool_group_release(struct threadpool *tp, struct threadpool_group *g) {
+  threadpool_group_drop(tp, g, 0);
+}
+
+void threadpool_group_finish(struct threadpool *tp, struct threadpool_group *g) {
+  threadpool_group_drop(tp, g, 1);
+}
+
+int threadpool_abandon(struct threadpool *tp, pthread_t thread) {
+  pthread_attr_t attr;
+  struct threadpool_class *cls;
+  size_t c, i;
+  int rc;
+
+  rc = pthread_attr_init(&attr);
+  if(rc) return rc;
+  if(tp->stacksize) {
+    rc = pthread_attr_setstacksize(&attr, tp->stacksize);
+    if(rc) goto out;
+  }
+
+  pthread_mutex_lock(&tp->mutex);
+  rc = ESRCH;
+  for(c = 0; c < tp->nclasses; ++c) {
+    cls = &tp->classes[c];
+    for(i = 0; i < cls->nthreads; ++i) {
+      if(pthread_equal(cls->threads[i], thread)) break;
+    }
+    if(i == cls->nthreads) continue;
+    pthread_detach(thread);
+    --tp->running;
+    rc = pthread_create(&cls->threads[i], &attr, threadpool_consumer, cls);
+    if(rc) {
+      // carry on with one less thread
+      cls->threads[i] = cls->threads[--cls->nthreads];
+      --tp->nthreads;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&tp->mutex);
+
+out:
+  pthread_attr_destroy(&attr);
+  return rc;
+}
+
 static inline int ilog2(size_t val) {
   int i;
   assert(val != 0);
@@ -171,63 +448,153 @@ static inline int ilog2(size_t val) {
   return i;
 }
 
-int threadpool_init(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax) {
-  return threadpool_init_prio(tp, nthreads, stacksize, qmax, NULL);
+// stop the threads started so far; must be called with tp->mutex held
+static void threadpool_stop(struct threadpool *tp) {
+  size_t c, i;
+
+  tp->stop = 1;
+  for(c = 0; c < tp->nclasses; ++c) {
+    pthread_cond_broadcast(&tp->classes[c].consumer);
+  }
+  pthread_mutex_unlock(&tp->mutex);
+  for(c = 0; c < tp->nclasses; ++c) {
+    for(i = 0; i < tp->classes[c].nthreads; ++i) {
+      pthread_join(tp->classes[c].threads[i], NULL);
+    }
+  }
 }
 
-int threadpool_init_prio(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax, int (*priority_cmp)(const struct threadpool_task *, const struct threadpool_task *)) {
+static void threadpool_free_classes(struct threadpool *tp) {
+  struct threadpool_class *cls;
+  struct threadpool_node *node, *next;
+  size_t c, b;
+
+  for(c = 0; c < tp->nclasses; ++c) {
+    cls = &tp->classes[c];
+    // a class can be left with tasks that another class queued after its
+    // threads exited; the nodes the pool allocated are its to free
+    for(b = 0; cls->buckets && b < tp->nbuckets; ++b) {
+      for(node = cls->buckets[b].head; node; node = next) {
+        next = node->next;
+        if(node->pooled) {
+          memacct_add(MEMACCT_QUEUE, -(ssize_t) sizeof(struct threadpool_node));
+          free(node);
+        }
+      }
+    }
+    pthread_cond_destroy(&cls->consumer);
+    free(cls->threads);
+    free(cls->bucket_bits);
+    free(cls->buckets);
+  }
+  tp->nclasses = 0;
+}
+
+static int threadpool_init_common(
+  struct threadpool *tp,
+  const size_t *nthreads,
+  size_t nclasses,
+  size_t stacksize,
+  size_t qmax,
+  int (*priority_cmp)(const struct threadpool_task *, const struct threadpool_task *),
+  size_t nbuckets
+) {
   pthread_attr_t attr;
-  int i, rc;
+  struct threadpool_class *cls;
+  long ncpus;
+  size_t c, i;
+  int rc;
 
-  assert(nthreads > 0);
+  assert(nclasses > 0 && nclasses <= THREADPOOL_MAX_CLASSES);
+  assert(nclasses == 1 || nbuckets > 0);
+  assert(nbuckets <= THREADPOOL_MAX_BUCKETS);
 
   rc = pthread_mutex_init(&tp->mutex, NULL);
   if(rc) goto err0;
   rc = pthread_cond_init(&tp->producer, NULL);
   if(rc) goto err1;
-  rc = pthread_cond_init(&tp->consumer, NULL);
-  if(rc) goto err2;
 
   rc = pthread_attr_init(&attr);
-  if(rc) goto err3;
+  if(rc) goto err2;
   if(stacksize) {
     rc = pthread_attr_setstacksize(&attr, stacksize);
-    if(rc) goto err4;
+    if(rc) goto err3;
   }
 
   tp->stop = 0;
-  tp->nthreads = nthreads;
+  tp->nthreads = 0;
+  tp->stacksize = stacksize;
   tp->running = 0;
+  tp->spinning = 0;
+  tp->spin = THREADPOOL_SPIN;
+  // spinning only pays while another CPU is free to queue the next task
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  tp->max_spinning = ncpus > 1 ? ncpus - 1 : 0;
   tp->priority_cmp = priority_cmp;
   tp->qsize = qmax == 0 ? 8 : 1 << (ilog2(qmax-1)+1);
   tp->qhead = 0;
   tp->qcount = 0;
   tp->qmax = qmax;
   tp->q = malloc(sizeof(struct threadpool_task) * tp->qsize);
-  if(!tp->q) goto err4;
-  tp->threads = malloc(sizeof(pthread_t) * nthreads);
-  if(!tp->threads) goto err5;
+  if(!tp->q) {
+    rc = ENOMEM;
+    goto err3;
+  }
+  memacct_add(MEMACCT_QUEUE, sizeof(struct threadpool_task) * tp->qsize);
+  tp->nbuckets = nbuckets;
+  tp->nclasses = 0;
+  for(c = 0; c < nclasses; ++c) {
+    assert(nthreads[c] > 0);
+    cls = &tp->classes[c];
+    cls->tp = tp;
+    cls->nthreads = 0;
+    cls->idle = 0;
+    cls->signalled = 0;
+    cls->spinning = 0;
+    cls->qcount = 0;
+    cls->bucket_summary = 0;
+    cls->threads = malloc(sizeof(pthread_t) * nthreads[c]);
+    cls->buckets = NULL;
+    cls->bucket_bits = NULL;
+    if(nbuckets) {
+      cls->buckets = calloc(nbuckets, sizeof(struct threadpool_bucket));
+      cls->bucket_bits = calloc((nbuckets + 63) >> 6, sizeof(uint64_t));
+    }
+    if(!cls->threads || (nbuckets && (!cls->buckets || !cls->bucket_bits))) {
+      rc = ENOMEM;
+    } else {
+      rc = pthread_cond_init(&cls->consumer, NULL);
+    }
+    if(rc) {
+      free(cls->threads);
+      free(cls->bucket_bits);
+      free(cls->buckets);
+      goto err4;
+    }
+    ++tp->nclasses;
+  }
   pthread_mutex_lock(&tp->mutex);
-  for(i = 0; i < nthreads; ++i) {
-    rc = pthread_create(&tp->threads[i], &attr, threadpool_consumer, tp);
-    if(rc) goto err6;
+  for(c = 0; c < nclasses; ++c) {
+    cls = &tp->classes[c];
+    for(i = 0; i < nthreads[c]; ++i) {
+      rc = pthread_create(&cls->threads[i], &attr, threadpool_consumer, cls);
+      if(rc) goto err5;
+      ++cls->nthreads;
+      ++tp->nthreads;
+    }
   }
   pthread_mutex_unlock(&tp->mutex);
+  pthread_attr_destroy(&attr);
   return 0;
 
-err6:
-  pthread_mutex_unlock(&tp->mutex);
-  for(--i; i >= 0; --i) {
-    pthread_cancel(tp->threads[i]);
-    pthread_join(tp->threads[i], NULL);
-  }
-  free(tp->threads);
 err5:
-  free(tp->q);
+  threadpool_stop(tp);
 err4:
-  pthread_attr_destroy(&attr);
+  threadpool_free_classes(tp);
+  memacct_add(MEMACCT_QUEUE, -(ssize_t) (sizeof(struct threadpool_task) * tp->qsize));
+  free(tp->q);
 err3:
-  pthread_cond_destroy(&tp->consumer);
+  pthread_attr_destroy(&attr);
 err2:
   pthread_cond_destroy(&tp->producer);
 err1:
@@ -236,22 +603,36 @@ err0:
   return rc;
 }
 
-int threadpool_destroy(struct threadpool *tp) {
-  int i, rc;
+int threadpool_init(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax) {
+  return threadpool_init_common(tp, &nthreads, 1, stacksize, qmax, NULL, 0);
+}
 
+int threadpool_init_prio(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax, int (*priority_cmp)(const struct threadpool_task *, const struct threadpool_task *)) {
+  return threadpool_init_common(tp, &nthreads, 1, stacksize, qmax, priority_cmp, 0);
+}
+
+int threadpool_init_buckets(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax, size_t nbuckets) {
+  return threadpool_init_common(tp, &nthreads, 1, stacksize, qmax, NULL, nbuckets);
+}
+
+int threadpool_init_classes(struct threadpool *tp, const size_t *nthreads, size_t nclasses, size_t stacksize, size_t qmax, size_t nbuckets) {
+  return threadpool_init_common(tp, nthreads, nclasses, stacksize, qmax, NULL, nbuckets);
+}
+
+void threadpool_set_spin(struct threadpool *tp, size_t spin) {
   pthread_mutex_lock(&tp->mutex);
-  tp->stop = 1;
-  pthread_cond_broadcast(&tp->consumer);
+  tp->spin = spin;
   pthread_mutex_unlock(&tp->mutex);
+}
 
-  for(i = 0; i < tp->nthreads; ++i) {
-    rc = pthread_join(tp->threads[i], NULL);
-    if(rc) return rc;
-  }
-  free(tp->threads);
+int threadpool_destroy(struct threadpool *tp) {
+  int rc;
+
+  pthread_mutex_lock(&tp->mutex);
+  threadpool_stop(tp);
+  threadpool_free_classes(tp);
+  memacct_add(MEMACCT_QUEUE, -(ssize_t) (sizeof(struct threadpool_task) * tp->qsize));
   free(tp->q);
-  rc = pthread_cond_destroy(&tp->consumer);
-  if(rc) return rc;
   rc = pthread_cond_destroy(&tp->producer);
   if(rc) return rc;
   rc = pthread_mutex_destroy(&tp->mutex);
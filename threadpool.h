@@ -37,12 +37,95 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <stdint.h>
+
+/// largest number of priority levels for threadpool_init_buckets()
+#define THREADPOOL_MAX_BUCKETS 4096
+
+/// most worker classes for threadpool_init_classes()
+#define THREADPOOL_MAX_CLASSES 4
+
+/// how many times an idle thread checks the queue before sleeping by default
+#define THREADPOOL_SPIN 200
 
 struct threadpool_task {
   void (*routine)(void *);
   void *arg;
 };
 
+/**
+ * A task queued by threadpool_add_nodes().  The node is owned by the caller,
+ * usually embedded in the object that arg points to, so that queueing it
+ * allocates nothing.  It must stay valid until routine is called.
+ */
+struct threadpool_node {
+  struct threadpool_node *next;
+  void (*routine)(void *);
+  void *arg;
+  /// priority, for a threadpool made by threadpool_init_buckets()
+  unsigned key;
+  /// worker class to run it, for a threadpool made by threadpool_init_classes()
+  unsigned cls;
+  /// non-zero if the threadpool allocated the node and frees it
+  int pooled;
+  /// group released once routine returns, or NULL
+  struct threadpool_group *group;
+};
+
+/**
+ * A count of tasks and holds outstanding.  When it drops to zero, the
+ * group's continuation, if any, is queued as a member of the parent group,
+ * so a parent group does not finish before the continuations of the groups
+ * nested in it have run.
+ */
+struct threadpool_group {
+  /// updated atomically
+  size_t count;
+  struct threadpool_group *parent;
+  struct threadpool_node *continuation;
+};
+
+/// a FIFO list of the tasks with one priority
+struct threadpool_bucket {
+  struct threadpool_node *head;
+  struct threadpool_node *tail;
+};
+
+/**
+ * The threads of one class of worker and the tasks queued for them.
+ */
+struct threadpool_class {
+  struct threadpool *tp;
+
+  /// wakes consumer when signaled
+  pthread_cond_t consumer;
+
+  /// number of threads
+  size_t nthreads;
+
+  /// thread array
+  pthread_t *threads;
+
+  /// number of threads waiting for a task
+  size_t idle;
+
+  /// number of waiting threads signalled that have not yet woken
+  size_t signalled;
+
+  /// number of threads checking the queue before they wait
+  size_t spinning;
+
+  /// number of tasks queued, written atomically
+  size_t qcount;
+
+  /// with priority buckets, one queue per priority, highest served first
+  struct threadpool_bucket *buckets;
+
+  /// bit per non-empty bucket, and bit per non-zero word of bucket_bits
+  uint64_t *bucket_bits;
+  uint64_t bucket_summary;
+};
+
 struct threadpool {
   /// mutex
   pthread_mutex_t mutex;
@@ -50,38 +133,129 @@ struct threadpool {
   /// wakes producer when signaled
   pthread_cond_t producer;
 
-  /// wakes consumer when signaled
-  pthread_cond_t consumer;
-
   /// non-zero when stopping
   int stop;
 
-  /// number of threads
+  /// number of threads in all classes
   size_t nthreads;
 
+  /// stack size of each thread, 0 for the default
+  size_t stacksize;
+
   /// number of tasks currently running
   size_t running;
 
-  /// thread array
-  pthread_t *threads;
+  /// number of threads checking the queue before they wait
+  size_t spinning;
+
+  /// how many times an idle thread checks the queue before it waits
+  size_t spin;
+
+  /// most threads that spin at once, one fewer than the number of CPUs
+  size_t max_spinning;
 
   int (*priority_cmp)(const struct threadpool_task *, const struct threadpool_task *);
 
-  /// task queue
+  /// task queue, without priority buckets
   struct threadpool_task *q;
   size_t qsize;
   size_t qhead;
+
+  /// number of tasks queued for all classes
   size_t qcount;
   size_t qmax;
+
+  /// number of priorities, or 0 without priority buckets
+  size_t nbuckets;
+
+  /// worker classes, only the first unless made by threadpool_init_classes()
+  struct threadpool_class classes[THREADPOOL_MAX_CLASSES];
+  size_t nclasses;
 };
 
 /// initialize a threadpool
 int threadpool_init(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax);
 int threadpool_init_prio(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax, int (*priority_cmp)(const struct threadpool_task *, const struct threadpool_task *));
 
+/**
+ * Initialize a threadpool whose tasks are given an integer priority from 0
+ * to nbuckets - 1 (at most THREADPOOL_MAX_BUCKETS) by threadpool_add_key().
+ * Higher priorities run first, and tasks of the same priority run in the
+ * order they were added.  Adding or taking a task costs a few instructions,
+ * unlike threadpool_init_prio() which calls priority_cmp O(log n) times.
+ */
+int threadpool_init_buckets(struct threadpool *tp, size_t nthreads, size_t stacksize, size_t qmax, size_t nbuckets);
+
+/**
+ * Initialize a threadpool as threadpool_init_buckets() does, but with
+ * nclasses (at most THREADPOOL_MAX_CLASSES) classes of worker.  Class i has
+ * nthreads[i] threads of its own, which run only the nodes whose cls is i,
+ * so that long tasks in one class do not hold up the tasks of another.
+ * threadpool_add() and threadpool_add_key() add to class 0.
+ */
+int threadpool_init_classes(struct threadpool *tp, const size_t *nthreads, size_t nclasses, size_t stacksize, size_t qmax, size_t nbuckets);
+
+/**
+ * Set how many times an idle thread checks the queue for a new task before
+ * it sleeps.  Spinning saves the wakeup when tasks are short and come in
+ * quick succession; 0 sleeps at once.  The default is THREADPOOL_SPIN.  At
+ * most one thread fewer than there are CPUs spins at a time.
+ */
+void threadpool_set_spin(struct threadpool *tp, size_t spin);
+
 /// add a task to a threadpool
 int threadpool_add(struct threadpool *tp, void (*routine)(void *), void *arg);
 
+/// add a task with a priority to a threadpool made by threadpool_init_buckets()
+int threadpool_add_key(struct threadpool *tp, void (*routine)(void *), void *arg, unsigned key);
+
+/**
+ * Add the list of nodes linked by their next pointers to a threadpool made
+ * by threadpool_init_buckets(), under one lock and without allocating.
+ * Either all of the nodes are queued or, if an error is returned, none.
+ * Each node's cls must be set, and its group, to NULL or to a group that
+ * already counts the node.
+ */
+int threadpool_add_nodes(struct threadpool *tp, struct threadpool_node *nodes);
+
+/**
+ * Initialize a group holding one hold for its creator, nested in parent
+ * (which may be NULL).  The parent gets a hold until this group finishes.
+ */
+void threadpool_group_init(struct threadpool_group *g, struct threadpool_group *parent);
+
+/// add n holds to a group, each to be dropped by threadpool_group_release()
+void threadpool_group_hold(struct threadpool_group *g, size_t n);
+
+/**
+ * Set the node queued when the group's count reaches zero.  The node must
+ * not be in use by then.  It may be set any time before the last hold is
+ * dropped.
+ */
+void threadpool_group_continue(struct threadpool_group *g, struct threadpool_node *continuation);
+
+/**
+ * Add the list of nodes as in threadpool_add_nodes(), each as a member of
+ * g, which is released as each of their routines returns.
+ */
+int threadpool_group_add(struct threadpool *tp, struct threadpool_group *g, struct threadpool_node *nodes);
+
+/// drop a hold on a group, queueing its continuation if it was the last
+void threadpool_group_release(struct threadpool *tp, struct threadpool_group *g);
+
+/**
+ * Drop the creator's hold on a group.  If it was the last, the continuation
+ * is run in the calling thread rather than queued.
+ */
+void threadpool_group_finish(struct threadpool *tp, struct threadpool_group *g);
+
+/**
+ * Give up on a thread that is blocked running a task.  The thread is
+ * detached and replaced by a new one.  It must not return to the pool when
+ * the task finally unblocks; it should call pthread_exit() instead.
+ */
+int threadpool_abandon(struct threadpool *tp, pthread_t thread);
+
 /// stop and destroy a threadpool object
 int threadpool_destroy(struct threadpool *tp);
 
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "toolopts.h"
+#include "memacct.h"
+#include "threadpool.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// the deferred method is given the traversal's arg, not the toolopts
+static struct toolopts *toolopts_current;
+
+static void toolopts_deferred(void *arg, const char *path) {
+  struct toolopts *o = toolopts_current;
+  char **deferred, *p;
+
+  p = strdup(path);
+  deferred = realloc(o->deferred, (o->deferred_count + 1) * sizeof(char *));
+  if(!p || !deferred) {
+    perror(path);
+    exit(1);
+  }
+  deferred[o->deferred_count++] = p;
+  o->deferred = deferred;
+}
+
+void toolopts_init(struct toolopts *o, int flags, size_t threads) {
+  memset(o, 0, sizeof(*o));
+  o->flags = flags;
+  o->threads = threads;
+  o->stacksize = TOOLOPTS_STACKSIZE;
+  o->tune = 1;
+  o->inode_order = -1;
+  o->file_tasks = -1;
+  toolopts_current = o;
+}
+
+void toolopts_usage(const struct toolopts *o, FILE *file) {
+  fprintf(file,
+    "      --hotspots[=K]  Report the K slowest operations (default %d)\n"
+    "      --rate=N        Perform at most N metadata operations per second\n"
+    "      --rate-file=F   Read --rate from F, and again on SIGHUP\n"
+    , TOOLOPTS_DEFAULT_HOTSPOTS);
+  if(o->flags & TOOLOPTS_RETRY) {
+    fprintf(file,
+      "      --watchdog=S    Defer paths whose stat or read takes over S seconds,\n"
+      "                      and retry them at the end\n");
+  } else {
+    fprintf(file,
+      "      --watchdog=S    Skip paths whose stat or read takes over S seconds\n");
+  }
+  if(o->flags & TOOLOPTS_SEEDS) {
+    fprintf(file,
+      "      --seed-file=F   Only walk the directories listed in F\n");
+  }
+  fprintf(file,
+    "      --no-tune       Do not tune settings to the file system type\n"
+    "      --tune-file=F   Read file system tuning profiles from F\n"
+    "      --inode-order=B Stat directory entries in inode order (yes or no,\n"
+    "                      default as tuned for the file system)\n"
+    "      --file-tasks=B  Give each file its own task (yes or no, default as\n"
+    "                      tuned for the file system)\n"
+    "      --readdir-buffer=N\n"
+    "                      Read directories N bytes at a time (K, M, G suffixes)\n"
+    "      --stack-size=N  Give each thread an N byte stack (default 2M, min 64K)\n"
+    "      --spin=N        Check for work N times before an idle thread sleeps\n"
+    "                      (default %d, 0 to sleep at once)\n"
+    "      --memory-report Report memory use by category at exit and on SIGUSR1\n"
+    , THREADPOOL_SPIN);
+  if(o->flags & TOOLOPTS_COSTS) {
+    fprintf(file,
+      "      --cost-file=F   Start the subtrees that were slowest in the last run\n"
+      "                      first, and save the costs of this run to F\n");
+  }
+}
+
+int toolopts_parse(struct toolopts *o, int opt, const char *arg) {
+  int n;
+
+  switch(opt) {
+  case 'j':
+    n = atoi(arg);
+    if(n <= 0) {
+      fprintf(stderr, "Error: number of threads (-j) must be a positive integer\n");
+      exit(2);
+    }
+    o->threads = n;
+    o->tune_keep |= FSTUNE_KEEP_THREADS;
+    return 1;
+  case TOOLOPTS_OPT_NO_TUNE:
+    o->tune = 0;
+    return 1;
+  case TOOLOPTS_OPT_TUNE_FILE:
+    o->tune_file = arg;
+    return 1;
+  case TOOLOPTS_OPT_INODE_ORDER:
+    if(fstune_parse_bool(arg, &o->inode_order)) {
+      fprintf(stderr, "Error: --inode-order must be yes or no\n");
+      exit(2);
+    }
+    o->tune_keep |= FSTUNE_KEEP_INODE_ORDER;
+    return 1;
+  case TOOLOPTS_OPT_FILE_TASKS:
+    if(fstune_parse_bool(arg, &o->file_tasks)) {
+      fprintf(stderr, "Error: --file-tasks must be yes or no\n");
+      exit(2);
+    }
+    o->tune_keep |= FSTUNE_KEEP_FILE_TASKS;
+    return 1;
+  case TOOLOPTS_OPT_COST_FILE:
+    o->cost_file = arg;
+    return 1;
+  case TOOLOPTS_OPT_MEMORY_REPORT:
+    memacct_enable();
+    memacct_report_on_signal(SIGUSR1);
+    return 1;
+  case TOOLOPTS_OPT_STACK_SIZE:
+    if(fstune_parse_stacksize(arg, &o->stacksize)) {
+      fprintf(stderr, "Error: invalid stack size: %s\n", arg);
+      exit(2);
+    }
+    return 1;
+  case TOOLOPTS_OPT_SPIN:
+    if(fstune_parse_spin(arg, &o->options.spin)) {
+      fprintf(stderr, "Error: invalid spin count: %s\n", arg);
+      exit(2);
+    }
+    return 1;
+  case TOOLOPTS_OPT_READDIR_BUFFER:
+    if(fstune_parse_size(arg, &o->options.readdir_buffer_size)) {
+      fprintf(stderr, "Error: invalid readdir buffer size: %s\n", arg);
+      exit(2);
+    }
+    o->tune_keep |= FSTUNE_KEEP_READDIR_BUFFER;
+    return 1;
+  case TOOLOPTS_OPT_HOTSPOTS:
+    n = arg ? atoi(arg) : TOOLOPTS_DEFAULT_HOTSPOTS;
+    if(n <= 0) {
+      fprintf(stderr, "Error: number of hotspots must be a positive integer\n");
+      exit(2);
+    }
+    o->hotspots_count = n;
+    return 1;
+  case TOOLOPTS_OPT_RATE:
+    o->rate = atof(arg);
+    if(o->rate < 0) {
+      fprintf(stderr, "Error: rate must be a non-negative number\n");
+      exit(2);
+    }
+    return 1;
+  case TOOLOPTS_OPT_RATE_FILE:
+    o->rate_file = arg;
+    return 1;
+  case TOOLOPTS_OPT_WATCHDOG:
+    o->options.watchdog_timeout = atof(arg);
+    if(o->options.watchdog_timeout <= 0) {
+      fprintf(stderr, "Error: watchdog timeout must be a positive number\n");
+      exit(2);
+    }
+    o->options.deferred_method = toolopts_deferred;
+    return 1;
+  case TOOLOPTS_OPT_SEED_FILE:
+    if(o->seeds) seeds_free(o->seeds);
+    o->seeds = seeds_load(arg);
+    if(!o->seeds) {
+      perror(arg);
+      exit(2);
+    }
+    o->options.seeds = o->seeds;
+    return 1;
+  }
+  return 0;
+}
+
+void toolopts_setup(struct toolopts *o, const char *arg0) {
+  int rc;
+
+  if(o->tune) {
+    rc = fstune_init(&o->fstune, o->tune_file);
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", o->tune_file ? o->tune_file : FSTUNE_CONFIG_FILE, strerror(rc));
+      exit(2);
+    }
+  }
+
+  if(o->cost_file) {
+    rc = costs_init(&o->costs);
+    if(rc == 0) {
+      rc = costs_load(&o->costs, o->cost_file);
+      if(rc == ENOENT) rc = 0;
+    }
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", o->cost_file, strerror(rc));
+      exit(2);
+    }
+    o->options.costs = &o->costs;
+  }
+
+  if(o->hotspots_count) {
+    rc = hotspots_init(&o->hotspots, o->hotspots_count);
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", arg0, strerror(rc));
+      exit(2);
+    }
+    o->options.hotspots = &o->hotspots;
+  }
+
+  if(o->rate > 0 || o->rate_file) {
+    rc = ratelimit_init(&o->ratelimit, o->rate, o->rate_file);
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", o->rate_file ? o->rate_file : "rate", strerror(rc));
+      exit(2);
+    }
+    if(o->rate_file) ratelimit_reload_on_signal(&o->ratelimit, SIGHUP);
+    o->options.ratelimit = &o->ratelimit;
+  }
+}
+
+void toolopts_tune(
+  struct toolopts *o,
+  const char *path,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+) {
+  fstune_tune(o->tune ? &o->fstune : NULL, o->tune_keep, path, nthreads, config, options);
+  if(o->inode_order == 1) *config |= MTPT_CONFIG_INODE_ORDER;
+  else if(o->inode_order == 0) *config &= ~MTPT_CONFIG_INODE_ORDER;
+  if(o->file_tasks == 1) *config |= MTPT_CONFIG_FILE_TASKS;
+  else if(o->file_tasks == 0) *config &= ~MTPT_CONFIG_FILE_TASKS;
+}
+
+void toolopts_forget_deferred(struct toolopts *o, size_t from) {
+  size_t i;
+
+  for(i = from; i < o->deferred_count; ++i) {
+    free(o->deferred[i]);
+  }
+  o->deferred_count = from;
+}
+
+int toolopts_finish(struct toolopts *o) {
+  size_t i;
+  int rc, ret = 0;
+
+  if(o->options.hotspots) {
+    hotspots_print(&o->hotspots, stderr);
+    hotspots_destroy(&o->hotspots);
+  }
+  if(memacct_enabled) memacct_report(STDERR_FILENO);
+  if(o->options.ratelimit) ratelimit_destroy(&o->ratelimit);
+  if(o->tune) fstune_destroy(&o->fstune);
+  if(o->options.costs) {
+    rc = costs_save(&o->costs, o->cost_file);
+    if(rc) {
+      fprintf(stderr, "%s: %s\n", o->cost_file, strerror(rc));
+      ret = 1;
+    }
+    costs_destroy(&o->costs);
+  }
+  for(i = 0; i < o->deferred_count; ++i) {
+    fprintf(stderr, "%s: skipped because the watchdog timed out\n", o->deferred[i]);
+    free(o->deferred[i]);
+  }
+  free(o->deferred);
+  if(o->deferred_count) ret = 1;
+  if(o->seeds) seeds_free(o->seeds);
+  return ret;
+}
@@ -0,0 +1,194 @@
+/**
+ * @file
+ * @author Scott Duckworth <sduckwo@clemson.edu>
+ * @brief  Command line options shared by the tools
+ *
+ * @section LICENSE
+ * Copyright (c) 2014, Clemson University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Clemson University nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TOOLOPTS_H
+#define TOOLOPTS_H
+
+#include "mtpt.h"
+#include "costs.h"
+#include "fstune.h"
+#include "hotspots.h"
+#include "ratelimit.h"
+#include "seeds.h"
+#include <getopt.h>
+#include <stdio.h>
+
+#define TOOLOPTS_DEFAULT_HOTSPOTS 10
+#define TOOLOPTS_STACKSIZE (2<<20) // 2 MB
+
+/// the options a tool takes besides the common ones, for toolopts_init()
+#define TOOLOPTS_SEEDS 0x1
+#define TOOLOPTS_COSTS 0x2
+/// the tool retries deferred paths itself, which --watchdog's help says
+#define TOOLOPTS_RETRY 0x4
+
+/// getopt_long() values of the long options, the tool's own coming after
+enum {
+  TOOLOPTS_OPT_HOTSPOTS = 256,
+  TOOLOPTS_OPT_RATE,
+  TOOLOPTS_OPT_RATE_FILE,
+  TOOLOPTS_OPT_WATCHDOG,
+  TOOLOPTS_OPT_SEED_FILE,
+  TOOLOPTS_OPT_NO_TUNE,
+  TOOLOPTS_OPT_TUNE_FILE,
+  TOOLOPTS_OPT_READDIR_BUFFER,
+  TOOLOPTS_OPT_STACK_SIZE,
+  TOOLOPTS_OPT_SPIN,
+  TOOLOPTS_OPT_MEMORY_REPORT,
+  TOOLOPTS_OPT_COST_FILE,
+  TOOLOPTS_OPT_INODE_ORDER,
+  TOOLOPTS_OPT_FILE_TASKS,
+  TOOLOPTS_OPT_END
+};
+
+/**
+ * Entries for a tool's getopt_long() options array: the common ones, and
+ * those for TOOLOPTS_SEEDS and TOOLOPTS_COSTS.
+ */
+#define TOOLOPTS_LONG_OPTIONS \
+  {"hotspots", optional_argument, NULL, TOOLOPTS_OPT_HOTSPOTS}, \
+  {"rate", required_argument, NULL, TOOLOPTS_OPT_RATE}, \
+  {"rate-file", required_argument, NULL, TOOLOPTS_OPT_RATE_FILE}, \
+  {"watchdog", required_argument, NULL, TOOLOPTS_OPT_WATCHDOG}, \
+  {"no-tune", no_argument, NULL, TOOLOPTS_OPT_NO_TUNE}, \
+  {"tune-file", required_argument, NULL, TOOLOPTS_OPT_TUNE_FILE}, \
+  {"inode-order", required_argument, NULL, TOOLOPTS_OPT_INODE_ORDER}, \
+  {"file-tasks", required_argument, NULL, TOOLOPTS_OPT_FILE_TASKS}, \
+  {"readdir-buffer", required_argument, NULL, TOOLOPTS_OPT_READDIR_BUFFER}, \
+  {"stack-size", required_argument, NULL, TOOLOPTS_OPT_STACK_SIZE}, \
+  {"spin", required_argument, NULL, TOOLOPTS_OPT_SPIN}, \
+  {"memory-report", no_argument, NULL, TOOLOPTS_OPT_MEMORY_REPORT}
+#define TOOLOPTS_SEEDS_LONG_OPTIONS \
+  {"seed-file", required_argument, NULL, TOOLOPTS_OPT_SEED_FILE}
+#define TOOLOPTS_COSTS_LONG_OPTIONS \
+  {"cost-file", required_argument, NULL, TOOLOPTS_OPT_COST_FILE}
+
+/**
+ * The settings of the common options, and what they set up.
+ */
+struct toolopts {
+  /// TOOLOPTS_* flags given to toolopts_init()
+  int flags;
+
+  /// -j, or the tool's default
+  size_t threads;
+
+  /// --stack-size
+  size_t stacksize;
+
+  /// passed to mtpt_opts(), pointing at the structures below once set up
+  mtpt_options_t options;
+
+  /// zero with --no-tune
+  int tune;
+
+  /// FSTUNE_KEEP_* flags for the settings given on the command line
+  int tune_keep;
+
+  /// --inode-order and --file-tasks: 1 for yes, 0 for no, -1 if not given
+  int inode_order;
+  int file_tasks;
+
+  const char *tune_file;
+  const char *cost_file;
+  const char *rate_file;
+  double rate;
+  size_t hotspots_count;
+
+  struct fstune fstune;
+  struct hotspots hotspots;
+  struct ratelimit ratelimit;
+  struct costs costs;
+  struct seeds *seeds;
+
+  /// paths the watchdog skipped, added to as the traversals go
+  char **deferred;
+  size_t deferred_count;
+};
+
+/**
+ * Sets the defaults, with threads for -j.  flags is a bitwise OR of
+ * TOOLOPTS_SEEDS, TOOLOPTS_COSTS and TOOLOPTS_RETRY.
+ */
+void toolopts_init(struct toolopts *o, int flags, size_t threads);
+
+/**
+ * Prints the help of the common long options.
+ */
+void toolopts_usage(const struct toolopts *o, FILE *file);
+
+/**
+ * Handles opt, a value returned by getopt_long(), if it is -j or one of the
+ * common long options.  An invalid argument is reported on stderr and exits
+ * with status 2.
+ *
+ * @return non-zero if opt was handled
+ */
+int toolopts_parse(struct toolopts *o, int opt, const char *arg);
+
+/**
+ * Loads the tuning profiles and the costs, and sets up the hotspots and the
+ * rate limit, once the options have been parsed.  Errors are reported on
+ * stderr and exit with status 2.
+ */
+void toolopts_setup(struct toolopts *o, const char *arg0);
+
+/**
+ * Tunes the settings for a traversal of path as fstune_tune() does, unless
+ * --no-tune was given, and then applies --inode-order and --file-tasks.
+ */
+void toolopts_tune(
+  struct toolopts *o,
+  const char *path,
+  size_t *nthreads,
+  int *config,
+  mtpt_options_t *options
+);
+
+/**
+ * Frees the deferred paths from index from on, which a retry has covered.
+ */
+void toolopts_forget_deferred(struct toolopts *o, size_t from);
+
+/**
+ * Reports the hotspots, the memory used and the deferred paths, saves the
+ * costs and frees everything toolopts_setup() set up.
+ *
+ * @return non-zero if paths were deferred or the costs could not be saved,
+ * which are reported on stderr
+ */
+int toolopts_finish(struct toolopts *o);
+
+#endif